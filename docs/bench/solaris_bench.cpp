@@ -0,0 +1,971 @@
+/**
+ * =================================================================================================
+ * SOLARIS - HOST BENCHMARK AND REPLAY HARNESS
+ * =================================================================================================
+ *
+ * Runs the firmware's DSP, power quality analysis, stream parsing, command sequencing,
+ * automation rules, forecaster and delta patch applier (../solaris_core.h) natively, replaying
+ * ADC captures and stream events, and reports throughput, per-sample cost and accuracy against
+ * the reference values of the waveform. The block kernel is checked for exactly the sums of
+ * pair-by-pair accumulation, and every applied patch for exactly the target image.
+ *
+ * BUILD AND RUN (from the repository root):
+ *   g++ -O2 -std=c++17 -o solaris_bench docs/bench/solaris_bench.cpp
+ *   (-O3 lets GCC vectorize the block kernel)
+ *   ./solaris_bench                                  # synthetic capture + built-in events
+ *   ./solaris_bench --capture dump.csv                # replay a recorded capture
+ *   ./solaris_bench --events docs/bench/stream_events.tsv
+ *   ./solaris_bench --write-capture synthetic.csv     # save the synthetic capture
+ *
+ * CAPTURE FORMAT (CSV): one "rawVoltage,rawCurrent" pair of ADC counts per line, taken at
+ * the firmware's per-channel rate. Lines starting with '#' are comments; a header line
+ *   # reference vrms=<V> irms=<A> p=<W> offset=<counts>
+ * supplies the values accuracy is measured against. Without it only throughput is reported.
+ *
+ * EVENTS FORMAT (TSV): path <TAB> payload [<TAB> presentHex <TAB> stateHex], one stream
+ * event per line as delivered by the /app/switchStates stream. The expected masks are
+ * optional; when present every replay is checked against them.
+ *
+ */
+
+#include "../solaris_core.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// ===== FIRMWARE CONSTANTS (keep in step with firmware.cpp) =====
+const float VREF = 3.3;
+const int ADC_MAX = 4095;
+const float CURRENT_CALIBRATION_FACTOR = 0.185;
+const float VOLTAGE_DIVIDER_RATIO = (47.0 + 10.0) / 10.0;
+const float VOLTAGE_CALIBRATION = 1.25;
+#define ADC_CHANNEL_RATE_HZ 10000
+#define MAINS_FREQUENCY_HZ 50
+#define RMS_WINDOW_SAMPLES (ADC_CHANNEL_RATE_HZ / MAINS_FREQUENCY_HZ * 10)
+
+const PowerScale SCALE = {
+  (VREF / ADC_MAX) * VOLTAGE_DIVIDER_RATIO * VOLTAGE_CALIBRATION,
+  (VREF / ADC_MAX) / CURRENT_CALIBRATION_FACTOR,
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// =======================================================================
+//   ADC CAPTURES
+// =======================================================================
+struct Capture {
+  std::vector<uint16_t> voltage;
+  std::vector<uint16_t> current;
+  bool haveReference = false;
+  float vrms = 0, irms = 0, power = 0, offset = VOLTAGE_MIDPOINT;
+};
+
+// Deterministic noise so runs are comparable.
+static uint32_t rngState = 12345;
+static float uniformNoise() {
+  rngState = rngState * 1664525u + 1013904223u;
+  return (rngState >> 8) / (float)(1 << 24);
+}
+static float gaussianNoise() {
+  float u1 = uniformNoise() + 1e-7f, u2 = uniformNoise();
+  return sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+static uint16_t toCounts(float value) {
+  long counts = lroundf(value);
+  if (counts < 0) counts = 0;
+  if (counts > ADC_MAX) counts = ADC_MAX;
+  return (uint16_t)counts;
+}
+
+// Two seconds of a distorted, lagging load: voltage with 5 % third harmonic, current 35
+// degrees behind with 8 % fifth harmonic, both with 1.5 counts of noise and quantized.
+// The harmonics share no order, so real power comes from the fundamentals alone.
+static Capture syntheticCapture() {
+  const float vPeak = 1400, iPeak = 1200, h3 = 0.05f, h5 = 0.08f;
+  const float lag = 35.0f * 3.14159265f / 180.0f, offset = 2071.0f, noise = 1.5f;
+  const float w = 2.0f * 3.14159265f * MAINS_FREQUENCY_HZ / ADC_CHANNEL_RATE_HZ;
+
+  Capture capture;
+  const int samples = ADC_CHANNEL_RATE_HZ * 2;
+  for (int n = 0; n < samples; n++) {
+    float v = vPeak * (sinf(w * n) + h3 * sinf(3 * w * n));
+    float i = iPeak * (sinf(w * n - lag) + h5 * sinf(5 * (w * n - lag)));
+    capture.voltage.push_back(toCounts(VOLTAGE_MIDPOINT + v + noise * gaussianNoise()));
+    capture.current.push_back(toCounts(offset + i + noise * gaussianNoise()));
+  }
+
+  const float currentScale = SCALE.ampsPerCount;
+  capture.haveReference = true;
+  capture.vrms = vPeak / sqrtf(2) * sqrtf(1 + h3 * h3) * SCALE.voltsPerCount;
+  capture.irms = iPeak / sqrtf(2) * sqrtf(1 + h5 * h5) * currentScale;
+  capture.power = vPeak * iPeak / 2 * cosf(lag) * SCALE.voltsPerCount * currentScale;
+  capture.offset = offset;
+  return capture;
+}
+
+static bool loadCapture(const char* path, Capture& capture) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    unsigned v, i;
+    if (line[0] == '#') {
+      float vrms, irms, power, offset;
+      if (sscanf(line, "# reference vrms=%f irms=%f p=%f offset=%f", &vrms, &irms, &power, &offset) == 4) {
+        capture.haveReference = true;
+        capture.vrms = vrms;
+        capture.irms = irms;
+        capture.power = power;
+        capture.offset = offset;
+      }
+    } else if (sscanf(line, "%u,%u", &v, &i) == 2) {
+      capture.voltage.push_back((uint16_t)v);
+      capture.current.push_back((uint16_t)i);
+    }
+  }
+  fclose(file);
+  return !capture.voltage.empty();
+}
+
+static bool writeCapture(const char* path, const Capture& capture) {
+  FILE* file = fopen(path, "w");
+  if (!file) return false;
+  fprintf(file, "# solaris capture, %d samples/s per channel\n", ADC_CHANNEL_RATE_HZ);
+  fprintf(file, "# reference vrms=%.5f irms=%.5f p=%.5f offset=%.2f\n", capture.vrms, capture.irms,
+          capture.power, capture.offset);
+  for (size_t n = 0; n < capture.voltage.size(); n++) {
+    fprintf(file, "%u,%u\n", capture.voltage[n], capture.current[n]);
+  }
+  fclose(file);
+  return true;
+}
+
+static float percentError(float measured, float reference) {
+  return reference != 0 ? 100.0f * (measured - reference) / reference : 0.0f;
+}
+
+// Replays the capture window by window, as samplerTask() does, with the offset calibrated.
+static void benchAccuracy(const Capture& capture) {
+  PowerAccumulator acc = {};
+  powerAccumulatorSetOffset(acc, capture.offset);
+
+  int windows = 0;
+  double sumV = 0, sumI = 0, sumP = 0;
+  float worstV = 0, worstI = 0, worstP = 0;
+  for (size_t n = 0; n < capture.voltage.size(); n++) {
+    if (!powerAccumulate(acc, capture.voltage[n], capture.current[n], false, RMS_WINDOW_SAMPLES)) continue;
+    PowerWindow w = powerWindowResult(acc, SCALE);
+    windows++;
+    sumV += w.voltageRMS;
+    sumI += w.currentRMS;
+    sumP += w.realPower;
+    if (capture.haveReference) {
+      worstV = fmaxf(worstV, fabsf(percentError(w.voltageRMS, capture.vrms)));
+      worstI = fmaxf(worstI, fabsf(percentError(w.currentRMS, capture.irms)));
+      worstP = fmaxf(worstP, fabsf(percentError(w.realPower, capture.power)));
+    }
+  }
+  if (windows == 0) {
+    printf("accuracy: capture is shorter than one %d-sample window\n", RMS_WINDOW_SAMPLES);
+    return;
+  }
+
+  printf("accuracy over %d windows of %d samples\n", windows, RMS_WINDOW_SAMPLES);
+  printf("  %-12s %12s %12s %10s %10s\n", "", "measured", "reference", "mean err", "worst err");
+  const char* names[] = { "voltage V", "current A", "power W" };
+  const double means[] = { sumV / windows, sumI / windows, sumP / windows };
+  const float refs[] = { capture.vrms, capture.irms, capture.power };
+  const float worst[] = { worstV, worstI, worstP };
+  for (int k = 0; k < 3; k++) {
+    if (capture.haveReference) {
+      printf("  %-12s %12.4f %12.4f %9.3f%% %9.3f%%\n", names[k], means[k], refs[k],
+             percentError((float)means[k], refs[k]), worst[k]);
+    } else {
+      printf("  %-12s %12.4f %12s\n", names[k], means[k], "-");
+    }
+  }
+}
+
+// Loads off: the offset should converge on the true bias with the EMA time constant.
+static void benchOffsetTracking(const Capture& capture) {
+  PowerAccumulator acc = {};
+  powerAccumulatorSetOffset(acc, VOLTAGE_MIDPOINT);
+  const float target = capture.offset;
+  uint32_t settled = 0;
+  for (uint32_t n = 1; n <= 20u * (1 << OFFSET_EMA_SHIFT); n++) {
+    uint16_t idle = toCounts(target + 1.5f * gaussianNoise());
+    if (powerAccumulate(acc, VOLTAGE_MIDPOINT, idle, true, RMS_WINDOW_SAMPLES)) powerWindowResult(acc, SCALE);
+    if (fabsf(powerAccumulatorOffset(acc) - target) < 0.5f) {
+      if (!settled) settled = n;
+    } else {
+      settled = 0;
+    }
+  }
+  float start = fabsf(target - VOLTAGE_MIDPOINT);
+  float expected = start > 0.5f ? (1 << OFFSET_EMA_SHIFT) * logf(start / 0.5f) : 0;
+  printf("offset EMA: %.1f -> %.1f counts settled within 0.5 after %u samples (%.2f s), "
+         "first-order estimate %.0f\n",
+         (float)VOLTAGE_MIDPOINT, target, settled, settled / (float)ADC_CHANNEL_RATE_HZ, expected);
+}
+
+// Returns sample pairs per second.
+static double benchThroughput(const Capture& capture) {
+  PowerAccumulator acc = {};
+  powerAccumulatorSetOffset(acc, capture.offset);
+  volatile float sink = 0;
+  uint64_t pairs = 0;
+  const size_t length = capture.voltage.size();
+
+  Clock::time_point start = Clock::now();
+  double elapsed = 0;
+  while (elapsed < 1.0) {
+    for (size_t n = 0; n < length; n++) {
+      if (powerAccumulate(acc, capture.voltage[n], capture.current[n], false, RMS_WINDOW_SAMPLES)) {
+        sink = sink + powerWindowResult(acc, SCALE).realPower;
+      }
+    }
+    pairs += length;
+    elapsed = secondsSince(start);
+  }
+  printf("throughput: %.1f M sample pairs/s, %.2f ns per pair, %.0fx the %d Hz real-time rate\n",
+         pairs / elapsed / 1e6, elapsed * 1e9 / pairs, pairs / elapsed / ADC_CHANNEL_RATE_HZ,
+         ADC_CHANNEL_RATE_HZ);
+  return pairs / elapsed;
+}
+
+// The capture as samplerTask() hands it to the block kernel: centered int16 arrays.
+static void centerCapture(const Capture& capture, std::vector<int16_t>& v, std::vector<int16_t>& r) {
+  v.resize(capture.voltage.size());
+  r.resize(capture.current.size());
+  for (size_t n = 0; n < v.size(); n++) {
+    v[n] = (int16_t)(capture.voltage[n] - VOLTAGE_MIDPOINT);
+    r[n] = (int16_t)(capture.current[n] - CURRENT_BLOCK_BIAS);
+  }
+}
+
+// Feeds the capture through powerAccumulateBlock() in ragged blocks, with offsets that land
+// on every rounding case and a stretch of offset tracking, and requires the same integer
+// sums and windows as powerAccumulate() pair by pair. Then times full ADC-frame blocks.
+static void benchBlockKernel(const Capture& capture, double pairwisePerSecond) {
+  std::vector<int16_t> v, r;
+  centerCapture(capture, v, r);
+  const size_t length = v.size();
+  const uint32_t blockSizes[] = { 1, 7, 64, 300, 1000 };
+  const float offsets[] = { capture.offset, 2048.0f, 2047.99f, 1903.3f, 2213.0f / 3 };
+
+  int runs = 0, mismatches = 0;
+  for (float offset : offsets) {
+    for (uint32_t blockSize : blockSizes) {
+      for (int track = 0; track < 2; track++) {
+        PowerAccumulator pairwise = {}, block = {};
+        powerAccumulatorSetOffset(pairwise, offset);
+        powerAccumulatorSetOffset(block, offset);
+        bool same = true;
+        for (size_t n = 0; n < length && same;) {
+          uint32_t want = (uint32_t)((length - n < blockSize) ? length - n : blockSize);
+          bool tracking = track && (n / RMS_WINDOW_SAMPLES) % 2 == 0;
+          uint32_t taken = powerAccumulateBlock(block, &v[n], &r[n], want, tracking, RMS_WINDOW_SAMPLES);
+          for (uint32_t k = 0; k < taken; k++) {
+            powerAccumulate(pairwise, capture.voltage[n + k], capture.current[n + k], tracking, RMS_WINDOW_SAMPLES);
+          }
+          n += taken;
+          same = block.sumV2 == pairwise.sumV2 && block.sumI2 == pairwise.sumI2 && block.sumVI == pairwise.sumVI &&
+                 block.count == pairwise.count && block.currentOffsetQ16 == pairwise.currentOffsetQ16;
+          if (block.count >= RMS_WINDOW_SAMPLES) {
+            PowerWindow a = powerWindowResult(block, SCALE), b = powerWindowResult(pairwise, SCALE);
+            same = same && memcmp(&a, &b, sizeof(a)) == 0;
+          }
+        }
+        runs++;
+        if (!same) mismatches++;
+      }
+    }
+  }
+  printf("block kernel: %d runs against pair-by-pair accumulation, %s\n", runs,
+         mismatches ? "MISMATCH" : "identical sums and windows");
+  if (mismatches) printf("  %d runs differ\n", mismatches);
+
+  const uint32_t frameScans = 64; // ADC_FRAME_SCANS: samplerTask() runs one block per DMA frame
+  PowerAccumulator acc = {};
+  powerAccumulatorSetOffset(acc, capture.offset);
+  volatile float sink = 0;
+  uint64_t pairs = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed = 0;
+  while (elapsed < 1.0) {
+    for (size_t n = 0; n < length;) {
+      uint32_t want = (uint32_t)((length - n < frameScans) ? length - n : frameScans);
+      n += powerAccumulateBlock(acc, &v[n], &r[n], want, false, RMS_WINDOW_SAMPLES);
+      if (acc.count >= RMS_WINDOW_SAMPLES) sink = sink + powerWindowResult(acc, SCALE).realPower;
+    }
+    pairs += length;
+    elapsed = secondsSince(start);
+  }
+  printf("  %u-pair blocks: %.1f M sample pairs/s, %.2f ns per pair, %.1fx pair by pair\n", frameScans,
+         pairs / elapsed / 1e6, elapsed * 1e9 / pairs, pairs / elapsed / pairwisePerSecond);
+}
+
+// =======================================================================
+//   STREAM EVENTS
+// =======================================================================
+struct StreamEvent {
+  std::string path;
+  std::string payload;
+  bool haveExpected;
+  SwitchSnapshot expected;
+};
+
+// Same dispatch as streamCallback() in firmware.cpp, without touching the relays.
+static bool replayStreamEvent(const StreamEvent& event, SwitchSnapshot& out) {
+  int switchId = parseSwitchStatePath(event.path.c_str());
+  if (switchId > 0) {
+    out.present = 1u << switchId;
+    out.state = event.payload == "true" ? (1u << switchId) : 0;
+    return true;
+  }
+  uint32_t seq[MAX_SWITCH_ID + 1];
+  switchId = parseSwitchObjectPath(event.path.c_str());
+  if (switchId > 0 && parseSwitchObject(switchId, event.payload.c_str(), out, seq)) return true;
+  if (event.path == "/" && parseSwitchSnapshot(event.payload.c_str(), out, seq)) return true;
+  out.present = 0; // Rejected payloads are dropped whole
+  out.state = 0;
+  return false;
+}
+
+static std::string snapshotJson(int switches) {
+  std::string json = "{";
+  for (int id = 1; id <= switches; id++) {
+    char entry[96];
+    snprintf(entry, sizeof(entry), "%s\"%d\":{\"name\":\"Switch %d\",\"state\":%s,\"watts\":[40,60]}",
+             id > 1 ? "," : "", id, id, id % 3 ? "true" : "false");
+    json += entry;
+  }
+  return json + "}";
+}
+
+static SwitchSnapshot snapshotExpected(int switches) {
+  SwitchSnapshot s = { 0, 0 };
+  for (int id = 1; id <= switches; id++) {
+    s.present |= 1u << id;
+    if (id % 3) s.state |= 1u << id;
+  }
+  return s;
+}
+
+static std::vector<StreamEvent> builtInEvents() {
+  std::vector<StreamEvent> events;
+  events.push_back({ "/3/state", "true", true, { 1u << 3, 1u << 3 } });
+  events.push_back({ "/12/state", "false", true, { 1u << 12, 0 } });
+  events.push_back({ "/4/name", "\"Porch\"", true, { 0, 0 } });
+  events.push_back({ "/4", "{\"state\":false,\"seq\":812,\"issuedAt\":1760000000000}", true, { 1u << 4, 0 } });
+  events.push_back({ "/", snapshotJson(5), true, snapshotExpected(5) });
+  events.push_back({ "/", snapshotJson(31), true, snapshotExpected(31) });
+  return events;
+}
+
+static bool loadEvents(const char* path, std::vector<StreamEvent>& events) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+  char line[8192];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') continue;
+    char* payload = strchr(line, '\t');
+    if (!payload) continue;
+    *payload++ = '\0';
+    StreamEvent event = { line, payload, false, { 0, 0 } };
+    char* masks = strchr(payload, '\t');
+    if (masks) {
+      *masks++ = '\0';
+      event.payload = payload;
+      unsigned present, state;
+      if (sscanf(masks, "%x\t%x", &present, &state) == 2) {
+        event.haveExpected = true;
+        event.expected = { present, state };
+      }
+    }
+    events.push_back(event);
+  }
+  fclose(file);
+  return !events.empty();
+}
+
+static void benchStreamEvents(const std::vector<StreamEvent>& events) {
+  printf("stream events: %d\n", (int)events.size());
+  printf("  %-10s %8s %12s %10s  %s\n", "path", "bytes", "ns/event", "MB/s", "result");
+  int failures = 0;
+  for (const StreamEvent& event : events) {
+    SwitchSnapshot out;
+    bool parsed = replayStreamEvent(event, out);
+    bool ok = !event.haveExpected ||
+              (out.present == event.expected.present && out.state == event.expected.state);
+    if (!ok) failures++;
+
+    uint64_t runs = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    volatile uint32_t sink = 0;
+    while (elapsed < 0.2) {
+      for (int k = 0; k < 1000; k++) {
+        replayStreamEvent(event, out);
+        sink = sink + out.state;
+      }
+      runs += 1000;
+      elapsed = secondsSince(start);
+    }
+    double nsPerEvent = elapsed * 1e9 / runs;
+    printf("  %-10.10s %8d %12.1f %10.1f  %s present=%08x state=%08x%s\n", event.path.c_str(),
+           (int)event.payload.size(), nsPerEvent, event.payload.size() / nsPerEvent * 1e3,
+           parsed ? "parsed" : "ignored", out.present, out.state, ok ? "" : "  MISMATCH");
+  }
+  if (failures) printf("  %d event(s) did not match their expected masks\n", failures);
+}
+
+// Replays a reconnect and a burst of reordered and duplicated commands through the
+// CommandSequencer and checks every verdict, as executeCommands() in firmware.cpp sees them.
+static void benchCommandSequencing() {
+  struct Step {
+    const char* what;
+    int switchId;
+    bool state;
+    uint32_t seq;
+    CommandVerdict expected;
+  };
+  static const Step steps[] = {
+    { "initial snapshot", 1, true, 10, COMMAND_APPLY },
+    { "initial snapshot", 2, false, 11, COMMAND_APPLY },
+    { "reconnect replay", 1, true, 10, COMMAND_STALE },
+    { "reconnect replay", 2, false, 11, COMMAND_STALE },
+    { "toggle", 1, false, 12, COMMAND_APPLY },
+    { "late copy", 1, true, 10, COMMAND_STALE },
+    { "same state", 1, false, 13, COMMAND_UNCHANGED },
+    { "bare write", 2, false, 0, COMMAND_UNCHANGED },
+    { "bare write", 2, true, 0, COMMAND_APPLY },
+    { "before wrap", 3, true, 0xfffffff0u, COMMAND_APPLY },
+    { "after wrap", 3, false, 0x00000005u, COMMAND_APPLY },
+    { "pre-wrap copy", 3, true, 0xfffffff0u, COMMAND_STALE },
+  };
+
+  CommandSequencer seqr = {};
+  int drives = 0, failures = 0;
+  printf("command sequencing:\n");
+  for (const Step& step : steps) {
+    CommandVerdict verdict = commandAccept(seqr, step.switchId, step.state, step.seq);
+    if (verdict == COMMAND_APPLY) drives++;
+    if (verdict != step.expected) {
+      failures++;
+      printf("  %-16s switch %d seq %u: verdict %d, expected %d  MISMATCH\n", step.what, step.switchId,
+             (unsigned)step.seq, (int)verdict, (int)step.expected);
+    }
+  }
+  printf("  %d commands, %d relay writes, %s\n", (int)(sizeof(steps) / sizeof(steps[0])), drives,
+         failures ? "FAILED" : "all verdicts as expected");
+}
+
+static std::string base64Encode(const uint8_t* data, size_t length) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string text;
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t chunk = (uint32_t)data[i] << 16;
+    if (i + 1 < length) chunk |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length) chunk |= data[i + 2];
+    text += alphabet[(chunk >> 18) & 63];
+    text += alphabet[(chunk >> 12) & 63];
+    text += i + 1 < length ? alphabet[(chunk >> 6) & 63] : '=';
+    text += i + 2 < length ? alphabet[chunk & 63] : '=';
+  }
+  return text;
+}
+
+static void putRule(uint8_t* p, AutomationInput input, AutomationOp op, int switchId, uint8_t flags,
+                    float threshold, float hysteresis, uint16_t holdSamples) {
+  memset(p, 0, AUTOMATION_RULE_SIZE);
+  p[0] = input;
+  p[1] = op;
+  p[2] = (uint8_t)switchId;
+  p[3] = flags;
+  memcpy(p + 4, &threshold, 4); // Host is little-endian, like the ESP32
+  memcpy(p + 8, &hysteresis, 4);
+  p[12] = (uint8_t)holdSamples;
+  p[13] = (uint8_t)(holdSamples >> 8);
+}
+
+// Sends a rule table through the same base64 and table decoding as the firmware, replays a
+// load and light profile through it and checks each step's commands, then times a full
+// table of AUTOMATION_MAX_RULES rules.
+static void benchAutomation() {
+  uint8_t table[AUTOMATION_TABLE_MAX_SIZE];
+  table[0] = AUTOMATION_TABLE_VERSION;
+  table[1] = 2;
+  // Shed switch 4 (DB true = relay HIGH = load off) above 1500 W held for 2 readings,
+  // back on below 1400 W
+  putRule(table + 2, AUTOMATION_INPUT_POWER, AUTOMATION_ABOVE, 4, AUTOMATION_FLAG_STATE | AUTOMATION_FLAG_RESTORE,
+          1500, 100, 2);
+  // Lights on switch 2 (DB false) below LDR 800, off again above 850
+  putRule(table + 2 + AUTOMATION_RULE_SIZE, AUTOMATION_INPUT_LDR, AUTOMATION_BELOW, 2, AUTOMATION_FLAG_RESTORE,
+          800, 50, 1);
+  std::string text = base64Encode(table, 2 + 2 * AUTOMATION_RULE_SIZE);
+
+  uint8_t decoded[AUTOMATION_TABLE_MAX_SIZE];
+  int length = base64Decode(text.c_str(), decoded, sizeof(decoded));
+  AutomationTable rules;
+  if (!parseAutomationTable(decoded, length, rules)) {
+    printf("automation: table did not decode  FAILED\n");
+    return;
+  }
+
+  struct Step {
+    float power, ldr;
+    uint32_t present, state; // Expected commands
+  };
+  static const Step steps[] = {
+    { 900, 1200, 0, 0 },
+    { 1600, 1200, 0, 0 },                // Not held long enough yet
+    { 1650, 1200, 1u << 4, 1u << 4 },    // Shed
+    { 1450, 1200, 0, 0 },                // Inside the hysteresis band
+    { 1350, 790, (1u << 4) | (1u << 2), 0 }, // Restored, and lights on
+    { 600, 820, 0, 0 },
+    { 600, 900, 1u << 2, 1u << 2 },      // Lights off again
+  };
+  AutomationState state = {};
+  int failures = 0;
+  for (const Step& step : steps) {
+    float inputs[AUTOMATION_INPUT_COUNT] = { step.power, step.ldr, NAN };
+    SwitchSnapshot out = { 0, 0 };
+    automationEvaluate(rules, inputs, state, out);
+    if (out.present != step.present || (out.state & out.present) != step.state) {
+      failures++;
+      printf("  power %.0f ldr %.0f: present=%08x state=%08x  MISMATCH\n", step.power, step.ldr, out.present,
+             out.state & out.present);
+    }
+  }
+  printf("automation: %d-byte table as %d base64 chars, %d steps, %s\n", length, (int)text.size(),
+         (int)(sizeof(steps) / sizeof(steps[0])), failures ? "FAILED" : "all commands as expected");
+
+  AutomationTable full = {};
+  full.count = AUTOMATION_MAX_RULES;
+  for (int i = 0; i < AUTOMATION_MAX_RULES; i++) {
+    full.rules[i] = rules.rules[i % 2];
+    full.rules[i].switchId = (uint8_t)(1 + i % MAX_SWITCH_ID);
+  }
+  AutomationState fullState = {};
+  uint64_t runs = 0;
+  volatile uint32_t sink = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed = 0;
+  while (elapsed < 0.2) {
+    for (int k = 0; k < 1000; k++) {
+      float inputs[AUTOMATION_INPUT_COUNT] = { (float)(1000 + (k & 1023)), (float)(700 + (k & 255)), 25 };
+      SwitchSnapshot out = { 0, 0 };
+      sink = sink + automationEvaluate(full, inputs, fullState, out) + out.present;
+    }
+    runs += 1000;
+    elapsed = secondsSince(start);
+  }
+  printf("  %d rules: %.1f ns per evaluation\n", AUTOMATION_MAX_RULES, elapsed * 1e9 / runs);
+}
+
+// Quarter energy of a household-like day: a base load, a morning and a larger evening peak,
+// and noise. Returns Wh.
+static float syntheticQuarterWh(int quarter) {
+  int slot = quarter % FORECAST_SEASON_SLOTS;
+  float hour = slot / 4.0f;
+  float wh = 40.0f;
+  wh += 60.0f * expf(-0.5f * (hour - 7.5f) * (hour - 7.5f));
+  wh += 150.0f * expf(-0.5f * (hour - 19.5f) * (hour - 19.5f) / 2.0f);
+  return wh * (1.0f + 0.1f * gaussianNoise());
+}
+
+// Trains the forecaster on two weeks of synthetic quarters and scores its next-hour forecast
+// over the following week against "the next hour repeats the last one".
+static void benchForecaster() {
+  const int trainQuarters = 14 * FORECAST_SEASON_SLOTS;
+  const int testQuarters = 7 * FORECAST_SEASON_SLOTS;
+  std::vector<float> wh(trainQuarters + testQuarters + 4);
+  for (size_t q = 0; q < wh.size(); q++) wh[q] = syntheticQuarterWh((int)q);
+
+  Forecaster f = {};
+  double absError = 0, naiveAbsError = 0, actualSum = 0;
+  int covered = 0, scored = 0;
+  for (int q = 0; q < trainQuarters + testQuarters; q++) {
+    forecasterUpdate(f, wh[q], q % FORECAST_SEASON_SLOTS);
+    if (q < trainQuarters || q < 4) continue;
+    float predicted = forecasterPredict(f, (q + 1) % FORECAST_SEASON_SLOTS, 4);
+    float band = forecasterBand(f, 4);
+    float actual = wh[q + 1] + wh[q + 2] + wh[q + 3] + wh[q + 4];
+    float naive = wh[q] + wh[q - 1] + wh[q - 2] + wh[q - 3];
+    absError += fabs(predicted - actual);
+    naiveAbsError += fabs(naive - actual);
+    actualSum += actual;
+    if (fabsf(predicted - actual) <= band) covered++;
+    scored++;
+  }
+  printf("forecaster: %d-byte model, next-hour error %.1f%% (last-hour repeat %.1f%%), %.0f%% inside the band\n",
+         (int)sizeof(Forecaster), 100.0 * absError / actualSum, 100.0 * naiveAbsError / actualSum,
+         100.0 * covered / scored);
+}
+
+// =======================================================================
+//   POWER QUALITY
+// =======================================================================
+// 12 cycles of voltage and current at `hz` with the given 3rd/5th/7th harmonic fractions,
+// the current lagging 35 degrees, with 1.5 counts of noise, quantized.
+static void powerQualityCapture(float hz, const float (&vh)[3], const float (&ih)[3], std::vector<uint16_t>& v,
+                                std::vector<uint16_t>& i) {
+  const float w = 2.0f * 3.14159265f * hz / ADC_CHANNEL_RATE_HZ, lag = 35.0f * 3.14159265f / 180.0f;
+  const int orders[3] = { 3, 5, 7 };
+  const uint32_t samples = 12 * ADC_CHANNEL_RATE_HZ / MAINS_FREQUENCY_HZ;
+  v.clear();
+  i.clear();
+  for (uint32_t n = 0; n < samples; n++) {
+    float a = sinf(w * n + 0.4f), b = sinf(w * n + 0.4f - lag);
+    for (int k = 0; k < 3; k++) {
+      a += vh[k] * sinf(orders[k] * (w * n + 0.4f));
+      b += ih[k] * sinf(orders[k] * (w * n + 0.4f - lag));
+    }
+    v.push_back(toCounts(VOLTAGE_MIDPOINT + 1400 * a + 1.5f * gaussianNoise()));
+    i.push_back(toCounts(2071 + 1200 * b + 1.5f * gaussianNoise()));
+  }
+}
+
+// Runs pqAnalyze() on the capture and on off-nominal synthetic mains against their known
+// harmonic content, times it, then replays a supply with a sag and a swell through the
+// event detector.
+static void benchPowerQuality(const Capture& capture) {
+  static PqWorkspace ws;
+  pqInit(ws);
+  PowerQuality pq;
+  const uint32_t snapshot = 12 * ADC_CHANNEL_RATE_HZ / MAINS_FREQUENCY_HZ;
+  if (capture.voltage.size() >= snapshot &&
+      pqAnalyze(capture.voltage.data(), capture.current.data(), snapshot, ADC_CHANNEL_RATE_HZ, ws, pq)) {
+    printf("power quality: capture %.3f Hz, THD voltage %.2f%% current %.2f%%, h3 voltage %.2f%%, h5 current %.2f%%\n",
+           pq.frequencyHz, pq.thdVoltage, pq.thdCurrent, pq.voltageHarmonics[2], pq.currentHarmonics[4]);
+  } else {
+    printf("power quality: capture has too few mains cycles to analyze\n");
+  }
+
+  struct Case { float hz; float vh[3]; float ih[3]; };
+  const Case cases[] = {
+    { 50.0f, { 0.05f, 0, 0 }, { 0, 0.08f, 0 } },
+    { 49.2f, { 0.03f, 0.02f, 0.01f }, { 0.20f, 0.10f, 0.05f } },
+    { 50.7f, { 0, 0.04f, 0 }, { 0.30f, 0, 0.12f } },
+  };
+  printf("  %-8s %10s %12s %12s %12s %12s\n", "mains", "f error", "THD V", "expected", "THD I", "expected");
+  std::vector<uint16_t> v, i;
+  for (const Case& c : cases) {
+    powerQualityCapture(c.hz, c.vh, c.ih, v, i);
+    if (!pqAnalyze(v.data(), i.data(), (uint32_t)v.size(), ADC_CHANNEL_RATE_HZ, ws, pq)) {
+      printf("  %5.1f Hz  not analyzed\n", c.hz);
+      continue;
+    }
+    float expectedV = 100 * sqrtf(c.vh[0] * c.vh[0] + c.vh[1] * c.vh[1] + c.vh[2] * c.vh[2]);
+    float expectedI = 100 * sqrtf(c.ih[0] * c.ih[0] + c.ih[1] * c.ih[1] + c.ih[2] * c.ih[2]);
+    printf("  %5.1f Hz %7.1f mHz %11.2f%% %11.2f%% %11.2f%% %11.2f%%\n", c.hz, 1000 * (pq.frequencyHz - c.hz),
+           pq.thdVoltage, expectedV, pq.thdCurrent, expectedI);
+  }
+
+  int runs = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed = 0;
+  while (elapsed < 0.5) {
+    pqAnalyze(v.data(), i.data(), (uint32_t)v.size(), ADC_CHANNEL_RATE_HZ, ws, pq);
+    runs++;
+    elapsed = secondsSince(start);
+  }
+  printf("  %d-point frame: %.1f us per analysis\n", PQ_FFT_SIZE, elapsed * 1e6 / runs);
+
+  // 20 s of supply: a 6-cycle sag to 60 % at 5 s and a 25-cycle swell to 115 % at 12 s
+  const uint32_t perCycle = ADC_CHANNEL_RATE_HZ / MAINS_FREQUENCY_HZ;
+  VoltageEventDetector det;
+  voltageEventInit(det, perCycle / 2);
+  const float w = 2.0f * 3.14159265f * MAINS_FREQUENCY_HZ / ADC_CHANNEL_RATE_HZ;
+  int events = 0;
+  for (uint32_t n = 0; n < 20u * ADC_CHANNEL_RATE_HZ; n++) {
+    float level = 1.0f;
+    if (n >= 5u * ADC_CHANNEL_RATE_HZ && n < 5u * ADC_CHANNEL_RATE_HZ + 6 * perCycle) level = 0.6f;
+    if (n >= 12u * ADC_CHANNEL_RATE_HZ && n < 12u * ADC_CHANNEL_RATE_HZ + 25 * perCycle) level = 1.15f;
+    int32_t centered = toCounts(VOLTAGE_MIDPOINT + 1400 * level * sinf(w * n) + 1.5f * gaussianNoise()) - VOLTAGE_MIDPOINT;
+    VoltageEvent e;
+    if (voltageEventUpdate(det, centered, e)) {
+      events++;
+      printf("  %s at %.2f s: %u half cycles (%.0f ms), %.0f%% of the reference\n",
+             e.kind == VOLTAGE_EVENT_SAG ? "sag" : "swell", (float)n / ADC_CHANNEL_RATE_HZ, (unsigned)e.halfCycles,
+             e.halfCycles * 500.0f / MAINS_FREQUENCY_HZ, 100 * e.extreme);
+    }
+  }
+  printf("  %d voltage events in 20 s, expected 2 (6 cycle sag, 25 cycle swell)\n", events);
+}
+
+// =======================================================================
+//   DELTA PATCHES
+// =======================================================================
+// A synthetic 1 MB "image" and an edited copy of it, the kinds of change a rebuild makes:
+// bytes inserted and removed, scattered 4-byte words changed (addresses that moved) and a
+// grown tail. The patch is made by a port of createDeltaPatch() in src/lib/ota.ts, applied
+// through deltaApplyFeed() in download-sized pieces and compared with the target byte for
+// byte. Malformed patches must be rejected before a byte outside the images is touched.
+#define PATCH_MATCH_BLOCK 16
+#define PATCH_MIN_COPY 24
+#define PATCH_HASH_BITS 20
+#define PATCH_MAX_CHAIN 32
+
+static uint32_t patchBlockHash(const uint8_t* p) {
+  uint32_t h = 2166136261u;
+  for (int k = 0; k < PATCH_MATCH_BLOCK; k++) h = (h ^ p[k]) * 16777619u;
+  return h >> (32 - PATCH_HASH_BITS);
+}
+
+static void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((uint8_t)value);
+}
+
+static void putU32(std::vector<uint8_t>& out, uint32_t value) {
+  for (int k = 0; k < 4; k++) out.push_back((uint8_t)(value >> (8 * k)));
+}
+
+static void putInsert(std::vector<uint8_t>& out, const std::vector<uint8_t>& target, size_t from, size_t to) {
+  if (to <= from) return;
+  out.push_back(DELTA_OP_INSERT);
+  putVarint(out, to - from);
+  out.insert(out.end(), target.begin() + from, target.begin() + to);
+}
+
+// Same greedy matcher as createDeltaPatch(). The hashes in the header are left zero: they
+// are checked by the firmware, not by the applier.
+static std::vector<uint8_t> makeDeltaPatch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target) {
+  std::vector<uint8_t> out;
+  putU32(out, DELTA_PATCH_MAGIC);
+  putU32(out, (uint32_t)source.size());
+  out.resize(out.size() + 32);
+  putU32(out, (uint32_t)target.size());
+  out.resize(out.size() + 32);
+
+  std::vector<int32_t> head(1u << PATCH_HASH_BITS, -1), chain(source.size(), -1);
+  for (size_t i = 0; i + PATCH_MATCH_BLOCK <= source.size(); i++) {
+    uint32_t h = patchBlockHash(&source[i]);
+    chain[i] = head[h];
+    head[h] = (int32_t)i;
+  }
+
+  size_t i = 0, literalStart = 0, cursor = 0;
+  auto matchLength = [&](size_t from, size_t at) {
+    size_t n = 0;
+    while (from + n < source.size() && at + n < target.size() && source[from + n] == target[at + n]) n++;
+    return n;
+  };
+  while (i + PATCH_MATCH_BLOCK <= target.size()) {
+    size_t bestLength = 0, bestFrom = 0;
+    size_t guess = cursor + (i - literalStart); // Same-size edit since the last copy
+    if (guess < source.size()) {
+      bestLength = matchLength(guess, i);
+      bestFrom = guess;
+    }
+    int32_t candidate = head[patchBlockHash(&target[i])];
+    for (int steps = 0; candidate >= 0 && steps < PATCH_MAX_CHAIN; steps++, candidate = chain[candidate]) {
+      size_t n = matchLength((size_t)candidate, i);
+      if (n > bestLength) {
+        bestLength = n;
+        bestFrom = (size_t)candidate;
+      }
+    }
+    if (bestLength < PATCH_MIN_COPY) {
+      i++;
+      continue;
+    }
+    while (i > literalStart && bestFrom > 0 && source[bestFrom - 1] == target[i - 1]) {
+      i--;
+      bestFrom--;
+      bestLength++;
+    }
+    putInsert(out, target, literalStart, i);
+    int64_t delta = (int64_t)bestFrom - (int64_t)cursor;
+    out.push_back(DELTA_OP_COPY);
+    putVarint(out, delta >= 0 ? (uint64_t)delta * 2 : (uint64_t)(-delta) * 2 - 1);
+    putVarint(out, bestLength);
+    cursor = bestFrom + bestLength;
+    i += bestLength;
+    literalStart = i;
+  }
+  putInsert(out, target, literalStart, target.size());
+  return out;
+}
+
+struct PatchBuffers {
+  const std::vector<uint8_t>* source;
+  std::vector<uint8_t> target;
+  uint32_t reads;
+};
+
+static bool patchReadSource(void* context, uint32_t offset, uint8_t* out, uint32_t length) {
+  PatchBuffers* b = (PatchBuffers*)context;
+  if ((size_t)offset + length > b->source->size()) return false;
+  memcpy(out, b->source->data() + offset, length);
+  b->reads++;
+  return true;
+}
+
+static bool patchWriteTarget(void* context, const uint8_t* data, uint32_t length) {
+  PatchBuffers* b = (PatchBuffers*)context;
+  b->target.insert(b->target.end(), data, data + length);
+  return true;
+}
+
+// Feeds the patch `piece` bytes at a time, as otaTask() does with each read of the
+// download. Returns the final status.
+static DeltaStatus applyPatch(const std::vector<uint8_t>& patch, const std::vector<uint8_t>& source, size_t piece,
+                              PatchBuffers& buffers) {
+  static DeltaApplier applier;
+  buffers.source = &source;
+  buffers.target.clear();
+  buffers.reads = 0;
+  DeltaIo io = { &buffers, patchReadSource, patchWriteTarget };
+  deltaApplyBegin(applier);
+  for (size_t offset = 0; offset < patch.size();) {
+    size_t n = patch.size() - offset < piece ? patch.size() - offset : piece;
+    uint32_t used = 0;
+    while (used < n) {
+      used += deltaApplyFeed(applier, &patch[offset + used], (uint32_t)(n - used), io);
+      if (applier.status == DELTA_HEADER_READY) continue;
+      if (applier.status != DELTA_MORE && (applier.status != DELTA_DONE || used < n)) {
+        return applier.status == DELTA_DONE ? DELTA_BAD_PATCH : applier.status; // Bytes after the end
+      }
+    }
+    offset += n;
+  }
+  return applier.status;
+}
+
+static void benchDeltaPatch() {
+  std::vector<uint8_t> source(1 << 20);
+  uint32_t state = 2463534242u;
+  for (size_t k = 0; k < source.size(); k++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    // Code-like: small alphabet runs with the odd wide byte, so blocks repeat a little
+    source[k] = (state & 7) ? (uint8_t)(state >> 24 & 0x3f) : (uint8_t)(state >> 16);
+  }
+  std::vector<uint8_t> target(source.begin(), source.begin() + 100000);
+  for (int k = 0; k < 37; k++) target.push_back((uint8_t)(0xa0 + k)); // Inserted code
+  target.insert(target.end(), source.begin() + 100000, source.begin() + 600000);
+  target.insert(target.end(), source.begin() + 600500, source.end()); // 500 bytes removed
+  for (int k = 0; k < 1000; k++) {
+    size_t at = 4096 + (size_t)k * 1031;
+    for (int b = 0; b < 4; b++) target[at + b] ^= (uint8_t)(0x11 + b + k); // Moved addresses
+  }
+  for (int k = 0; k < 2048; k++) target.push_back((uint8_t)(k * 7));
+
+  Clock::time_point start = Clock::now();
+  std::vector<uint8_t> patch = makeDeltaPatch(source, target);
+  double encodeSeconds = secondsSince(start);
+
+  printf("delta patches:\n");
+  printf("  source %u bytes, target %u bytes, patch %u bytes (%.1f%% of the target), encoded in %.0f ms\n",
+         (unsigned)source.size(), (unsigned)target.size(), (unsigned)patch.size(), 100.0 * patch.size() / target.size(),
+         encodeSeconds * 1e3);
+
+  PatchBuffers buffers;
+  static const size_t pieces[] = { 1, 7, 1024, 1 << 20 };
+  for (size_t piece : pieces) {
+    start = Clock::now();
+    DeltaStatus status = applyPatch(patch, source, piece, buffers);
+    double seconds = secondsSince(start);
+    bool ok = status == DELTA_DONE && buffers.target == target;
+    printf("  %7u-byte pieces: %6.1f MB/s of target, %6u source reads  %s\n", (unsigned)piece,
+           target.size() / seconds / 1e6, (unsigned)buffers.reads, ok ? "identical" : "MISMATCH");
+  }
+
+  struct Broken {
+    const char* what;
+    std::vector<uint8_t> patch;
+    DeltaStatus expected;
+  };
+  std::vector<Broken> broken;
+  broken.push_back({ "truncated", std::vector<uint8_t>(patch.begin(), patch.end() - 100), DELTA_MORE });
+  broken.push_back({ "trailing bytes", patch, DELTA_BAD_PATCH });
+  broken.back().patch.push_back(0);
+  broken.push_back({ "bad magic", patch, DELTA_BAD_PATCH });
+  broken.back().patch[0] ^= 1;
+  broken.push_back({ "unknown op", patch, DELTA_BAD_PATCH });
+  broken.back().patch[DELTA_HEADER_SIZE] = 9;
+  std::vector<uint8_t> outside(patch.begin(), patch.begin() + DELTA_HEADER_SIZE);
+  outside.push_back(DELTA_OP_COPY);
+  putVarint(outside, (uint64_t)(source.size() - 8) * 2);
+  putVarint(outside, 16);
+  broken.push_back({ "copy past source", outside, DELTA_BAD_PATCH });
+  std::vector<uint8_t> overlong(patch.begin(), patch.begin() + DELTA_HEADER_SIZE);
+  overlong.push_back(DELTA_OP_INSERT);
+  putVarint(overlong, target.size() + 1);
+  broken.push_back({ "insert past target", overlong, DELTA_BAD_PATCH });
+
+  int failures = 0;
+  for (const Broken& b : broken) {
+    DeltaStatus status = applyPatch(b.patch, source, 1024, buffers);
+    if (status != b.expected) {
+      failures++;
+      printf("  %-18s status %d, expected %d  MISMATCH\n", b.what, (int)status, (int)b.expected);
+    }
+  }
+  printf("  %d malformed patches, %s\n", (int)broken.size(), failures ? "FAILED" : "all rejected as expected");
+}
+
+int main(int argc, char** argv) {
+  const char* capturePath = nullptr;
+  const char* writePath = nullptr;
+  const char* eventsPath = nullptr;
+  for (int a = 1; a + 1 < argc; a += 2) {
+    if (strcmp(argv[a], "--capture") == 0) capturePath = argv[a + 1];
+    else if (strcmp(argv[a], "--write-capture") == 0) writePath = argv[a + 1];
+    else if (strcmp(argv[a], "--events") == 0) eventsPath = argv[a + 1];
+  }
+
+  Capture capture;
+  if (capturePath) {
+    if (!loadCapture(capturePath, capture)) {
+      fprintf(stderr, "Could not read capture %s\n", capturePath);
+      return 1;
+    }
+    printf("capture: %s, %d sample pairs\n", capturePath, (int)capture.voltage.size());
+  } else {
+    capture = syntheticCapture();
+    printf("capture: synthetic, %d sample pairs\n", (int)capture.voltage.size());
+  }
+  if (writePath && !writeCapture(writePath, capture)) {
+    fprintf(stderr, "Could not write capture %s\n", writePath);
+    return 1;
+  }
+
+  std::vector<StreamEvent> events;
+  if (eventsPath) {
+    if (!loadEvents(eventsPath, events)) {
+      fprintf(stderr, "Could not read events %s\n", eventsPath);
+      return 1;
+    }
+  } else {
+    events = builtInEvents();
+  }
+
+  benchAccuracy(capture);
+  benchOffsetTracking(capture);
+  double pairwisePerSecond = benchThroughput(capture);
+  benchBlockKernel(capture, pairwisePerSecond);
+  benchStreamEvents(events);
+  benchCommandSequencing();
+  benchAutomation();
+  benchForecaster();
+  benchPowerQuality(capture);
+  benchDeltaPatch();
+  return 0;
+}
@@ -10,19 +10,95 @@
  * It also reads local sensor data (voltage, current, etc.) and sends it to Firebase
  * for the web app to display.
  *
+ * The same sketch builds every board; pick one with SOLARIS_PROFILE under BUILD PROFILE.
+ * A bare ESP32 with a relay module and no sensors is PROFILE_BASIC.
+ *
+ * Once flashed, devices update over the air from releases staged in the app, as delta
+ * patches against the running image with automatic rollback; see OTA UPDATES.
+ *
  * REQUIRED LIBRARIES:
  * - Arduino_JSON (by Arduino)
  * - Firebase ESP32 Client (by Mobizt) -> Search for "Firebase ESP32 Client" in Library Manager
- * - DHT sensor library (by Adafruit)
  * - LiquidCrystal (built-in)
+ * - PubSubClient (by Nick O'Leary), for the optional MQTT command channel
+ *
+ * REQUIRED CORE:
+ * - esp32 by Espressif Systems, version 3.x (ESP-IDF 5). The sampling engine uses the
+ *   ADC continuous (DMA) driver from <esp_adc/adc_continuous.h>.
+ *
+ * REQUIRED FILES:
+ * - solaris_core.h next to this sketch (DSP, stream and command parsing; see bench/ for host builds)
  *
  */
 
 #include <Arduino.h>
 #include <WiFi.h>
 #include <LiquidCrystal.h>
-#include <DHT.h>
 #include <Firebase_ESP_Client.h> // Modern Firebase library
+#include <WiFiClientSecure.h>
+#include <PubSubClient.h>
+#include <Wire.h>
+#include <Preferences.h>
+#include <LittleFS.h>
+#include <sys/time.h>
+#include <soc/gpio_reg.h>
+#include <esp_timer.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include <esp_pm.h>
+#include <driver/gpio.h>
+#include <esp_adc/adc_continuous.h>
+#include <esp_ota_ops.h>
+#include <esp_image_format.h>
+#include <esp_mac.h>
+#include <mbedtls/sha256.h>
+#include <HTTPClient.h> // OTA downloads only; telemetry uploads use the UPLOAD ARENA
+#include <atomic>
+#include "solaris_core.h" // Hardware-free DSP, stream and command parsing, also built on the host
+
+// ===== 0. BUILD PROFILE =====
+// SOLARIS_PROFILE sets the defaults of the build options below for one board. Each option
+// can also be overridden on its own, here or with -D. A feature the build leaves out is
+// removed by the preprocessor together with its tasks, buffers and driver calls, not
+// skipped at run time, so a smaller board also gets a smaller image and fits both OTA
+// slots of a 4 MB flash with room to spare.
+//   PROFILE_METERING  Solaris metering board: DMA-sampled mains voltage and current,
+//                     per-relay current sensors, DHT, LDR, LCD, power quality. The
+//                     ADC runs continuously, so the sag/swell detector sees every cycle.
+//   PROFILE_BASIC     Any ESP32 with a relay module on RELAYS[] and no sensors:
+//                     simulated readings, no LCD. For bringing up the app and the
+//                     relays before the metering hardware is wired.
+// Transport is chosen the same way: COMMAND_TRANSPORT (stream or MQTT) for switch
+// commands, TELEMETRY_BATCHING (/api/data batches or one RTDB pushJSON per reading) and
+// PROFILING for the diagnostics report.
+#define PROFILE_METERING 0
+#define PROFILE_BASIC 1
+#ifndef SOLARIS_PROFILE
+#define SOLARIS_PROFILE PROFILE_METERING
+#endif
+
+#ifndef SIMULATED_SENSORS
+#define SIMULATED_SENSORS (SOLARIS_PROFILE == PROFILE_BASIC) // 1 = random() readings, no ADC, DHT or LDR
+#endif
+#ifndef BRANCH_METERING
+#define BRANCH_METERING !SIMULATED_SENSORS // Per-relay current sensors behind the mux
+#endif
+#ifndef LCD_DISPLAY
+#define LCD_DISPLAY (SOLARIS_PROFILE == PROFILE_METERING)
+#endif
+// POWER_QUALITY and POWER_SAVE default to exclusive: sag/swell detection needs continuous
+// sampling and POWER_SAVE samples in bursts. Both may still be set together (see POWER
+// QUALITY ENGINE for what that costs).
+#ifndef POWER_QUALITY
+#define POWER_QUALITY !SIMULATED_SENSORS
+#endif
+#ifndef POWER_SAVE
+#define POWER_SAVE (!SIMULATED_SENSORS && !POWER_QUALITY)
+#endif
+
+#if BRANCH_METERING && SIMULATED_SENSORS
+#error "BRANCH_METERING needs the ADC sampler; it cannot be combined with SIMULATED_SENSORS"
+#endif
 
 // ===== 1. WIFI & FIREBASE CREDENTIALS =====
 // IMPORTANT: The DEVICE_API_KEY from the Solaris app settings is NOT used for Realtime Database auth.
@@ -33,12 +109,81 @@
 #define FIREBASE_HOST "https://smart-solar-agent-default-rtdb.firebaseio.com"
 #define FIREBASE_AUTH_SECRET "KEUSzaJSC2VSN1KRekN55FdHLyo1AVvESULCgAZF" // This is your DATABASE SECRET
 
+// Batched telemetry is posted to the web app's /api/data route, which authenticates
+// devices with the DEVICE_API_KEY from the Solaris settings page.
+#define APP_INGEST_URL "https://YOUR_DEPLOYED_APP_URL/api/data"
+#define DEVICE_API_KEY "YOUR_DEVICE_API_KEY"
+
+// Where switch commands come from. The Firebase stream needs nothing else. The MQTT channel
+// needs a broker that the web app publishes to as well (COMMAND_BROKER_URL in its
+// environment); see MQTT COMMAND CHANNEL below.
+#define COMMAND_TRANSPORT_STREAM 0 // JSON over the /app/switchStates SSE stream
+#define COMMAND_TRANSPORT_MQTT 1   // 8-byte binary frames over MQTT
+#ifndef COMMAND_TRANSPORT
+#define COMMAND_TRANSPORT COMMAND_TRANSPORT_STREAM
+#endif
+#define MQTT_HOST "YOUR_BROKER_HOST"
+#define MQTT_PORT 8883 // TLS
+#define MQTT_USERNAME "YOUR_BROKER_USERNAME"
+#define MQTT_PASSWORD "YOUR_BROKER_PASSWORD"
+#define MQTT_CLIENT_ID "solaris-device"
+#define COMMAND_TOPIC_PREFIX "solaris/switch/" // One retained topic per switch ID
+
 // ===== 2. GPIO PIN DEFINITIONS =====
-#define RELAY_1_PIN 13
-#define RELAY_2_PIN 14
-#define RELAY_3_PIN 27
-#define RELAY_4_PIN 26
-#define RELAY_5_PIN 25
+// Relay channels. Every switch ID under /app/switchStates that drives a relay needs one
+// row; a channel can be an on-board GPIO or an output of a relay-board expander.
+enum RelayBus : uint8_t {
+  RELAY_BUS_GPIO,           // `pin` is an ESP32 GPIO
+  RELAY_BUS_SHIFT_REGISTER, // `pin` is an output of the 74HC595 chain (0 = QA of the first chip)
+  RELAY_BUS_PCF8574,        // `pin` is a port bit of the PCF8574 I2C expander
+};
+
+struct RelayChannel {
+  uint8_t switchId;
+  RelayBus bus;
+  uint8_t pin;
+};
+
+#if SOLARIS_PROFILE == PROFILE_BASIC
+// Five-channel module on GPIOs the metering board gives to the LCD and the DHT
+constexpr RelayChannel RELAYS[] = {
+  { 1, RELAY_BUS_GPIO, 23 },
+  { 2, RELAY_BUS_GPIO, 22 },
+  { 3, RELAY_BUS_GPIO, 21 },
+  { 4, RELAY_BUS_GPIO, 19 },
+  { 5, RELAY_BUS_GPIO, 18 },
+};
+#else
+constexpr RelayChannel RELAYS[] = {
+  { 1, RELAY_BUS_GPIO, 13 },
+  { 2, RELAY_BUS_GPIO, 14 },
+  { 3, RELAY_BUS_GPIO, 27 },
+  { 4, RELAY_BUS_GPIO, 26 },
+  { 5, RELAY_BUS_GPIO, 25 },
+  // 8/16-channel boards continue on an expander, e.g.:
+  // { 6, RELAY_BUS_SHIFT_REGISTER, 0 },
+  // { 7, RELAY_BUS_SHIFT_REGISTER, 1 },
+};
+#endif
+constexpr int RELAY_COUNT = sizeof(RELAYS) / sizeof(RELAYS[0]);
+
+// Expander wiring. Both expander types use the same header pins, so a board uses one or
+// the other; the pins are only touched when RELAYS[] has a row on that bus.
+#define SHIFT_DATA_PIN 16
+#define SHIFT_CLOCK_PIN 17
+#define SHIFT_LATCH_PIN 2
+#define SHIFT_REGISTER_BITS 16 // Two chained 74HC595
+#define EXPANDER_SDA_PIN 16
+#define EXPANDER_SCL_PIN 17
+#define PCF8574_ADDRESS 0x20
+
+// Inrush limiting. With RELAY_STAGGER_MS > 0, loads switched on by the same command come
+// on RELAY_STAGGER_GROUP at a time, in RELAYS[] order, RELAY_STAGGER_MS apart. Relays
+// that switch a load off always change immediately.
+#define RELAY_STAGGER_MS 0        // 0 = apply every change in one write
+#define RELAY_STAGGER_GROUP 1
+#define RELAY_LOAD_ON_LEVEL LOW   // NC relays: driving LOW turns the load on
+#define RELAY_BOOT_LEVEL HIGH     // Safe state until the stream restores the app's states (loads off)
 
 #define CURRENT_PIN 32
 #define VOLTAGE_PIN 34
@@ -46,12 +191,39 @@
 #define DHT_PIN 23
 #define CONST_PIN 33 // Brightness control for LCD
 
+// Per-relay current sensors. ADC1 has no free pins left for one channel each, so every
+// relay's ACS712 goes to an input of a CD74HC4051 analog multiplexer whose output is
+// BRANCH_CURRENT_PIN. The sampler steps through this table round-robin (see PER-RELAY
+// METERING). `voltsPerAmp` is the sensor's sensitivity: 0.185 for the 5 A ACS712,
+// 0.100 for 20 A, 0.066 for 30 A.
+struct BranchSensor {
+  uint8_t switchId;
+  uint8_t muxChannel;
+  float voltsPerAmp;
+};
+
+constexpr BranchSensor BRANCH_SENSORS[] = {
+  { 1, 0, 0.185 },
+  { 2, 1, 0.185 },
+  { 3, 2, 0.185 },
+  { 4, 3, 0.185 },
+  { 5, 4, 0.185 },
+};
+// Without BRANCH_METERING the table is ignored and per-relay fields drop out of telemetry
+constexpr int BRANCH_METER_COUNT = BRANCH_METERING ? sizeof(BRANCH_SENSORS) / sizeof(BRANCH_SENSORS[0]) : 0;
+
+#define BRANCH_CURRENT_PIN 36 // ADC1, input only
+// Mux select lines S0-S2. 15, 12 and 0 are strapping pins, but they are only driven once
+// the sketch runs and the mux inputs do not pull them, so boot is unaffected.
+const uint8_t BRANCH_MUX_SELECT_PINS[] = { 15, 12, 0 };
+
+#if LCD_DISPLAY
 // LCD (4-bit mode)
 LiquidCrystal lcd(22, 21, 19, 18, 5, 4);
+#endif
 
-// DHT Sensor
-#define DHTTYPE DHT11
-DHT dht(DHT_PIN, DHTTYPE);
+// DHT Sensor (read by the interrupt-driven capture below, not the Adafruit driver)
+#define DHT_TYPE 11 // 11 = DHT11, 22 = DHT22
 
 // ===== 3. FIREBASE & APP OBJECTS =====
 FirebaseData fbdo;
@@ -62,102 +234,685 @@ FirebaseData stream; // Dedicated object for the stream
 // ===== 4. SENSOR CALIBRATION & GLOBALS =====
 const float VREF = 3.3;
 const int ADC_MAX = 4095;
-float currentOffset = 2048.0; // Auto-calibrated on startup
+float currentOffset = 2048.0; // Warm-started from NVS, re-learned while the loads are off
 const float CURRENT_CALIBRATION_FACTOR = 0.185; // For ACS712 30A version
 const float VOLTAGE_DIVIDER_RATIO = (47.0 + 10.0) / 10.0;
-const float VOLTAGE_CALIBRATION = 1.25;
+const float VOLTAGE_CALIBRATION = 1.25; // Default until a field calibration is stored in NVS
+float voltageCalibration = VOLTAGE_CALIBRATION;
+
+#define SENSOR_INTERVAL_MS 2000
+#define FIREBASE_INTERVAL_MS 10000 // Length of each uploaded rollup
+#define CLOCK_VALID_AFTER 1700000000L // Unix seconds; earlier means SNTP has not synced
+
+// One complete set of readings. sensingTask() produces it, folds it into the rollups and
+// hands it to the LCD task by value, so a consumer never sees voltage from one read and
+// power from the next.
+struct SensorSnapshot {
+  float voltageRMS;
+  float currentRMS;
+  float power;         // Real (active) power in W
+  float apparentPower; // VA
+  float powerFactor;
+  float energyWh;      // Energy accumulated since boot
+  float temp;
+  float hum;
+  int ldrValue;
+#if BRANCH_METERING
+  float switchPower[BRANCH_METER_COUNT]; // Real power per BRANCH_SENSORS[] row, W
+#endif
+  uint32_t takenAtMs;
+};
+
+// Lock-free single-producer/single-consumer ring. Exactly one task may push and exactly
+// one other task may pop; head and tail are each written by only one side.
+template <typename T, uint32_t N>
+class SpscRing {
+  static_assert((N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+ public:
+  bool push(const T& item) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N) return false; // Full
+    slots_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false; // Empty
+    item = slots_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  T slots_[N];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+};
+
+// Metrics summarised by a Rollup. Energy is a counter and is tracked separately.
+enum RollupMetric {
+  ROLLUP_VOLTAGE,
+  ROLLUP_CURRENT,
+  ROLLUP_POWER,
+  ROLLUP_APPARENT_POWER,
+  ROLLUP_POWER_FACTOR,
+  ROLLUP_TEMPERATURE,
+  ROLLUP_HUMIDITY,
+  ROLLUP_LDR,
+  ROLLUP_METRIC_COUNT
+};
+
+// min/max/mean of every snapshot taken over one interval, plus the energy used in it.
+struct Rollup {
+  uint32_t startedAtMs;  // takenAtMs of the first snapshot
+  uint32_t endedAtMs;    // takenAtMs of the last snapshot
+  uint32_t samples;
+  float energyStartWh;   // Energy counter at the first and last snapshot
+  float energyEndWh;
+  float sum[ROLLUP_METRIC_COUNT];
+  float min[ROLLUP_METRIC_COUNT];
+  float max[ROLLUP_METRIC_COUNT];
+#if BRANCH_METERING
+  float switchPowerSum[BRANCH_METER_COUNT]; // Per-relay power is only kept as a mean
+#endif
+
+  float mean(RollupMetric metric) const { return samples ? sum[metric] / samples : 0; }
+#if BRANCH_METERING
+  float switchPowerMean(int branch) const { return samples ? switchPowerSum[branch] / samples : 0; }
+#endif
+  float energyUsedWh() const { return energyEndWh - energyStartWh; }
+};
+
+SpscRing<Rollup, 8> telemetryRing;          // sensingTask -> networkTask, one per report
+#if LCD_DISPLAY
+SpscRing<SensorSnapshot, 4> displayRing;    // sensingTask -> lcdTask
+#endif
+
+// Last values that were valid, kept by sensingTask() only
+float lastTemp = 0;
+float lastHum = 0;
+bool haveTemp = false;
+
+// Compile-time checks and switch ID -> RELAYS[] index lookup
+constexpr bool relayBusUsed(RelayBus bus) {
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    if (RELAYS[i].bus == bus) return true;
+  }
+  return false;
+}
+
+constexpr bool relayTableValid() {
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    const RelayChannel& relay = RELAYS[i];
+    if (relay.switchId == 0 || relay.switchId > MAX_SWITCH_ID) return false;
+    if (relay.bus == RELAY_BUS_GPIO && relay.pin >= 34) return false; // GPIO 34-39 are input only
+    if (relay.bus == RELAY_BUS_SHIFT_REGISTER && relay.pin >= SHIFT_REGISTER_BITS) return false;
+    if (relay.bus == RELAY_BUS_PCF8574 && relay.pin >= 8) return false;
+    for (int j = i + 1; j < RELAY_COUNT; j++) {
+      if (RELAYS[j].switchId == relay.switchId) return false;
+    }
+  }
+  return true;
+}
+
+static_assert(relayTableValid(), "RELAYS[] has an out-of-range pin or a duplicate switch ID");
+static_assert(!(relayBusUsed(RELAY_BUS_SHIFT_REGISTER) && relayBusUsed(RELAY_BUS_PCF8574)),
+              "Shift-register and PCF8574 relays share header pins; use one expander type");
+
+struct RelayLookup {
+  int8_t index[MAX_SWITCH_ID + 1];
+};
+
+constexpr RelayLookup buildRelayLookup() {
+  RelayLookup lookup = {};
+  for (int id = 0; id <= MAX_SWITCH_ID; id++) lookup.index[id] = -1;
+  for (int i = 0; i < RELAY_COUNT; i++) lookup.index[RELAYS[i].switchId] = i;
+  return lookup;
+}
+
+constexpr RelayLookup RELAY_LOOKUP = buildRelayLookup();
+
+// Index into RELAYS[] for a switch ID, or -1 if that switch has no relay
+constexpr int relayIndexForSwitch(int switchId) {
+  return (switchId > 0 && switchId <= MAX_SWITCH_ID) ? RELAY_LOOKUP.index[switchId] : -1;
+}
+
+constexpr bool branchTableValid() {
+  for (int i = 0; i < BRANCH_METER_COUNT; i++) {
+    const BranchSensor& sensor = BRANCH_SENSORS[i];
+    if (relayIndexForSwitch(sensor.switchId) < 0 || sensor.muxChannel >= 8 || sensor.voltsPerAmp <= 0) return false;
+    for (int j = i + 1; j < BRANCH_METER_COUNT; j++) {
+      if (BRANCH_SENSORS[j].switchId == sensor.switchId || BRANCH_SENSORS[j].muxChannel == sensor.muxChannel) return false;
+    }
+  }
+  return true;
+}
+
+static_assert(branchTableValid(), "BRANCH_SENSORS[] needs one row per relay switch ID and a distinct mux channel");
+
+// =======================================================================
+//   PROFILING
+// =======================================================================
+// Per-stage timing from the CPU cycle counter. Wrap a stage in a ProfileScope and every run
+// lands in that stage's min/max/total and in a log2 histogram with two buckets per octave,
+// which gives the p99 to within half an octave. networkTask() publishes the stats with the
+// heap watermarks to /app/diagnostics every DIAGNOSTICS_INTERVAL_MS and starts a new window.
+// The cycle counter is per core. The tasks are pinned, so a stage starts and ends on one
+// core; only the Firebase stream callback can migrate, which would show as an outlier max.
+#ifndef PROFILING
+#define PROFILING 1
+#endif
+#define FIRMWARE_VERSION "2.0.0" // Reported with the diagnostics to compare builds in the field
+#define DIAGNOSTICS_INTERVAL_MS 300000
+#define PROFILE_BUCKETS 64
+
+enum ProfileStage {
+  PROF_SAMPLER_FRAME,   // One ADC DMA frame into the rings and the power meter
+  PROF_RMS_WINDOW,      // Closing a power meter window
+  PROF_READ_SENSORS,    // readAllSensors()
+  PROF_DHT_DECODE,
+  PROF_LCD,             // Page render plus differential flush
+  PROF_BATCH_ENCODE,
+  PROF_UPLOAD,          // Batch POST or pushJSON
+  PROF_STREAM_CALLBACK,
+  PROF_STAGE_COUNT
+};
+
+const char* const PROFILE_STAGE_NAMES[PROF_STAGE_COUNT] = {
+  "samplerFrame", "rmsWindow", "readAllSensors", "dhtDecode", "lcd", "batchEncode", "upload", "streamCallback"
+};
+
+struct ProfileStats {
+  uint32_t count;
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  uint32_t buckets[PROFILE_BUCKETS];
+};
+
+ProfileStats profileStats[PROF_STAGE_COUNT];
+size_t minLargestFreeBlock = SIZE_MAX;
+portMUX_TYPE profileMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Bucket 2k holds [2^k, 1.5 * 2^k), bucket 2k + 1 holds [1.5 * 2^k, 2^(k+1)).
+static int profileBucket(uint32_t cycles) {
+  if (cycles < 2) return cycles;
+  int msb = 31 - __builtin_clz(cycles);
+  return msb * 2 + ((cycles >> (msb - 1)) & 1);
+}
+
+static uint32_t profileBucketFloor(int bucket) {
+  if (bucket < 2) return bucket;
+  return (2u | (bucket & 1)) << (bucket / 2 - 1);
+}
+
+void profileRecord(ProfileStage stage, uint32_t cycles) {
+#if PROFILING
+  ProfileStats& stats = profileStats[stage];
+  portENTER_CRITICAL(&profileMux);
+  if (stats.count == 0 || cycles < stats.minCycles) stats.minCycles = cycles;
+  if (cycles > stats.maxCycles) stats.maxCycles = cycles;
+  stats.count++;
+  stats.totalCycles += cycles;
+  stats.buckets[profileBucket(cycles)]++;
+  portEXIT_CRITICAL(&profileMux);
+#endif
+}
+
+// Times the enclosing block, including early returns.
+class ProfileScope {
+ public:
+  explicit ProfileScope(ProfileStage stage) : stage_(stage), started_(esp_cpu_get_cycle_count()) {}
+  ~ProfileScope() { profileRecord(stage_, esp_cpu_get_cycle_count() - started_); }
+
+ private:
+  ProfileStage stage_;
+  uint32_t started_;
+};
+
+// Upper edge of the bucket holding the 99th percentile.
+static uint32_t profileP99(const ProfileStats& stats) {
+  uint64_t target = ((uint64_t)stats.count * 99 + 99) / 100;
+  uint64_t seen = 0;
+  for (int b = 0; b < PROFILE_BUCKETS; b++) {
+    seen += stats.buckets[b];
+    if (seen >= target) return b + 1 < PROFILE_BUCKETS ? profileBucketFloor(b + 1) : UINT32_MAX;
+  }
+  return stats.maxCycles;
+}
+
+// =======================================================================
+//   MEMORY BUDGET
+// =======================================================================
+// Weeks of uptime fail on fragmentation, not on running out of heap: each TLS handshake
+// needs one contiguous record buffer, and a heap cut into small holes by per-cycle Strings
+// and JSON trees eventually cannot give it one. So:
+//  - Everything built on every cycle lives in static memory: snapshots and rollups (rings),
+//    the telemetry payload (batchPayload), the HTTP request and response lines of the upload
+//    (UPLOAD ARENA), the power quality snapshot. The RTDB writes that still build a
+//    FirebaseJson are status reports made at most once a minute and command acks (and,
+//    with TELEMETRY_BATCHING off, each reading).
+//  - Every TLS connection (fbdo, stream, upload, MQTT) runs on the core's mbedTLS, whose
+//    record buffers are fixed when the core is built (CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN),
+//    so they are budgeted as TLS_RECORD_BYTES each rather than resized. The response
+//    fbdo keeps of an RTDB read is capped at FIREBASE_RESPONSE_BYTES. An OTA download is
+//    one more connection while it lasts and only starts with the heap healthy.
+//  - heapGuardStep() watches the largest free block and degrades before an allocation can
+//    fail. HEAP_TIGHT (less than two handshakes' worth): batches are flushed at
+//    BATCH_TIGHT_SAMPLES readings, so fewer bytes are in flight in lwIP buffers at once,
+//    the journal drains one short batch at a time and the optional status reports
+//    (diagnostics, power quality, per-relay metering, automation status) are skipped.
+//    HEAP_CRITICAL (not even one handshake): the upload connection is closed and readings
+//    go to the journal as if offline, until the heap recovers. Commands keep flowing
+//    throughout. If the heap stays critical for HEAP_CRITICAL_RESTART_MS the batch is
+//    journaled and the device restarts cleanly instead of failing mid-handshake.
+#define TLS_RECORD_BYTES (16384 + 1024)     // One mbedTLS in-record buffer plus its overhead
+#define FIREBASE_RESPONSE_BYTES 4096        // Largest RTDB read: switch states, rule table
+#define HEAP_TIGHT_BLOCK (2 * TLS_RECORD_BYTES)
+#define HEAP_CRITICAL_BLOCK (TLS_RECORD_BYTES + 4096)
+#define HEAP_RECOVER_MARGIN 4096            // Hysteresis before a level is left again
+#define HEAP_CRITICAL_RESTART_MS 600000
+#define BATCH_TIGHT_SAMPLES 6
+
+enum HeapHealth { HEAP_HEALTHY, HEAP_TIGHT, HEAP_CRITICAL };
+
+struct HeapGuard {
+  volatile HeapHealth health;
+  size_t largestBlock;      // Latest sample
+  unsigned long since;      // millis() when the current level was entered
+  uint32_t degradations;    // Times the level got worse
+  uint64_t tightMs;         // Time spent below HEAP_HEALTHY, closed levels only
+  uint64_t criticalMs;
+};
+
+HeapGuard heapGuard = { HEAP_HEALTHY, SIZE_MAX, 0, 0, 0, 0 };
+
+HeapHealth heapHealth() {
+  return heapGuard.health;
+}
+
+// Samples the heap and moves between levels. Called often from networkTask(); returns true
+// once the heap has been critical for HEAP_CRITICAL_RESTART_MS.
+bool heapGuardStep() {
+  size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  heapGuard.largestBlock = largest;
+  if (largest < minLargestFreeBlock) minLargestFreeBlock = largest;
+
+  // Getting worse is immediate; a level is only left HEAP_RECOVER_MARGIN above its edge
+  HeapHealth level = heapGuard.health;
+  HeapHealth next;
+  if (largest < HEAP_CRITICAL_BLOCK + (level == HEAP_CRITICAL ? HEAP_RECOVER_MARGIN : 0)) {
+    next = HEAP_CRITICAL;
+  } else if (largest < HEAP_TIGHT_BLOCK + (level != HEAP_HEALTHY ? HEAP_RECOVER_MARGIN : 0)) {
+    next = HEAP_TIGHT;
+  } else {
+    next = HEAP_HEALTHY;
+  }
+  unsigned long now = millis();
+  if (next != level) {
+    unsigned long spent = now - heapGuard.since;
+    if (level == HEAP_CRITICAL) heapGuard.criticalMs += spent;
+    if (level != HEAP_HEALTHY) heapGuard.tightMs += spent;
+    if (next > level) heapGuard.degradations++;
+    heapGuard.since = now;
+    heapGuard.health = next;
+    Serial.printf("Heap %s: largest free block %u bytes\n",
+                  next == HEAP_CRITICAL ? "critical" : next == HEAP_TIGHT ? "tight" : "healthy", (unsigned)largest);
+  }
+  return next == HEAP_CRITICAL && now - heapGuard.since >= HEAP_CRITICAL_RESTART_MS;
+}
+
+// =======================================================================
+//   RELAY DRIVER
+// =======================================================================
+// Output images of the expanders, so a batch can change several bits in one transfer
+uint16_t shiftRegisterImage = 0;
+uint8_t pcf8574Image = 0;
+
+void writeShiftRegister() {
+  digitalWrite(SHIFT_LATCH_PIN, LOW);
+  for (int shift = SHIFT_REGISTER_BITS - 8; shift >= 0; shift -= 8) {
+    shiftOut(SHIFT_DATA_PIN, SHIFT_CLOCK_PIN, MSBFIRST, (uint8_t)(shiftRegisterImage >> shift));
+  }
+  digitalWrite(SHIFT_LATCH_PIN, HIGH);
+}
+
+void writePcf8574() {
+  Wire.beginTransmission(PCF8574_ADDRESS);
+  Wire.write(pcf8574Image);
+  Wire.endTransmission();
+}
+
+// Output level of every relay, bit n for switch n (HIGH = set)
+uint32_t relayLevels = 0;
+unsigned long lastRelayChangeMs = 0;
+int64_t relayDrivenUs[MAX_SWITCH_ID + 1]; // esp_timer time each relay's output was last written
+SemaphoreHandle_t relayLock = NULL;                  // Serializes writers of the images above
+portMUX_TYPE relayMux = portMUX_INITIALIZER_UNLOCKED; // Guards staggerPending and the GPIO edges
+
+// Applies every state in `snapshot` with one write per bus: the GPIO set/clear registers
+// for on-board relays and a single transfer per expander. A set state bit means the relay
+// output is driven HIGH.
+void applySwitchSnapshot(const SwitchSnapshot& snapshot) {
+  uint32_t gpioSet = 0, gpioClear = 0;         // GPIO 0-31
+  uint32_t gpioSetHigh = 0, gpioClearHigh = 0; // GPIO 32-33
+
+  xSemaphoreTake(relayLock, portMAX_DELAY);
+  uint16_t shiftImage = shiftRegisterImage;
+  uint8_t pcfImage = pcf8574Image;
+
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    const RelayChannel& relay = RELAYS[i];
+    uint32_t bit = 1u << relay.switchId;
+    if (!(snapshot.present & bit)) continue;
+    bool high = snapshot.state & bit;
+
+    switch (relay.bus) {
+      case RELAY_BUS_GPIO:
+        if (relay.pin < 32) {
+          if (high) gpioSet |= 1u << relay.pin; else gpioClear |= 1u << relay.pin;
+        } else {
+          if (high) gpioSetHigh |= 1u << (relay.pin - 32); else gpioClearHigh |= 1u << (relay.pin - 32);
+        }
+        break;
+      case RELAY_BUS_SHIFT_REGISTER:
+        if (high) shiftImage |= 1u << relay.pin; else shiftImage &= ~(1u << relay.pin);
+        break;
+      case RELAY_BUS_PCF8574:
+        if (high) pcfImage |= 1u << relay.pin; else pcfImage &= ~(1u << relay.pin);
+        break;
+    }
+  }
+
+  // No interrupt or context switch may land between the set and clear edges
+  portENTER_CRITICAL(&relayMux);
+  REG_WRITE(GPIO_OUT_W1TS_REG, gpioSet);
+  REG_WRITE(GPIO_OUT_W1TC_REG, gpioClear);
+  REG_WRITE(GPIO_OUT1_W1TS_REG, gpioSetHigh);
+  REG_WRITE(GPIO_OUT1_W1TC_REG, gpioClearHigh);
+  portEXIT_CRITICAL(&relayMux);
+
+  if (shiftImage != shiftRegisterImage) {
+    shiftRegisterImage = shiftImage;
+    writeShiftRegister();
+  }
+  if (pcfImage != pcf8574Image) {
+    pcf8574Image = pcfImage;
+    writePcf8574();
+  }
+  uint32_t levels = (relayLevels & ~snapshot.present) | (snapshot.state & snapshot.present);
+  if (levels != relayLevels) lastRelayChangeMs = millis();
+  relayLevels = levels;
+  int64_t drivenUs = esp_timer_get_time();
+  for (uint32_t bits = snapshot.present; bits; bits &= bits - 1) relayDrivenUs[__builtin_ctz(bits)] = drivenUs;
+  xSemaphoreGive(relayLock);
+}
+
+// Switches whose loads are still waiting for their stagger step
+uint32_t staggerPending = 0;
+esp_timer_handle_t staggerTimer = NULL;
+
+// Bits of `levels` whose relay output currently has the load switched on
+static inline uint32_t loadOnBits(uint32_t levels) {
+  return (RELAY_LOAD_ON_LEVEL == HIGH) ? levels : ~levels;
+}
+
+// Switches on the next RELAY_STAGGER_GROUP pending loads, then re-arms itself while any
+// are left. Runs from actuateSwitchSnapshot() for the first group and from the esp_timer
+// task for the rest.
+static void staggerStep(void* arg) {
+  SwitchSnapshot group = { 0, 0 };
+  bool more;
+
+  portENTER_CRITICAL(&relayMux);
+  for (int i = 0, picked = 0; i < RELAY_COUNT && picked < RELAY_STAGGER_GROUP; i++) {
+    uint32_t bit = 1u << RELAYS[i].switchId;
+    if (staggerPending & bit) {
+      group.present |= bit;
+      picked++;
+    }
+  }
+  staggerPending &= ~group.present;
+  more = staggerPending != 0;
+  portEXIT_CRITICAL(&relayMux);
+
+  if (group.present) {
+    group.state = (RELAY_LOAD_ON_LEVEL == HIGH) ? group.present : 0;
+    applySwitchSnapshot(group);
+  }
+  if (more && !esp_timer_is_active(staggerTimer)) {
+    esp_timer_start_once(staggerTimer, RELAY_STAGGER_MS * 1000ULL);
+  }
+}
+
+// Drives the relays in `snapshot`. The full desired state is known up front: every change
+// that does not switch a load on goes out in one write, and loads that come on follow the
+// RELAY_STAGGER_MS schedule.
+void actuateSwitchSnapshot(const SwitchSnapshot& snapshot) {
+  if (RELAY_STAGGER_MS == 0) {
+    applySwitchSnapshot(snapshot);
+    return;
+  }
+
+  uint32_t turningOn = snapshot.present & loadOnBits(snapshot.state) & ~loadOnBits(relayLevels);
+  SwitchSnapshot immediate = { snapshot.present & ~turningOn, snapshot.state };
+
+  bool startSchedule;
+  portENTER_CRITICAL(&relayMux);
+  // A newer command replaces whatever was still scheduled for these switches
+  staggerPending = (staggerPending & ~snapshot.present) | turningOn;
+  startSchedule = turningOn && !esp_timer_is_active(staggerTimer);
+  portEXIT_CRITICAL(&relayMux);
+
+  if (immediate.present) applySwitchSnapshot(immediate);
+  if (startSchedule) staggerStep(NULL);
+}
+
+// Puts every relay in RELAY_BOOT_LEVEL. Called first thing in setup(), before anything
+// can block, so loads are never left in an undefined state while the network comes up.
+void beginRelays() {
+  relayLock = xSemaphoreCreateMutex();
+  esp_timer_create_args_t staggerTimerArgs = {};
+  staggerTimerArgs.callback = staggerStep;
+  staggerTimerArgs.name = "relayStagger";
+  esp_timer_create(&staggerTimerArgs, &staggerTimer);
+
+  // Output latches are loaded before the drivers are enabled, so there is no glitch
+  for (int i = 0; i < RELAY_COUNT; i++) {
+    if (RELAYS[i].bus == RELAY_BUS_GPIO) {
+      gpio_set_level((gpio_num_t)RELAYS[i].pin, RELAY_BOOT_LEVEL);
+      pinMode(RELAYS[i].pin, OUTPUT);
+    }
+    if (RELAY_BOOT_LEVEL == HIGH) relayLevels |= 1u << RELAYS[i].switchId;
+  }
+  shiftRegisterImage = (RELAY_BOOT_LEVEL == HIGH) ? 0xFFFF : 0;
+  pcf8574Image = (RELAY_BOOT_LEVEL == HIGH) ? 0xFF : 0;
+  if (relayBusUsed(RELAY_BUS_SHIFT_REGISTER)) {
+    pinMode(SHIFT_DATA_PIN, OUTPUT);
+    pinMode(SHIFT_CLOCK_PIN, OUTPUT);
+    pinMode(SHIFT_LATCH_PIN, OUTPUT);
+    writeShiftRegister();
+  }
+  if (relayBusUsed(RELAY_BUS_PCF8574)) {
+    Wire.begin(EXPANDER_SDA_PIN, EXPANDER_SCL_PIN);
+    writePcf8574();
+  }
+}
+
+// Bit n set when switch n has a relay
+constexpr uint32_t relaySwitchBits() {
+  uint32_t bits = 0;
+  for (int i = 0; i < RELAY_COUNT; i++) bits |= 1u << RELAYS[i].switchId;
+  return bits;
+}
+
+// True when every relay has held its load off for at least `ms`
+bool loadsOffFor(unsigned long ms) {
+  return (loadOnBits(relayLevels) & relaySwitchBits()) == 0 && millis() - lastRelayChangeMs >= ms;
+}
+
+// =======================================================================
+//   COMMAND PIPELINE
+// =======================================================================
+// Every switch command, whichever transport it came in on, goes through executeCommands():
+// the CommandSequencer (solaris_core.h) drops stale and duplicate commands before they
+// reach the relays, so a reconnect that replays the whole switchStates tree, or a retained
+// frame the device has already seen, drives nothing. What is left is actuated in one
+// actuateSwitchSnapshot() call.
+//
+// Each accepted command leaves an acknowledgement in pendingAcks[] (latest per switch wins).
+// networkTask() writes every acknowledgement whose relay has been driven to
+// /app/switchAcks/<id> in one multi-path update (flushCommandAcks()), at most every
+// COMMAND_ACK_FLUSH_MS. An acknowledgement carries the sequence number and state, the Unix
+// ms at which the GPIO was written, and the time from receipt to that write; the app
+// compares appliedAt with the issuedAt it wrote next to the command to get the end-to-end
+// toggle latency. Acknowledgements are written outside /app/switchStates so they do not
+// echo back down the command stream.
+//
+// Commands issued on the device itself (LOCAL AUTOMATION) are acknowledged the same way,
+// and the same update also writes their state to /app/switchStates/<id>/state, so the app
+// and the next stream snapshot show what the relay is doing. The echo that comes back
+// down the stream carries no sequence number and the state already commanded, so it drives
+// nothing. A command from the app that arrives before the flush replaces the pending
+// acknowledgement, and then the rule's state is never written over it.
+#define COMMAND_ACK_FLUSH_MS 250
+
+struct CommandAck {
+  uint32_t seq;
+  bool state;
+  bool drive;         // The relay has to be written; false when it was already in this state
+  bool local;         // Issued on the device: /app/switchStates is written as well
+  int64_t receivedUs; // esp_timer time the command arrived
+};
+
+// Receipt-to-GPIO latency, in microseconds, since boot
+struct ActuationLatency {
+  uint32_t lastUs;
+  uint32_t maxUs;
+  uint32_t count;
+};
+
+struct CommandStats {
+  uint32_t applied;
+  uint32_t unchanged;
+  uint32_t stale;
+};
+
+CommandSequencer commandSequencer = {};
+SemaphoreHandle_t commandLock = NULL; // Orders sequencing and actuation across transports
 
-volatile float voltageRMS = 0;
-volatile float currentRMS = 0;
-volatile float power = 0;
-volatile float temp = 0;
-volatile float hum = 0;
-volatile int ldrValue = 0;
+CommandAck pendingAcks[MAX_SWITCH_ID + 1];
+uint32_t ackPending = 0;
+portMUX_TYPE ackMux = portMUX_INITIALIZER_UNLOCKED;
 
-unsigned long lastSensorRead = 0;
-unsigned long lastFirebaseUpdate = 0;
+ActuationLatency actuationLatency = {};
+CommandStats commandStats = {};
+unsigned long lastAckFlushAt = 0;
 
-// Function to get the correct GPIO pin for a given switch ID
-int getPinForSwitch(int switchId) {
-  switch (switchId) {
-    case 1: return RELAY_1_PIN;
-    case 2: return RELAY_2_PIN;
-    case 3: return RELAY_3_PIN;
-    case 4: return RELAY_4_PIN;
-    case 5: return RELAY_5_PIN;
-    default: return -1; // Invalid pin
+// Sequences `commands` (with each switch's number in `seq`, or NULL when the commands carry
+// none) and drives the relays of the ones that change something. `receivedUs` is when the
+// transport handed them over. `local` marks commands issued on the device, whose states are
+// written back to /app/switchStates. Switches without a relay are ignored.
+void executeCommands(const SwitchSnapshot& commands, const uint32_t* seq, int64_t receivedUs, bool local = false) {
+  SwitchSnapshot apply = { 0, commands.state };
+  uint32_t acked = 0;
+
+  xSemaphoreTake(commandLock, portMAX_DELAY);
+  for (uint32_t bits = commands.present & relaySwitchBits(); bits; bits &= bits - 1) {
+    int switchId = __builtin_ctz(bits);
+    uint32_t commandSeq = seq ? seq[switchId] : 0;
+    switch (commandAccept(commandSequencer, switchId, commands.state & (1u << switchId), commandSeq)) {
+      case COMMAND_APPLY:
+        apply.present |= 1u << switchId;
+        acked |= 1u << switchId;
+        commandStats.applied++;
+        break;
+      case COMMAND_UNCHANGED:
+        if (commandSeq) acked |= 1u << switchId; // Confirms the newer number, nothing to drive
+        commandStats.unchanged++;
+        break;
+      case COMMAND_STALE:
+        commandStats.stale++;
+        break;
+    }
+  }
+
+  portENTER_CRITICAL(&ackMux);
+  for (uint32_t bits = acked; bits; bits &= bits - 1) {
+    int switchId = __builtin_ctz(bits);
+    CommandAck& ack = pendingAcks[switchId];
+    bool drive = apply.present & (1u << switchId);
+    ack.seq = seq ? seq[switchId] : 0;
+    // An unchanged command that lands while the previous one still waits for its stagger
+    // step only takes over its number
+    if (!drive && (ackPending & (1u << switchId)) && ack.drive) continue;
+    ack.state = commands.state & (1u << switchId);
+    ack.drive = drive;
+    ack.local = local;
+    ack.receivedUs = receivedUs;
   }
+  ackPending |= acked;
+  portEXIT_CRITICAL(&ackMux);
+
+  if (apply.present) actuateSwitchSnapshot(apply);
+  xSemaphoreGive(commandLock);
+}
+
+void beginCommandPipeline() {
+  commandLock = xSemaphoreCreateMutex();
 }
 
 // =======================================================================
 //   FIREBASE STREAM CALLBACK - This function handles incoming data
 // =======================================================================
+// **LOGIC INVERTED FOR NORMALLY CLOSED RELAYS**
+// App "ON" (true) -> Relay LOW to turn ON. DB state is false.
+// App "OFF" (false) -> Relay HIGH to turn OFF. DB state is true.
+//
+// The app writes each command as a PATCH of /app/switchStates/<id> with its state, seq and
+// issuedAt, which arrives here as a "/<id>" event. Bare "/<id>/state" writes are still
+// accepted, without a sequence number.
 void streamCallback(StreamData data) {
-  Serial.println("------------------------------------");
-  Serial.printf("Stream update received at path: %s\n", data.streamPath().c_str());
+  ProfileScope profile(PROF_STREAM_CALLBACK);
+  int64_t receivedUs = esp_timer_get_time();
 
-  FirebaseJson json;
+  // Stream paths such as "/4/state" fit in String's inline buffer, so this does not
+  // touch the heap.
   String dataPath = data.dataPath();
 
-  // This handles the initial load where the entire object is sent
-  if (data.dataTypeEnum() == fb_esp_data_type_json && dataPath == "/") {
-    Serial.println("Received initial JSON object for all switches.");
-    json.setJsonData(data.stringData());
-    
-    FirebaseJson::IteratorValue value;
-    size_t len = json.iteratorBegin();
-    String key;
-
-    for (size_t i = 0; i < len; i++) {
-      value = json.valueAt(i);
-      key = value.key;
-      int switchId = key.toInt();
-
-      if (switchId > 0) {
-        FirebaseJsonData result;
-        json.get(result, key + "/state"); 
-        if (result.success) {
-          bool switchState = result.to<bool>();
-          int pin = getPinForSwitch(switchId);
-          if (pin != -1) {
-            Serial.printf("Initial state for Switch %d: %s. Setting GPIO %d to %s (NC Logic)\n", 
-                          switchId, 
-                          switchState ? "OFF" : "ON", 
-                          pin, 
-                          switchState ? "HIGH" : "LOW");
-            digitalWrite(pin, switchState ? HIGH : LOW);
-          }
-        }
-      }
-    }
-    json.iteratorEnd();
-  } 
-  // This handles updates to a specific switch's state (e.g., from a PUT/PATCH)
-  // The path will be something like "/4/state"
-  else if (dataPath.indexOf("/state") != -1) {
-    dataPath.remove(dataPath.lastIndexOf("/state"));
-    if (dataPath.startsWith("/")) {
-        dataPath.remove(0, 1);
-    }
-    int switchId = dataPath.toInt();
-    
-    if (switchId > 0) {
-      bool switchState = data.to<bool>();
-      int pin = getPinForSwitch(switchId);
-
-      if (pin != -1) {
-        // **LOGIC INVERTED FOR NORMALLY CLOSED RELAYS**
-        // App "ON" (true) -> Relay LOW to turn ON. DB state is false.
-        // App "OFF" (false) -> Relay HIGH to turn OFF. DB state is true.
-        Serial.printf("Switch %d state from DB: %s. Setting GPIO %d to %s (NC Logic)\n", 
-                      switchId, 
-                      switchState ? "true (OFF)" : "false (ON)", 
-                      pin, 
-                      switchState ? "HIGH" : "LOW");
-        digitalWrite(pin, switchState ? HIGH : LOW);
-      }
+  // A single switch's state (e.g. from a PUT), path "/4/state"
+  int switchId = parseSwitchStatePath(dataPath.c_str());
+  if (switchId > 0) {
+    bool switchState = data.to<bool>();
+    SwitchSnapshot one = { 1u << switchId, switchState ? (1u << switchId) : 0 };
+    executeCommands(one, NULL, receivedUs);
+    return;
+  }
+  if (data.dataTypeEnum() != fb_esp_data_type_json) return;
+
+  uint32_t seq[MAX_SWITCH_ID + 1];
+  SwitchSnapshot snapshot;
+  switchId = parseSwitchObjectPath(dataPath.c_str());
+  if (switchId > 0) {
+    // A sequenced command for one switch, path "/4"
+    if (!parseSwitchObject(switchId, data.jsonString().c_str(), snapshot, seq)) return;
+  } else if (dataPath == "/") {
+    // The initial load (or a reconnect) where the entire object is sent. All states are
+    // collected first and then applied together.
+    if (!parseSwitchSnapshot(data.jsonString().c_str(), snapshot, seq)) {
+      Serial.println("Ignoring malformed switchStates snapshot.");
+      return;
     }
+  } else {
+    return;
   }
+  // Patches without a state are not commands, e.g. the per-relay metering this device
+  // writes back under each switch
+  if (snapshot.present == 0) return;
+  executeCommands(snapshot, seq, receivedUs);
 }
 
 void streamTimeoutCallback(bool timeout) {
@@ -166,179 +921,3606 @@ void streamTimeoutCallback(bool timeout) {
   }
 }
 
-// Sensor reading functions (placeholders/simplified for brevity)
-void calibrateCurrentSensor() {
-  Serial.println("Calibrating current sensor offset...");
-  long sum = 0;
-  for (int i = 0; i < 1000; i++) {
-    sum += analogRead(CURRENT_PIN);
-    delay(1);
-  }
-  currentOffset = sum / 1000.0;
-  Serial.print("Current sensor offset: "); Serial.println(currentOffset);
+// =======================================================================
+//   CONTINUOUS (DMA) ADC SAMPLING ENGINE
+// =======================================================================
+// The ADC1 digital controller scans VOLTAGE_PIN, CURRENT_PIN, BRANCH_CURRENT_PIN (with
+// BRANCH_METERING) and LDR_PIN in a fixed pattern and DMAs the conversions into
+// driver-owned frames. samplerTask() drains each frame into one ring per pin, so the power
+// meter and sensor reads only use finished samples and never wait on the ADC. While
+// continuous mode owns ADC1, analogRead() on these pins must not be used.
+#define ADC_CHANNEL_RATE_HZ 10000   // Conversions/s per pin (60 Hz mains: use 12000)
+#if BRANCH_METERING
+#define ADC_PATTERN_LEN 4           // VOLTAGE_PIN, CURRENT_PIN, BRANCH_CURRENT_PIN, LDR_PIN
+#else
+#define ADC_PATTERN_LEN 3           // VOLTAGE_PIN, CURRENT_PIN, LDR_PIN
+#endif
+#define ADC_LDR_SLOT (ADC_PATTERN_LEN - 1)
+#define ADC_SAMPLE_RATE_HZ (ADC_CHANNEL_RATE_HZ * ADC_PATTERN_LEN) // Across the whole pattern
+#define MAINS_FREQUENCY_HZ 50
+#define SAMPLES_PER_CYCLE (ADC_CHANNEL_RATE_HZ / MAINS_FREQUENCY_HZ) // 200
+#define RMS_WINDOW_CYCLES 10        // RMS is always taken over whole mains cycles
+#define RMS_WINDOW_SAMPLES (SAMPLES_PER_CYCLE * RMS_WINDOW_CYCLES)
+#define SAMPLE_RING_SIZE 4096       // Must be a power of two and larger than RMS_WINDOW_SAMPLES
+#define ADC_FRAME_SCANS 64
+#define ADC_FRAME_BYTES (SOC_ADC_DIGI_RESULT_BYTES * ADC_PATTERN_LEN * ADC_FRAME_SCANS)
+#define ADC_BUFFERED_FRAMES 4       // Frames the driver holds before samplerTask() reads them
+
+// The DMA result layout differs by target: TYPE1 on the ESP32, TYPE2 on the ESP32-S3
+#if CONFIG_IDF_TARGET_ESP32S3
+#define ADC_OUTPUT_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define ADC_RESULT_CHANNEL(result) ((result)->type2.channel)
+#define ADC_RESULT_DATA(result) ((result)->type2.data)
+#else
+#define ADC_OUTPUT_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define ADC_RESULT_CHANNEL(result) ((result)->type1.channel)
+#define ADC_RESULT_DATA(result) ((result)->type1.data)
+#endif
+
+#if !SIMULATED_SENSORS
+struct SampleRing {
+  uint16_t data[SAMPLE_RING_SIZE];
+  volatile uint32_t head = 0; // Total samples ever written; slot is head & (SAMPLE_RING_SIZE - 1)
+};
+
+SampleRing voltageRing;
+SampleRing currentRing;
+SampleRing ldrRing;
+
+adc_continuous_handle_t adcHandle = NULL;
+TaskHandle_t samplerTaskHandle = NULL;
+adc_channel_t adcChannels[ADC_PATTERN_LEN]; // Same order as the scan pattern
+
+static inline void pushSample(SampleRing& ring, uint16_t raw) {
+  uint32_t head = ring.head;
+  ring.data[head & (SAMPLE_RING_SIZE - 1)] = raw;
+  ring.head = head + 1;
 }
 
-float readVoltageRMS() {
-  const int samples = 100;
-  long sum = 0;
-  for (int i = 0; i < samples; i++) {
-    int raw = analogRead(VOLTAGE_PIN);
-    sum += (raw - 2048) * (raw - 2048);
-    delayMicroseconds(200);
+// Copies `count` samples from absolute index `start` on. Returns false if the sampler has
+// overwritten any of them by the time the copy is done.
+bool copySamples(const SampleRing& ring, uint32_t start, uint16_t* out, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    out[i] = ring.data[(start + i) & (SAMPLE_RING_SIZE - 1)];
   }
-  float rms = sqrt(sum / (float)samples);
-  float vRMS = (rms * VREF / ADC_MAX) * VOLTAGE_DIVIDER_RATIO * VOLTAGE_CALIBRATION;
-  return vRMS;
+  return ring.head - start <= SAMPLE_RING_SIZE;
 }
 
-float readCurrentRMS() {
-  const int samples = 200;
-  long sum = 0;
-  for (int i = 0; i < samples; i++) {
-    int raw = analogRead(CURRENT_PIN);
-    currentOffset = 0.999 * currentOffset + 0.001 * raw;
-    int centered = raw - currentOffset;
-    sum += (long)centered * (long)centered;
+// Copies the most recent `count` samples (oldest first). Returns false until the ring
+// has collected that many samples since boot.
+bool copyLatestSamples(const SampleRing& ring, uint16_t* out, uint32_t count) {
+  uint32_t head = ring.head;
+  if (head < count) return false;
+  uint32_t start = head - count;
+  for (uint32_t i = 0; i < count; i++) {
+    out[i] = ring.data[(start + i) & (SAMPLE_RING_SIZE - 1)];
   }
-  float rms = sqrt(sum / (float)samples);
-  float vRMS = (rms * VREF) / ADC_MAX;
-  float iRMS = vRMS / CURRENT_CALIBRATION_FACTOR;
-  return (iRMS < 0.05) ? 0.0 : iRMS;
+  return true;
 }
+#endif
 
-float readLux() {
-  int raw = analogRead(LDR_PIN);
-  return 4095 - raw; // Simplified, adjust as needed
-}
+// =======================================================================
+//   STREAMING POWER METER (DSP)
+// =======================================================================
+// Every scan yields a voltage sample immediately followed by a current sample, so the two
+// are treated as a simultaneous pair and fed to the PowerAccumulator in solaris_core.h.
+// When a window of whole mains cycles is complete it is turned into true RMS, real power,
+// apparent power and power factor, and energy is integrated here. All of this runs in
+// samplerTask(), so sensingTask() only copies the finished result.
+//
+// samplerTask() collects each DMA frame's pairs into two centered int16 arrays and hands
+// them over as one block (powerAccumulateBlock()), which gives the same integer sums as
+// pair-by-pair accumulation at a fraction of the cost: the per-pair work is five int16
+// multiply-accumulates instead of 64-bit sums. On the ESP32-S3 the moments are taken with
+// the PIE vector MACs, eight pairs per instruction, once a boot-time check has shown they
+// match the scalar kernel bit for bit; other targets use the scalar kernel.
+#define POWER_KERNEL_SIMD 1 // Use the PIE kernel when built for the ESP32-S3
+
+#if !SIMULATED_SENSORS
+struct PowerReading {
+  float voltageRMS;
+  float currentRMS;
+  float realPower;
+  float apparentPower;
+  float powerFactor;
+  float energyWh;
+  float currentOffset;
+  uint32_t windows; // Completed windows since boot
+};
 
-void readAllSensors() {
-  voltageRMS = readVoltageRMS();
-  currentRMS = readCurrentRMS();
-  power = voltageRMS * currentRMS;
+struct PowerMeter {
+  PowerAccumulator acc;
+  volatile bool trackOffset; // Follow the offset with the EMA; only safe while no load draws current
+  int64_t energyMilliJoules;
+  int64_t lastWindowUs;
+  PowerReading latest;
+};
 
-  float t_reading = dht.readTemperature();
-  float h_reading = dht.readHumidity();
-  if (!isnan(t_reading)) temp = t_reading;
-  if (!isnan(h_reading)) hum = h_reading;
+PowerMeter meter = {};
+portMUX_TYPE meterMux = portMUX_INITIALIZER_UNLOCKED;
 
-  ldrValue = readLux();
+// ADC counts -> volts at the mains side, and ADC counts -> amps through the ACS712
+PowerScale powerScale = {
+  (VREF / ADC_MAX) * VOLTAGE_DIVIDER_RATIO * VOLTAGE_CALIBRATION,
+  (VREF / ADC_MAX) / CURRENT_CALIBRATION_FACTOR,
+};
+const float WINDOW_SECONDS = RMS_WINDOW_SAMPLES / (float)ADC_CHANNEL_RATE_HZ;
+
+void powerMeterSetOffset(float offset) {
+  portENTER_CRITICAL(&meterMux);
+  powerAccumulatorSetOffset(meter.acc, offset);
+  portEXIT_CRITICAL(&meterMux);
 }
 
-void sendSensorDataToFirebase() {
-  if (WiFi.status() != WL_CONNECTED || !Firebase.ready()) return;
+void powerMeterSetVoltageCalibration(float calibration) {
+  powerScale.voltsPerCount = (VREF / ADC_MAX) * VOLTAGE_DIVIDER_RATIO * calibration;
+}
 
-  Serial.println("Sending sensor data to Firebase...");
+void powerMeterTrackOffset(bool track) {
+  meter.trackOffset = track;
+}
 
-  // Use a JSON object to send all data at once to a new timestamped entry
-  FirebaseJson json;
-  json.set("voltage", voltageRMS);
-  json.set("current", currentRMS);
-  json.set("power", power);
-  json.set("temperature", temp);
-  json.set("humidity", hum);
-  json.set("ldr", ldrValue);
-  json.set("timestamp/.sv", "timestamp"); // Correct way to set server value timestamp
+alignas(16) int16_t blockVoltage[ADC_FRAME_SCANS]; // Centered pairs of the frame being read
+alignas(16) int16_t blockCurrent[ADC_FRAME_SCANS];
+uint32_t blockPairs = 0;
+PowerMomentsKernel powerKernel = powerMomentsScalar;
+const char* powerKernelName = "scalar";
 
-  // Push a new entry under /app/energyData
-  if (Firebase.RTDB.pushJSON(&fbdo, "/app/energyData", &json)) {
-    Serial.println("Sensor data sent successfully.");
+#if POWER_KERNEL_SIMD && CONFIG_IDF_TARGET_ESP32S3
+alignas(16) static const int16_t PIE_ONES[8] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+
+// Sum of a[k] * b[k] over `groups` groups of 8 lanes, in the 40-bit ACCX accumulator.
+// bStep is 16 to walk b, or 0 to reuse its first 8 lanes. Both pointers 16-byte aligned.
+static inline int32_t pieDot16(const int16_t* a, const int16_t* b, uint32_t groups, int32_t bStep) {
+  int32_t sum;
+  const int32_t shift = 0;
+  asm volatile(
+    "ee.zero.accx\n"
+    "1:\n"
+    "ee.vld.128.ip q0, %[a], 16\n"
+    "ee.vld.128.xp q1, %[b], %[bStep]\n"
+    "ee.vmulas.s16.accx q0, q1\n"
+    "addi %[groups], %[groups], -1\n"
+    "bnez %[groups], 1b\n"
+    "ee.srs.accx %[sum], %[shift], 0\n"
+    : [sum] "=r"(sum), [a] "+r"(a), [b] "+r"(b), [groups] "+r"(groups)
+    : [bStep] "r"(bStep), [shift] "r"(shift)
+    : "memory");
+  return sum;
+}
+
+// Scalar up to the first 16-byte boundary and for the tail, PIE in between. Every sum
+// of a block fits in 32 bits (POWER_BLOCK_MAX), so ACCX saturation never applies.
+static void powerMomentsPie(const int16_t* v, const int16_t* r, uint32_t n, PowerMoments& m) {
+  uint32_t head = ((16 - ((uintptr_t)v & 15)) & 15) / sizeof(int16_t);
+  if (head > n || (((uintptr_t)v ^ (uintptr_t)r) & 15)) head = n;
+  uint32_t groups = (n - head) / 8;
+  powerMomentsScalar(v, r, head, m);
+  if (groups) {
+    const int16_t* pv = v + head;
+    const int16_t* pr = r + head;
+    m.sumV += pieDot16(pv, PIE_ONES, groups, 0);
+    m.sumR += pieDot16(pr, PIE_ONES, groups, 0);
+    m.sumVV += pieDot16(pv, pv, groups, 16);
+    m.sumRR += pieDot16(pr, pr, groups, 16);
+    m.sumVR += pieDot16(pv, pr, groups, 16);
+  }
+  uint32_t done = head + groups * 8;
+  if (done < n) {
+    PowerMoments tail;
+    powerMomentsScalar(v + done, r + done, n - done, tail);
+    m.sumV += tail.sumV;
+    m.sumR += tail.sumR;
+    m.sumVV += tail.sumVV;
+    m.sumRR += tail.sumRR;
+    m.sumVR += tail.sumVR;
+  }
+}
+#endif
+
+// Picks the fastest kernel that gives the scalar kernel's moments on a full-scale
+// pseudo-random block, including misaligned starts and ragged lengths.
+void selectPowerKernel() {
+#if POWER_KERNEL_SIMD && CONFIG_IDF_TARGET_ESP32S3
+  alignas(16) static int16_t testV[POWER_BLOCK_MAX];
+  alignas(16) static int16_t testR[POWER_BLOCK_MAX];
+  uint32_t seed = 0x2545f491;
+  for (int k = 0; k < POWER_BLOCK_MAX; k++) {
+    seed = seed * 1664525 + 1013904223;
+    testV[k] = (int16_t)((seed >> 20) & 0xfff) - VOLTAGE_MIDPOINT;
+    testR[k] = (int16_t)((seed >> 8) & 0xfff) - CURRENT_BLOCK_BIAS;
+  }
+  testV[0] = -VOLTAGE_MIDPOINT; // Largest products at both signs
+  testR[0] = -CURRENT_BLOCK_BIAS;
+  testV[1] = ADC_MAX - VOLTAGE_MIDPOINT;
+  testR[1] = ADC_MAX - CURRENT_BLOCK_BIAS;
+
+  const uint32_t starts[] = { 0, 3, 8 };
+  const uint32_t lengths[] = { POWER_BLOCK_MAX - 8, 61, 7 };
+  bool same = true;
+  for (uint32_t start : starts) {
+    for (uint32_t length : lengths) {
+      PowerMoments expected, got;
+      powerMomentsScalar(testV + start, testR + start, length, expected);
+      powerMomentsPie(testV + start, testR + start, length, got);
+      same = same && memcmp(&expected, &got, sizeof(expected)) == 0;
+    }
+  }
+  if (same) {
+    powerKernel = powerMomentsPie;
+    powerKernelName = "pie";
   } else {
-    Serial.printf("Failed to send data: %s\n", fbdo.errorReason().c_str());
+    Serial.println("PIE power kernel disagrees with the scalar kernel; using scalar");
   }
+#endif
+  Serial.printf("Power kernel: %s\n", powerKernelName);
 }
 
-void displayOnLCD() {
-  lcd.clear();
-  lcd.setCursor(0, 0);
-  lcd.print("V:");
-  lcd.print(voltageRMS, 0);
-  lcd.print("V A:");
-  lcd.print(currentRMS, 2);
-  lcd.print("A");
+static void powerMeterCloseWindow() {
+  ProfileScope profile(PROF_RMS_WINDOW);
+  PowerWindow w = powerWindowResult(meter.acc, powerScale);
 
-  lcd.setCursor(0, 1);
-  lcd.print("P:");
-  lcd.print(power, 0);
-  lcd.print("W LDR:");
-  lcd.print(ldrValue);
+  PowerReading r;
+  r.voltageRMS = w.voltageRMS;
+  r.currentRMS = w.currentRMS;
+  r.realPower = w.realPower;
+  r.apparentPower = w.apparentPower;
+  r.powerFactor = w.powerFactor;
+
+  // Energy covers the time since the previous window, which is longer than the window
+  // itself when POWER_SAVE samples in bursts
+  int64_t nowUs = esp_timer_get_time();
+  float seconds = meter.lastWindowUs ? (nowUs - meter.lastWindowUs) / 1e6f : WINDOW_SECONDS;
+  meter.lastWindowUs = nowUs;
+  meter.energyMilliJoules += (int64_t)(r.realPower * seconds * 1000.0f);
+  r.energyWh = meter.energyMilliJoules / 3600000.0;
+  r.currentOffset = powerAccumulatorOffset(meter.acc);
+
+  portENTER_CRITICAL(&meterMux);
+  r.windows = meter.latest.windows + 1;
+  meter.latest = r;
+  portEXIT_CRITICAL(&meterMux);
 }
 
-void setup() {
-  Serial.begin(115200);
-  analogReadResolution(12);
-
-  // Initialize pins
-  pinMode(RELAY_1_PIN, OUTPUT);
-  pinMode(RELAY_2_PIN, OUTPUT);
-  pinMode(RELAY_3_PIN, OUTPUT);
-  pinMode(RELAY_4_PIN, OUTPUT);
-  pinMode(RELAY_5_PIN, OUTPUT);
-  
-  pinMode(CONST_PIN, OUTPUT);
-  analogWrite(CONST_PIN, 80); // Set LCD brightness
+// Called with the simultaneous voltage/current pairs collected from one DMA frame.
+// Returns true if they completed a window.
+static bool powerMeterUpdateBlock(const int16_t* v, const int16_t* r, uint32_t n) {
+  bool track = meter.trackOffset;
+  bool closed = false;
+  while (n) {
+    uint32_t taken = powerAccumulateBlock(meter.acc, v, r, n, track, RMS_WINDOW_SAMPLES, powerKernel);
+    if (meter.acc.count >= RMS_WINDOW_SAMPLES) {
+      powerMeterCloseWindow();
+      closed = true;
+    }
+    v += taken;
+    r += taken;
+    n -= taken;
+  }
+  return closed;
+}
 
-  dht.begin();
-  lcd.begin(16, 2);
-  lcd.clear();
-  lcd.print("System Booting...");
-  delay(1000);
+static inline bool flushPowerBlock() {
+  bool closed = powerMeterUpdateBlock(blockVoltage, blockCurrent, blockPairs);
+  blockPairs = 0;
+  return closed;
+}
 
-  // Connect to WiFi
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  Serial.print("Connecting to WiFi");
-  lcd.clear();
-  lcd.print("Connecting WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    Serial.print(".");
-    delay(500);
+PowerReading latestPowerReading() {
+  portENTER_CRITICAL(&meterMux);
+  PowerReading r = meter.latest;
+  portEXIT_CRITICAL(&meterMux);
+  return r;
+}
+#endif
+
+// =======================================================================
+//   PER-RELAY METERING (multiplexed scan)
+// =======================================================================
+// BRANCH_CURRENT_PIN is one slot of the ADC pattern; the mux decides which relay's sensor
+// it sees. The scan dwells on one BRANCH_SENSORS[] row for a settle period plus one
+// RMS_WINDOW_SAMPLES window, paired with the voltage sample of the same scan, then selects
+// the next row. Each row gets its own PowerAccumulator, so each sensor has its own offset.
+// Switching the mux is a few GPIO writes from samplerTask(), so adding sensors only makes
+// the round longer (BRANCH_METER_COUNT x BRANCH_DWELL_MS); it never adds ADC load or blocks.
+// A row's power is held over the rest of the round for its energy count.
+#define BRANCH_SETTLE_SCANS (ADC_FRAME_SCANS * (ADC_BUFFERED_FRAMES + 1)) // Scans still in flight when the mux moves
+#define BRANCH_DWELL_MS ((BRANCH_SETTLE_SCANS + RMS_WINDOW_SAMPLES) * 1000 / ADC_CHANNEL_RATE_HZ)
+
+#if BRANCH_METERING
+struct BranchReading {
+  float currentRMS;
+  float realPower;
+  float powerFactor;
+  float energyWh;
+  float currentOffset;
+  uint32_t windows;
+};
+
+struct BranchMeter {
+  PowerAccumulator acc;
+  int64_t energyMilliJoules;
+  int64_t lastWindowUs;
+  BranchReading latest;
+};
+
+BranchMeter branchMeters[BRANCH_METER_COUNT] = {};
+volatile uint32_t branchTrackOffset = 0; // Bit n: follow the offset of BRANCH_SENSORS[n]
+int branchSlot = 0;                      // Row the mux is on; samplerTask() only
+uint32_t branchSettle = 0;               // Scans left to discard after a mux change
+portMUX_TYPE branchMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void selectBranchMux(uint8_t channel) {
+  for (int bit = 0; bit < 3; bit++) {
+    gpio_set_level((gpio_num_t)BRANCH_MUX_SELECT_PINS[bit], (channel >> bit) & 1);
   }
-  Serial.println("\nWiFi Connected!");
-  lcd.clear();
-  lcd.print("WiFi Connected!");
-  delay(1000);
+}
 
-  // Configure Firebase
-  config.database_url = FIREBASE_HOST;
-  config.signer.tokens.legacy_token = FIREBASE_AUTH_SECRET;
+void branchMeterSetOffset(int branch, float offset) {
+  portENTER_CRITICAL(&branchMux);
+  powerAccumulatorSetOffset(branchMeters[branch].acc, offset);
+  portEXIT_CRITICAL(&branchMux);
+}
 
-  Firebase.begin(&config, &auth);
-  Firebase.reconnectWiFi(true);
+static void branchMeterCloseWindow(int branch) {
+  BranchMeter& b = branchMeters[branch];
+  PowerScale scale = { powerScale.voltsPerCount, (VREF / ADC_MAX) / BRANCH_SENSORS[branch].voltsPerAmp };
+  PowerWindow w = powerWindowResult(b.acc, scale);
 
-  // Calibrate sensor and perform initial read
-  calibrateCurrentSensor();
-  readAllSensors();
-  displayOnLCD();
+  int64_t nowUs = esp_timer_get_time();
+  if (b.lastWindowUs) b.energyMilliJoules += (int64_t)(w.realPower * ((nowUs - b.lastWindowUs) / 1000.0f));
+  b.lastWindowUs = nowUs;
 
-  // =======================================================================
-  //   START FIREBASE STREAM
-  // =======================================================================
-  // This is the crucial part that listens for changes from your web app.
-  // The path "/app/switchStates" must exactly match what the web app uses.
-  if (!Firebase.RTDB.beginStream(&stream, "/app/switchStates")) {
-    Serial.printf("Could not begin stream: %s\n", stream.errorReason().c_str());
+  BranchReading r;
+  r.currentRMS = w.currentRMS;
+  r.realPower = w.realPower;
+  r.powerFactor = w.powerFactor;
+  r.energyWh = b.energyMilliJoules / 3600000.0;
+  r.currentOffset = powerAccumulatorOffset(b.acc);
+
+  portENTER_CRITICAL(&branchMux);
+  r.windows = b.latest.windows + 1;
+  b.latest = r;
+  portEXIT_CRITICAL(&branchMux);
+}
+
+// Called once per voltage/branch-current sample pair. Returns true when it completed a
+// window and moved the mux on.
+static inline bool branchMeterUpdate(uint16_t rawVoltage, uint16_t rawCurrent) {
+  if (branchSettle) {
+    branchSettle--;
+    return false;
   }
+  bool track = branchTrackOffset & (1u << branchSlot);
+  if (!powerAccumulate(branchMeters[branchSlot].acc, rawVoltage, rawCurrent, track, RMS_WINDOW_SAMPLES)) return false;
 
-  Firebase.RTDB.setStreamCallback(&stream, streamCallback, streamTimeoutCallback);
-  
-  Serial.println("\nSetup complete. System is running.");
-  lcd.clear();
-  lcd.print("System Ready!");
+  branchMeterCloseWindow(branchSlot);
+  if (BRANCH_METER_COUNT > 1) {
+    branchSlot = (branchSlot + 1) % BRANCH_METER_COUNT;
+    selectBranchMux(BRANCH_SENSORS[branchSlot].muxChannel);
+    branchSettle = BRANCH_SETTLE_SCANS;
+  }
+  return true;
 }
 
-void loop() {
-  // The loop handles non-blocking sensor reads and Firebase updates.
-  // The stream for switches runs automatically in the background.
+BranchReading latestBranchReading(int branch) {
+  portENTER_CRITICAL(&branchMux);
+  BranchReading r = branchMeters[branch].latest;
+  portEXIT_CRITICAL(&branchMux);
+  return r;
+}
+
+void beginBranchMetering() {
+  for (uint8_t pin : BRANCH_MUX_SELECT_PINS) pinMode(pin, OUTPUT);
+  for (int i = 0; i < BRANCH_METER_COUNT; i++) {
+    powerAccumulatorSetOffset(branchMeters[i].acc, currentOffset);
+  }
+  selectBranchMux(BRANCH_SENSORS[0].muxChannel);
+  branchSettle = BRANCH_SETTLE_SCANS;
+}
+#endif
+
+// =======================================================================
+//   POWER MANAGEMENT
+// =======================================================================
+// With POWER_SAVE enabled the ADC no longer runs continuously. A timer starts one sampling
+// burst every SENSOR_INTERVAL_MS, long enough for one power window and one per-relay
+// window (BRANCH_DWELL_MS). samplerTask() stops the ADC as soon as that branch window
+// closes, so each burst meters one BRANCH_SENSORS[] row and a full per-relay round takes
+// BRANCH_METER_COUNT bursts; without BRANCH_METERING the burst ends with the power window.
+// With POWER_QUALITY a burst also lasts at least PQ_SNAPSHOT_SAMPLES pairs (BURST_MIN_PAIRS),
+// so every burst holds one whole power quality snapshot.
+// The ADC driver holds the APB frequency at maximum only while it runs. Between bursts
+// dynamic frequency scaling drops the CPU to POWER_MIN_FREQ_MHZ and FreeRTOS can enter
+// automatic light sleep. Automatic light sleep needs an Arduino core built with
+// CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE; without them, esp_pm_configure()
+// fails and the CPU stays at full clock.
+//
+// WiFi uses modem sleep and wakes every WIFI_LISTEN_INTERVAL beacons, which bounds how long
+// a relay command waits at the access point: ~3 x 102.4 ms by default. The relay is driven
+// as soon as the stream task sees the command; waking from light sleep takes well under
+// 1 ms.
+//
+// Supply current is not measured on the board, so the gain is estimated. The time the
+// sampler actually ran in each FIREBASE_INTERVAL_MS is measured and weighted with the
+// POWER_MODEL_* currents (ESP32 datasheet, typical). The result is compared with the same
+// interval sampled continuously; see powerBudgetStep(). Check the model against a USB
+// power meter when changing it. The latest interval and the charge saved since boot go to
+// /app/powerBudget every POWER_REPORT_MS.
+#define POWER_MAX_FREQ_MHZ 240
+#define POWER_MIN_FREQ_MHZ 80          // DFS floor between bursts
+#define WIFI_POWER_SAVE WIFI_PS_MAX_MODEM
+#define WIFI_LISTEN_INTERVAL 3         // ESP-IDF default listen interval for WIFI_PS_MAX_MODEM
+#define POWER_MODEL_ACTIVE_MA 50.0     // CPU at 240 MHz, radio in modem sleep
+#define POWER_MODEL_IDLE_MA 20.0       // CPU at 80 MHz, radio in modem sleep
+#define POWER_MODEL_LIGHT_SLEEP_MA 3.0 // Light sleep, averaged over the beacon wakes
+#define POWER_REPORT_MS 60000
+#define BURST_ENDS_ON_POWER_WINDOW (POWER_SAVE && !BRANCH_METERING)
+
+#if POWER_SAVE && SIMULATED_SENSORS
+#error "POWER_SAVE samples in bursts and needs the ADC sampler; set it to 0 with SIMULATED_SENSORS"
+#endif
 
-  // Read sensors every 2 seconds
-  if (millis() - lastSensorRead > 2000) {
-    lastSensorRead = millis();
-    readAllSensors();
-    displayOnLCD();
+struct PowerBudget {
+  float samplerDuty;  // Share of the interval the ADC was running
+  float estimatedMa;  // Average supply current over the interval
+  float savedMa;      // Against the same interval sampled continuously at full clock
+  float savedMah;     // Charge saved in the interval
+};
+
+bool frequencyScaling = false;
+bool lightSleepEnabled = false;
+esp_timer_handle_t burstTimer = NULL;
+volatile bool samplingBurstActive = false;
+volatile bool samplingBurstStarting = false; // Set by the timer, cleared by samplerTask()
+int64_t burstStartedUs = 0;
+int64_t samplingActiveUs = 0;  // ADC-on time since the budget interval began
+int64_t budgetStartedUs = 0;
+PowerBudget lastPowerBudget = {};
+uint32_t powerBudgetIntervals = 0; // Closed by powerBudgetStep() since boot
+float savedMahSinceBoot = 0;
+portMUX_TYPE powerMux = portMUX_INITIALIZER_UNLOCKED;
+
+#if !SIMULATED_SENSORS
+// esp_timer callback, every SENSOR_INTERVAL_MS
+static void startSamplingBurst(void* arg) {
+  if (samplingBurstActive) return; // The previous burst is still running
+  burstStartedUs = esp_timer_get_time();
+  samplingBurstStarting = true;
+  samplingBurstActive = true;
+  adc_continuous_start(adcHandle);
+}
+
+// Called by samplerTask() once the burst's windows are complete. Conversions taken after
+// the windows closed are discarded so the next burst starts from fresh samples.
+static void endSamplingBurst(uint8_t* frame) {
+  adc_continuous_stop(adcHandle);
+  uint32_t length = 0;
+  while (adc_continuous_read(adcHandle, frame, ADC_FRAME_BYTES, &length, 0) == ESP_OK) {
+  }
+  portENTER_CRITICAL(&powerMux);
+  samplingActiveUs += esp_timer_get_time() - burstStartedUs;
+  portEXIT_CRITICAL(&powerMux);
+  samplingBurstActive = false;
+}
+#endif
+
+// DFS and automatic light sleep. Runs in setup() before sampling starts.
+void beginPowerManagement() {
+  budgetStartedUs = esp_timer_get_time();
+#if POWER_SAVE
+  esp_pm_config_t pm = {};
+  pm.max_freq_mhz = POWER_MAX_FREQ_MHZ;
+  pm.min_freq_mhz = POWER_MIN_FREQ_MHZ;
+  pm.light_sleep_enable = true;
+  lightSleepEnabled = esp_pm_configure(&pm) == ESP_OK;
+  frequencyScaling = lightSleepEnabled;
+  if (!lightSleepEnabled) {
+    // Try DFS on its own, then give up and run at full clock
+    pm.light_sleep_enable = false;
+    esp_err_t err = esp_pm_configure(&pm);
+    frequencyScaling = err == ESP_OK;
+    if (!frequencyScaling) {
+      Serial.printf("Power management unavailable (%s), running at full clock.\n", esp_err_to_name(err));
+    }
   }
 
-  // Send data to Firebase every 10 seconds
-  if (millis() - lastFirebaseUpdate > 10000) {
-    lastFirebaseUpdate = millis();
-    sendSensorDataToFirebase();
+  esp_timer_create_args_t burstArgs = {};
+  burstArgs.callback = startSamplingBurst;
+  burstArgs.name = "sampleBurst";
+  esp_timer_create(&burstArgs, &burstTimer);
+#endif
+}
+
+// Closes the budget interval every FIREBASE_INTERVAL_MS. Runs from networkTask().
+void powerBudgetStep() {
+  int64_t nowUs = esp_timer_get_time();
+  int64_t elapsedUs = nowUs - budgetStartedUs;
+  if (elapsedUs < FIREBASE_INTERVAL_MS * 1000LL) return;
+
+  portENTER_CRITICAL(&powerMux);
+  int64_t activeUs = samplingActiveUs;
+  samplingActiveUs = 0;
+  portEXIT_CRITICAL(&powerMux);
+  budgetStartedUs = nowUs;
+
+  PowerBudget budget;
+  budget.samplerDuty = POWER_SAVE ? fminf(1.0f, activeUs / (float)elapsedUs) : 1.0f;
+  float restMa = lightSleepEnabled ? POWER_MODEL_LIGHT_SLEEP_MA
+                 : frequencyScaling ? POWER_MODEL_IDLE_MA
+                                    : POWER_MODEL_ACTIVE_MA;
+  budget.estimatedMa = budget.samplerDuty * POWER_MODEL_ACTIVE_MA + (1 - budget.samplerDuty) * restMa;
+  budget.savedMa = POWER_MODEL_ACTIVE_MA - budget.estimatedMa;
+  budget.savedMah = budget.savedMa * (elapsedUs / 3.6e9f);
+  lastPowerBudget = budget;
+  savedMahSinceBoot += budget.savedMah;
+  powerBudgetIntervals++;
+}
+
+// Writes the latest budget interval to /app/powerBudget. Runs from networkTask() every
+// POWER_REPORT_MS while online, and only once an interval has closed since the last write.
+void publishPowerBudget() {
+  static uint32_t publishedIntervals = 0;
+  if (powerBudgetIntervals == publishedIntervals) return;
+
+  PowerBudget budget = lastPowerBudget;
+  FirebaseJson json;
+  json.set("lightSleep", lightSleepEnabled);
+  json.set("frequencyScaling", frequencyScaling);
+  json.set("samplerDuty", budget.samplerDuty);
+  json.set("estimatedMa", budget.estimatedMa);
+  json.set("savedMa", budget.savedMa);
+  json.set("savedMahPerInterval", budget.savedMah);
+  json.set("savedMahSinceBoot", savedMahSinceBoot);
+  json.set("updatedAt/.sv", "timestamp");
+  if (Firebase.RTDB.setJSON(&fbdo, "/app/powerBudget", &json)) {
+    publishedIntervals = powerBudgetIntervals;
+  } else {
+    Serial.printf("Failed to publish the power budget: %s\n", fbdo.errorReason().c_str());
   }
 }
+
+// =======================================================================
+//   POWER QUALITY ENGINE
+// =======================================================================
+// With POWER_QUALITY enabled, pqTask() turns the raw sample rings into power quality data
+// using the POWER QUALITY part of solaris_core.h:
+//  - Every PQ_INTERVAL_MS it copies PQ_SNAPSHOT_SAMPLES voltage/current pairs and runs
+//    pqAnalyze(): frequency, THD and the first PQ_HARMONICS harmonics of both channels.
+//    With POWER_SAVE the snapshot is taken from each burst as it ends.
+//  - It follows every voltage sample through the sag/swell detector.
+// pqTask() runs at PQ_TASK_PRIORITY, below every other task, so it only uses idle CPU time
+// and can never delay sensingTask()'s SENSOR_INTERVAL_MS cadence. The rings hold
+// SAMPLE_RING_SIZE samples (~0.4 s); if the task falls further behind than that, the
+// detector restarts from the newest sample and the skipped samples count as a gap.
+// Under POWER_SAVE, which is off by default with POWER_QUALITY, the detector only sees the
+// bursts (~230 ms of every SENSOR_INTERVAL_MS), so the sag and swell counts are a sample,
+// not a complete record. /app/powerQuality carries the share it saw as eventCoverage.
+//
+// Only a summary reaches telemetry: frequency, THD, and sag and swell counts since boot.
+// The harmonics and the last event go to /app/powerQuality every PQ_REPORT_MS.
+#define PQ_INTERVAL_MS 2000
+#define PQ_REPORT_MS 60000
+#define PQ_TICK_MS 100                // Detector catch-up period, well inside the ring
+#define PQ_TASK_PRIORITY 1            // Shares the lowest level with lcdTask
+#define PQ_SNAPSHOT_SAMPLES (PQ_CYCLES * SAMPLES_PER_CYCLE + SAMPLES_PER_CYCLE * 3 / 2) // Down to ~48 Hz
+#define PQ_REPORTED_HARMONICS 9       // h = 1..9 written to /app/powerQuality
+#define PQ_RING_MARGIN 512            // Samples the sampler may write while the detector reads
+
+// Shortest POWER_SAVE burst, in voltage/current pairs: snapshots are never taken across bursts
+#define BURST_MIN_PAIRS (POWER_QUALITY ? PQ_SNAPSHOT_SAMPLES : 0)
+
+static_assert(PQ_SNAPSHOT_SAMPLES < SAMPLE_RING_SIZE, "The power quality snapshot must fit the sample rings");
+static_assert(!POWER_QUALITY || BURST_MIN_PAIRS >= PQ_SNAPSHOT_SAMPLES,
+              "A POWER_SAVE burst must hold a whole power quality snapshot");
+#if POWER_QUALITY && SIMULATED_SENSORS
+#error "POWER_QUALITY analyses the sampled waveforms; set it to 0 with SIMULATED_SENSORS"
+#endif
+
+struct PowerQualitySummary {
+  float frequencyHz;       // 0 until the first analysis
+  float thdVoltage;        // %, -1 until measured or while the channel is idle
+  float thdCurrent;
+  float voltageFundamental; // Volts RMS
+  float currentFundamental; // Amps RMS
+  float voltageHarmonics[PQ_REPORTED_HARMONICS]; // % of the fundamental, h at [h - 1]
+  float currentHarmonics[PQ_REPORTED_HARMONICS];
+  uint32_t analyses;
+  uint32_t sags;           // Since boot
+  uint32_t swells;
+  uint32_t gaps;           // Times the detector fell behind the ring
+  VoltageEvent lastEvent;  // kind VOLTAGE_EVENT_NONE until the first one
+  uint32_t lastEventUnix;  // 0 if the clock had not synced
+};
+
+PowerQualitySummary powerQuality = { 0, -1, -1 };
+portMUX_TYPE powerQualityMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint32_t burstFirstSample = 0; // voltageRing index where the current burst began
+TaskHandle_t pqTaskHandle = NULL;
+
+#if POWER_QUALITY
+PqWorkspace pqWorkspace;
+uint16_t pqVoltage[PQ_SNAPSHOT_SAMPLES];
+uint16_t pqCurrent[PQ_SNAPSHOT_SAMPLES];
+VoltageEventDetector pqDetector;
+uint32_t pqCursor = 0; // Next voltageRing sample for the detector
+
+// Copies the newest simultaneous pairs. Voltage and current are pushed once per scan, so
+// index n of both rings comes from one scan. Returns false if there are not enough yet, or
+// (POWER_SAVE) the last burst was shorter than the snapshot.
+static bool copyPowerQualitySnapshot() {
+  uint32_t end = currentRing.head; // Each of these currents has its voltage in voltageRing
+  if (end < PQ_SNAPSHOT_SAMPLES) return false;
+  if (POWER_SAVE && end - burstFirstSample < PQ_SNAPSHOT_SAMPLES) return false;
+  uint32_t start = end - PQ_SNAPSHOT_SAMPLES;
+  return copySamples(voltageRing, start, pqVoltage, PQ_SNAPSHOT_SAMPLES) &&
+         copySamples(currentRing, start, pqCurrent, PQ_SNAPSHOT_SAMPLES);
+}
+
+static void analyzePowerQuality() {
+  if (!copyPowerQualitySnapshot()) return;
+  PowerQuality pq;
+  if (!pqAnalyze(pqVoltage, pqCurrent, PQ_SNAPSHOT_SAMPLES, ADC_CHANNEL_RATE_HZ, pqWorkspace, pq)) return;
+
+  portENTER_CRITICAL(&powerQualityMux);
+  powerQuality.frequencyHz = pq.frequencyHz;
+  powerQuality.thdVoltage = pq.thdVoltage;
+  powerQuality.thdCurrent = pq.thdCurrent;
+  powerQuality.voltageFundamental = pq.voltageFundamental * powerScale.voltsPerCount;
+  powerQuality.currentFundamental = pq.currentFundamental * powerScale.ampsPerCount;
+  memcpy(powerQuality.voltageHarmonics, pq.voltageHarmonics, sizeof(powerQuality.voltageHarmonics));
+  memcpy(powerQuality.currentHarmonics, pq.currentHarmonics, sizeof(powerQuality.currentHarmonics));
+  powerQuality.analyses++;
+  portEXIT_CRITICAL(&powerQualityMux);
+}
+
+static void recordVoltageEvent(const VoltageEvent& event) {
+  time_t now = time(nullptr);
+  portENTER_CRITICAL(&powerQualityMux);
+  if (event.kind == VOLTAGE_EVENT_SAG) powerQuality.sags++; else powerQuality.swells++;
+  powerQuality.lastEvent = event;
+  powerQuality.lastEventUnix = now >= CLOCK_VALID_AFTER ? (uint32_t)now : 0;
+  portEXIT_CRITICAL(&powerQualityMux);
+  Serial.printf("Voltage %s: %u ms at %.0f%% of the reference\n", event.kind == VOLTAGE_EVENT_SAG ? "sag" : "swell",
+                (unsigned)(event.halfCycles * 500 / MAINS_FREQUENCY_HZ), 100 * event.extreme);
+}
+
+// Feeds the voltage samples written since the last call to the sag/swell detector.
+static void followVoltageEvents() {
+  uint32_t head = voltageRing.head;
+  if (head - pqCursor > SAMPLE_RING_SIZE - PQ_RING_MARGIN) {
+    pqCursor = head;
+    voltageEventRestart(pqDetector);
+    portENTER_CRITICAL(&powerQualityMux);
+    powerQuality.gaps++;
+    portEXIT_CRITICAL(&powerQualityMux);
+    return;
+  }
+  const uint32_t burstStart = burstFirstSample;
+  for (; pqCursor != head; pqCursor++) {
+    if (pqCursor == burstStart) voltageEventRestart(pqDetector); // Bursts do not join up in time
+    int32_t v = (int32_t)voltageRing.data[pqCursor & (SAMPLE_RING_SIZE - 1)] - VOLTAGE_MIDPOINT;
+    VoltageEvent event;
+    if (voltageEventUpdate(pqDetector, v, event)) recordVoltageEvent(event);
+  }
+}
+
+void pqTask(void* param) {
+  unsigned long lastAnalysisAt = 0;
+  for (;;) {
+    // A notification means a POWER_SAVE burst has just ended
+    bool burstEnded = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PQ_TICK_MS)) > 0;
+    followVoltageEvents();
+    if (POWER_SAVE ? burstEnded : millis() - lastAnalysisAt >= PQ_INTERVAL_MS) {
+      lastAnalysisAt = millis();
+      analyzePowerQuality();
+    }
+  }
+}
+#endif
+
+// Called by samplerTask() with the POWER_SAVE burst it has just stopped.
+static inline void powerQualityBurstDone() {
+  if (pqTaskHandle) xTaskNotifyGive(pqTaskHandle);
+}
+
+void beginPowerQuality() {
+#if POWER_QUALITY
+  pqInit(pqWorkspace);
+  voltageEventInit(pqDetector, SAMPLES_PER_CYCLE / 2);
+  pqCursor = voltageRing.head;
+  xTaskCreatePinnedToCore(pqTask, "powerQuality", 4096, NULL, PQ_TASK_PRIORITY, &pqTaskHandle, 1);
+#endif
+}
+
+PowerQualitySummary currentPowerQuality() {
+  portENTER_CRITICAL(&powerQualityMux);
+  PowerQualitySummary summary = powerQuality;
+  portEXIT_CRITICAL(&powerQualityMux);
+  return summary;
+}
+
+// Writes the latest analysis to /app/powerQuality. Called from networkTask() while online.
+void publishPowerQuality() {
+#if POWER_QUALITY
+  static uint32_t publishedAnalyses = 0;
+  PowerQualitySummary pq = currentPowerQuality();
+  if (pq.analyses == publishedAnalyses) return;
+
+  FirebaseJson json;
+  json.set("frequency", pq.frequencyHz);
+  json.set("thdVoltage", pq.thdVoltage);
+  json.set("thdCurrent", pq.thdCurrent);
+  json.set("voltageFundamental", pq.voltageFundamental);
+  json.set("currentFundamental", pq.currentFundamental);
+  for (int h = 1; h <= PQ_REPORTED_HARMONICS; h++) {
+    char path[32];
+    snprintf(path, sizeof(path), "voltageHarmonics/%d", h);
+    json.set(path, pq.voltageHarmonics[h - 1]);
+    snprintf(path, sizeof(path), "currentHarmonics/%d", h);
+    json.set(path, pq.currentHarmonics[h - 1]);
+  }
+  json.set("sags", (unsigned long)pq.sags);
+  json.set("swells", (unsigned long)pq.swells);
+  // Share of the time the detector saw; the counts only cover that much
+  json.set("eventCoverage", POWER_SAVE ? lastPowerBudget.samplerDuty : 1.0f);
+  json.set("gaps", (unsigned long)pq.gaps);
+  if (pq.lastEvent.kind != VOLTAGE_EVENT_NONE) {
+    json.set("lastEvent/kind", pq.lastEvent.kind == VOLTAGE_EVENT_SAG ? "sag" : "swell");
+    json.set("lastEvent/durationMs", (int)(pq.lastEvent.halfCycles * 500 / MAINS_FREQUENCY_HZ));
+    json.set("lastEvent/percentOfReference", 100 * pq.lastEvent.extreme);
+    if (pq.lastEventUnix) json.set("lastEvent/at", (double)pq.lastEventUnix * 1000);
+  }
+  json.set("updatedAt/.sv", "timestamp");
+  if (Firebase.RTDB.setJSON(&fbdo, "/app/powerQuality", &json)) {
+    publishedAnalyses = pq.analyses;
+  } else {
+    Serial.printf("Failed to publish power quality: %s\n", fbdo.errorReason().c_str());
+  }
+#endif
+}
+
+// =======================================================================
+//   SAMPLER TASK
+// =======================================================================
+#if !SIMULATED_SENSORS
+// Runs in ISR context whenever the DMA has completed one conversion frame.
+static bool IRAM_ATTR onAdcFrameDone(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* edata, void* user_data) {
+  BaseType_t mustYield = pdFALSE;
+  vTaskNotifyGiveFromISR(samplerTaskHandle, &mustYield);
+  return mustYield == pdTRUE;
+}
+
+void samplerTask(void* param) {
+  static uint8_t frame[ADC_FRAME_BYTES];
+  bool windowsDone = false; // The burst's power and branch windows are complete
+  uint16_t pendingVoltage = 0;
+  bool havePendingVoltage = false;
+  bool haveBranchVoltage = false;
+  (void)haveBranchVoltage; // Only read with BRANCH_METERING
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    uint32_t length = 0;
+    bool burstDone = false;
+    while (!burstDone && adc_continuous_read(adcHandle, frame, ADC_FRAME_BYTES, &length, 0) == ESP_OK) {
+      ProfileScope profile(PROF_SAMPLER_FRAME);
+      if (samplingBurstStarting) {
+        // A burst starts a fresh power window; the branch window starts after its settle
+        samplingBurstStarting = false;
+        powerAccumulatorClear(meter.acc);
+        blockPairs = 0;
+        burstFirstSample = voltageRing.head;
+        windowsDone = false;
+        havePendingVoltage = false;
+        haveBranchVoltage = false;
+      }
+      for (uint32_t i = 0; !burstDone && i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+        const adc_digi_output_data_t* result = (const adc_digi_output_data_t*)&frame[i];
+        uint16_t raw = ADC_RESULT_DATA(result);
+        adc_channel_t channel = (adc_channel_t)ADC_RESULT_CHANNEL(result);
+        if (channel == adcChannels[0]) {
+          pushSample(voltageRing, raw);
+          pendingVoltage = raw;
+          havePendingVoltage = true;
+          haveBranchVoltage = true;
+        } else if (channel == adcChannels[1]) {
+          pushSample(currentRing, raw);
+          // Pattern order is voltage then current, so this completes a V.I pair
+          if (havePendingVoltage) {
+            blockVoltage[blockPairs] = (int16_t)pendingVoltage - VOLTAGE_MIDPOINT;
+            blockCurrent[blockPairs] = (int16_t)raw - CURRENT_BLOCK_BIAS;
+            if (++blockPairs == ADC_FRAME_SCANS && flushPowerBlock()) windowsDone |= BURST_ENDS_ON_POWER_WINDOW;
+            havePendingVoltage = false;
+          }
+#if BRANCH_METERING
+        } else if (channel == adcChannels[2]) {
+          // The branch current pairs with the same scan's voltage, taken two slots earlier
+          if (haveBranchVoltage) {
+            if (branchMeterUpdate(pendingVoltage, raw)) windowsDone |= POWER_SAVE;
+            haveBranchVoltage = false;
+          }
+#endif
+        } else if (channel == adcChannels[ADC_LDR_SLOT]) {
+          pushSample(ldrRing, raw);
+        }
+        burstDone = windowsDone && currentRing.head - burstFirstSample >= BURST_MIN_PAIRS;
+      }
+      if (flushPowerBlock()) windowsDone |= BURST_ENDS_ON_POWER_WINDOW;
+      burstDone = windowsDone && currentRing.head - burstFirstSample >= BURST_MIN_PAIRS;
+    }
+    if (burstDone) {
+      endSamplingBurst(frame);
+      powerQualityBurstDone();
+    }
+  }
+}
+
+void beginSampling() {
+  adc_continuous_handle_cfg_t handleConfig = {};
+  handleConfig.max_store_buf_size = ADC_FRAME_BYTES * ADC_BUFFERED_FRAMES;
+  handleConfig.conv_frame_size = ADC_FRAME_BYTES;
+  ESP_ERROR_CHECK(adc_continuous_new_handle(&handleConfig, &adcHandle));
+
+  // Voltage and current sit next to each other in the pattern so their samples are
+  // taken one conversion apart on every scan (25 us, 33 us without BRANCH_METERING); the
+  // branch current follows 25 us later (~0.9 degrees of phase at 50 Hz).
+#if BRANCH_METERING
+  const int pins[ADC_PATTERN_LEN] = { VOLTAGE_PIN, CURRENT_PIN, BRANCH_CURRENT_PIN, LDR_PIN };
+#else
+  const int pins[ADC_PATTERN_LEN] = { VOLTAGE_PIN, CURRENT_PIN, LDR_PIN };
+#endif
+  adc_digi_pattern_config_t pattern[ADC_PATTERN_LEN] = {};
+  for (int i = 0; i < ADC_PATTERN_LEN; i++) {
+    adc_unit_t unit;
+    ESP_ERROR_CHECK(adc_continuous_io_to_channel(pins[i], &unit, &adcChannels[i]));
+    pattern[i].atten = ADC_ATTEN_DB_12;
+    pattern[i].channel = adcChannels[i];
+    pattern[i].unit = unit;
+    pattern[i].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  }
+
+  adc_continuous_config_t adcConfig = {};
+  adcConfig.pattern_num = ADC_PATTERN_LEN;
+  adcConfig.adc_pattern = pattern;
+  adcConfig.sample_freq_hz = ADC_SAMPLE_RATE_HZ;
+  adcConfig.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  adcConfig.format = ADC_OUTPUT_FORMAT;
+  ESP_ERROR_CHECK(adc_continuous_config(adcHandle, &adcConfig));
+  powerMeterSetOffset(currentOffset);
+  selectPowerKernel();
+#if BRANCH_METERING
+  beginBranchMetering();
+#endif
+
+  xTaskCreatePinnedToCore(samplerTask, "sampler", 4096, NULL, 5, &samplerTaskHandle, 1);
+
+  adc_continuous_evt_cbs_t callbacks = {};
+  callbacks.on_conv_done = onAdcFrameDone;
+  ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(adcHandle, &callbacks, NULL));
+#if POWER_SAVE
+  startSamplingBurst(NULL);
+  esp_timer_start_periodic(burstTimer, SENSOR_INTERVAL_MS * 1000ULL);
+#else
+  ESP_ERROR_CHECK(adc_continuous_start(adcHandle));
+#endif
+}
+#endif
+
+// =======================================================================
+//   CALIBRATION STORE (NVS)
+// =======================================================================
+// The current-sensor offset, the voltage calibration and the offset's temperature drift
+// live in NVS, so a reboot measures correctly straight away instead of re-deriving the
+// offset while a load may already be drawing current. The offset is only (re)learned
+// while every relay has held its load off for CALIBRATION_IDLE_SETTLE_MS; the current
+// reading itself is not consulted, since it is the number being calibrated and would
+// never read 0 again once the offset had drifted. With loads on, the stored offset is
+// corrected for temperature.
+#define CALIBRATION_NAMESPACE "solaris-cal"
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_IDLE_SETTLE_MS 5000
+#define CALIBRATION_RELEARN_MS 3600000UL // Relearn (and write NVS) at most once an hour
+#define CALIBRATION_MIN_TEMP_SPAN 3.0    // Degrees C of spread needed before fitting drift
+#define CALIBRATION_DRIFT_FORGET 0.95    // Weight older points keep when a new one is added
+
+#if !SIMULATED_SENSORS
+struct CalibrationData {
+  uint16_t version;
+  float currentOffset;      // ADC counts, measured at currentOffsetTemp
+  float currentOffsetTemp;  // Degrees C
+  float offsetTempCoeff;    // ADC counts per degree C
+  float voltageCalibration;
+  // Exponentially weighted sums of (temperature, offset) points for the drift fit
+  float fitWeight;
+  float fitT;
+  float fitO;
+  float fitTT;
+  float fitTO;
+};
+
+Preferences calibrationPrefs;
+CalibrationData calibration = {};
+bool calibrationValid = false;
+bool offsetKnown = false; // calibration.currentOffset was loaded or measured, not the 0 default
+unsigned long lastOffsetLearnMs = 0;
+bool offsetLearnedThisBoot = false;
+
+// Scratch window for calibration
+uint16_t calibrationWindow[RMS_WINDOW_SAMPLES];
+
+#if BRANCH_METERING
+// Per-relay sensor offsets, stored as one float per BRANCH_SENSORS[] row under "branch".
+// Each row's offset follows its sensor while that relay holds its load off, and is written
+// back once it has tracked for BRANCH_OFFSET_SETTLE_MS, at most once per CALIBRATION_RELEARN_MS.
+#define BRANCH_OFFSET_SETTLE_MS 60000
+unsigned long branchIdleSinceMs[BRANCH_METER_COUNT];
+unsigned long lastBranchSaveMs = 0;
+bool branchSavedThisBoot = false;
+#endif
+
+bool loadCalibration() {
+  calibrationPrefs.begin(CALIBRATION_NAMESPACE, true);
+  size_t length = calibrationPrefs.getBytes("cal", &calibration, sizeof(calibration));
+  calibrationPrefs.end();
+  return length == sizeof(calibration) && calibration.version == CALIBRATION_VERSION;
+}
+
+void saveCalibration() {
+  calibration.version = CALIBRATION_VERSION;
+  calibrationPrefs.begin(CALIBRATION_NAMESPACE, false);
+  calibrationPrefs.putBytes("cal", &calibration, sizeof(calibration));
+  calibrationPrefs.end();
+  calibrationValid = true;
+}
+
+// Offset expected at `temp`, from the stored offset and its fitted drift
+float compensatedOffset(float temp) {
+  return calibration.currentOffset + calibration.offsetTempCoeff * (temp - calibration.currentOffsetTemp);
+}
+
+// Mean of the latest whole-cycle window of CURRENT_PIN samples
+float measureCurrentOffset() {
+  while (!copyLatestSamples(currentRing, calibrationWindow, RMS_WINDOW_SAMPLES)) {
+    delay(10); // Only waits for the very first window after boot
+  }
+  uint32_t sum = 0;
+  for (int i = 0; i < RMS_WINDOW_SAMPLES; i++) {
+    sum += calibrationWindow[i];
+  }
+  return sum / (float)RMS_WINDOW_SAMPLES;
+}
+
+// Applies a freshly measured offset, stores it and refines the temperature drift fit with it
+void learnCurrentOffset(float offset, float temp) {
+  currentOffset = offset;
+  powerMeterSetOffset(offset);
+
+  calibration.fitWeight = calibration.fitWeight * CALIBRATION_DRIFT_FORGET + 1.0;
+  calibration.fitT = calibration.fitT * CALIBRATION_DRIFT_FORGET + temp;
+  calibration.fitO = calibration.fitO * CALIBRATION_DRIFT_FORGET + offset;
+  calibration.fitTT = calibration.fitTT * CALIBRATION_DRIFT_FORGET + temp * temp;
+  calibration.fitTO = calibration.fitTO * CALIBRATION_DRIFT_FORGET + temp * offset;
+
+  float w = calibration.fitWeight;
+  float varT = calibration.fitTT / w - sq(calibration.fitT / w);
+  if (varT >= sq(CALIBRATION_MIN_TEMP_SPAN / 2)) {
+    calibration.offsetTempCoeff = (calibration.fitTO / w - (calibration.fitT / w) * (calibration.fitO / w)) / varT;
+  }
+  calibration.currentOffset = offset;
+  calibration.currentOffsetTemp = temp;
+  calibration.voltageCalibration = voltageCalibration;
+  offsetKnown = true;
+  saveCalibration();
+
+  lastOffsetLearnMs = millis();
+  offsetLearnedThisBoot = true;
+  Serial.printf("Learned current offset %.2f at %.1f C (drift %.3f counts/C)\n",
+                offset, temp, calibration.offsetTempCoeff);
+}
+
+#if BRANCH_METERING
+void loadBranchOffsets() {
+  float offsets[BRANCH_METER_COUNT];
+  calibrationPrefs.begin(CALIBRATION_NAMESPACE, true);
+  size_t length = calibrationPrefs.getBytes("branch", offsets, sizeof(offsets));
+  calibrationPrefs.end();
+  if (length != sizeof(offsets)) return; // Never stored, or BRANCH_SENSORS[] changed size
+  for (int i = 0; i < BRANCH_METER_COUNT; i++) branchMeterSetOffset(i, offsets[i]);
+  Serial.printf("Loaded %d per-relay sensor offsets from NVS\n", BRANCH_METER_COUNT);
+}
+
+// Picks which per-relay offsets may track (load off and relays settled) and stores them
+// once they have had time to converge.
+void branchCalibrationStep() {
+  unsigned long now = millis();
+  bool settled = now - lastRelayChangeMs >= CALIBRATION_IDLE_SETTLE_MS;
+  uint32_t track = 0;
+  bool converged = false;
+  for (int i = 0; i < BRANCH_METER_COUNT; i++) {
+    if (!settled || (loadOnBits(relayLevels) & (1u << BRANCH_SENSORS[i].switchId))) {
+      branchIdleSinceMs[i] = now;
+      continue;
+    }
+    track |= 1u << i;
+    converged = converged || now - branchIdleSinceMs[i] >= BRANCH_OFFSET_SETTLE_MS;
+  }
+  branchTrackOffset = track;
+
+  if (!converged || (branchSavedThisBoot && now - lastBranchSaveMs < CALIBRATION_RELEARN_MS)) return;
+  float offsets[BRANCH_METER_COUNT];
+  for (int i = 0; i < BRANCH_METER_COUNT; i++) {
+    BranchReading reading = latestBranchReading(i);
+    if (reading.windows == 0) return; // Not every row has been scanned yet
+    offsets[i] = reading.currentOffset;
+  }
+  calibrationPrefs.begin(CALIBRATION_NAMESPACE, false);
+  calibrationPrefs.putBytes("branch", offsets, sizeof(offsets));
+  calibrationPrefs.end();
+  lastBranchSaveMs = now;
+  branchSavedThisBoot = true;
+}
+#endif
+
+// Warm start. Runs at the top of sensingTask(), before the first reading is taken.
+void beginCalibration() {
+#if BRANCH_METERING
+  loadBranchOffsets();
+#endif
+  calibrationValid = loadCalibration();
+  if (calibrationValid) {
+    currentOffset = calibration.currentOffset;
+    voltageCalibration = calibration.voltageCalibration;
+    powerMeterSetVoltageCalibration(voltageCalibration);
+    powerMeterSetOffset(currentOffset);
+    offsetKnown = true;
+    Serial.printf("Calibration loaded from NVS: offset %.2f, voltage x%.3f\n", currentOffset, voltageCalibration);
+    return;
+  }
+
+  // First boot: the relays are still in RELAY_BOOT_LEVEL, so measure now if that keeps
+  // the loads off. Otherwise keep the default until calibrationStep() finds an idle moment.
+  calibration.voltageCalibration = voltageCalibration;
+  calibration.offsetTempCoeff = 0;
+  if (loadsOffFor(0)) {
+    currentOffset = measureCurrentOffset();
+    powerMeterSetOffset(currentOffset);
+    calibration.currentOffset = currentOffset;
+    calibration.currentOffsetTemp = haveTemp ? lastTemp : 25.0;
+    offsetKnown = true;
+    Serial.print("Current sensor offset: "); Serial.println(currentOffset);
+  }
+}
+
+// Called by sensingTask() after every reading
+void calibrationStep(const SensorSnapshot& snapshot) {
+  bool idle = loadsOffFor(CALIBRATION_IDLE_SETTLE_MS);
+  powerMeterTrackOffset(idle);
+#if BRANCH_METERING
+  branchCalibrationStep();
+#endif
+
+  if (idle && haveTemp && (!offsetLearnedThisBoot || millis() - lastOffsetLearnMs >= CALIBRATION_RELEARN_MS)) {
+    learnCurrentOffset(measureCurrentOffset(), snapshot.temp);
+  } else if (!idle && calibrationValid && haveTemp) {
+    powerMeterSetOffset(compensatedOffset(snapshot.temp));
+  }
+}
+
+// Field calibration against a reference meter, over Serial:
+//   cal v <volts>   scale the voltage reading so it matches <volts>
+//   cal show        print the stored calibration
+void handleCalibrationCommand(const SensorSnapshot& snapshot) {
+  static char line[32];
+  static size_t length = 0;
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c != '\n' && c != '\r') {
+      if (length < sizeof(line) - 1) line[length++] = c;
+      continue;
+    }
+    line[length] = '\0';
+    length = 0;
+
+    float reference;
+    if (sscanf(line, "cal v %f", &reference) == 1 && reference > 0 && snapshot.voltageRMS > 0) {
+      voltageCalibration *= reference / snapshot.voltageRMS;
+      powerMeterSetVoltageCalibration(voltageCalibration);
+      calibration.voltageCalibration = voltageCalibration;
+      if (offsetKnown) {
+        saveCalibration();
+        Serial.printf("Voltage calibration set to x%.4f\n", voltageCalibration);
+      } else {
+        // Storing now would save offset 0; learnCurrentOffset() stores both once it runs
+        Serial.printf("Voltage calibration set to x%.4f, stored once the current offset is learned\n",
+                      voltageCalibration);
+      }
+    } else if (strcmp(line, "cal show") == 0) {
+      Serial.printf("offset %.2f at %.1f C, drift %.3f counts/C, voltage x%.4f, stored %s\n",
+                    calibration.currentOffset, calibration.currentOffsetTemp, calibration.offsetTempCoeff,
+                    voltageCalibration, calibrationValid ? "yes" : "no");
+    }
+  }
+}
+
+float readLux() {
+  uint16_t latest[16];
+  if (!copyLatestSamples(ldrRing, latest, 16)) return 0;
+  uint32_t sum = 0;
+  for (int i = 0; i < 16; i++) sum += latest[i];
+  return 4095 - (sum / 16); // Simplified, adjust as needed
+}
+#endif
+
+// =======================================================================
+//   DHT CAPTURE (edge interrupts)
+// =======================================================================
+// The Adafruit driver bit-bangs the DHT's 40-bit reply with interrupts disabled for over
+// 20 ms, which stalls the task that calls it, the ADC DMA ISR and WiFi. Here a periodic
+// esp_timer starts a read every DHT_INTERVAL_MS (so the sensor's minimum interval holds no
+// matter who asks), the start pulse is timed by a one-shot timer instead of delay(), and a
+// falling-edge ISR timestamps the reply. Each bit is a 50 us low followed by a 26 us (0) or
+// 70 us (1) high, so the gap between consecutive falling edges decides the bit. The decoded
+// result is cached for readAllSensors(); nothing ever waits on the sensor.
+#define DHT_INTERVAL_MS 2000
+#define DHT_START_LOW_MS (DHT_TYPE == 11 ? 20 : 2)
+#define DHT_CAPTURE_MS 8        // Reply takes ~5 ms
+#define DHT_EDGES 42            // Response edge plus one edge at each of the 41 bit boundaries
+#define DHT_MAX_EDGES 46        // Room for a stray edge latched while the line was held low
+#define DHT_ONE_THRESHOLD_US 100 // Falling-to-falling: ~76 us for a 0, ~120 us for a 1
+
+#if !SIMULATED_SENSORS
+enum DhtPhase {
+  DHT_IDLE,
+  DHT_START_LOW, // Holding the line low for the start pulse
+  DHT_CAPTURING, // Line released, ISR timestamping the reply
+};
+
+struct DhtReading {
+  float temp;
+  float hum;
+  bool valid;
+  uint32_t readAtMs;
+  uint32_t failures; // Consecutive reads that failed to decode
+};
+
+esp_timer_handle_t dhtPeriodTimer = nullptr;
+esp_timer_handle_t dhtPhaseTimer = nullptr;
+volatile DhtPhase dhtPhase = DHT_IDLE;
+volatile uint32_t dhtEdgeCount = 0;
+uint32_t dhtEdgeUs[DHT_MAX_EDGES];
+DhtReading dhtReading = {};
+portMUX_TYPE dhtMux = portMUX_INITIALIZER_UNLOCKED;
+esp_pm_lock_handle_t dhtSleepLock = nullptr; // Edges are missed in light sleep; held for one read
+
+static void IRAM_ATTR dhtEdgeIsr(void* arg) {
+  uint32_t n = dhtEdgeCount;
+  if (n < DHT_MAX_EDGES) {
+    dhtEdgeUs[n] = (uint32_t)esp_timer_get_time();
+    dhtEdgeCount = n + 1;
+  }
+}
+
+// Decodes the captured edges into 5 bytes and checks the checksum. The reply always ends
+// on the edge that closes bit 39, so the bits are counted back from the last edge.
+static bool dhtDecode(uint8_t data[5]) {
+  uint32_t count = dhtEdgeCount;
+  if (count < DHT_EDGES) return false;
+  const uint32_t* edges = &dhtEdgeUs[count - DHT_EDGES];
+  memset(data, 0, 5);
+  for (int bit = 0; bit < 40; bit++) {
+    uint32_t period = edges[bit + 2] - edges[bit + 1];
+    if (period > DHT_ONE_THRESHOLD_US) data[bit / 8] |= 0x80 >> (bit % 8);
+  }
+  return (uint8_t)(data[0] + data[1] + data[2] + data[3]) == data[4];
+}
+
+static void dhtPhaseStep(void* arg) {
+  if (dhtPhase == DHT_START_LOW) {
+    dhtEdgeCount = 0;
+    gpio_set_level((gpio_num_t)DHT_PIN, 1); // Release; the pull-up lets the sensor answer
+    gpio_intr_enable((gpio_num_t)DHT_PIN);
+    dhtPhase = DHT_CAPTURING;
+    esp_timer_start_once(dhtPhaseTimer, DHT_CAPTURE_MS * 1000);
+    return;
+  }
+
+  ProfileScope profile(PROF_DHT_DECODE);
+  gpio_intr_disable((gpio_num_t)DHT_PIN);
+  if (dhtSleepLock) esp_pm_lock_release(dhtSleepLock);
+  dhtPhase = DHT_IDLE;
+  uint8_t data[5];
+  bool ok = dhtDecode(data);
+  float hum = 0, temp = 0;
+  if (ok && DHT_TYPE == 11) {
+    hum = data[0] + data[1] * 0.1f;
+    temp = data[2] + (data[3] & 0x7F) * 0.1f;
+    if (data[3] & 0x80) temp = -temp;
+  } else if (ok) {
+    hum = ((data[0] << 8) | data[1]) * 0.1f;
+    temp = (((data[2] & 0x7F) << 8) | data[3]) * 0.1f;
+    if (data[2] & 0x80) temp = -temp;
+  }
+
+  portENTER_CRITICAL(&dhtMux);
+  if (ok) {
+    dhtReading.temp = temp;
+    dhtReading.hum = hum;
+    dhtReading.valid = true;
+    dhtReading.readAtMs = millis();
+    dhtReading.failures = 0;
+  } else {
+    dhtReading.failures++;
+  }
+  portEXIT_CRITICAL(&dhtMux);
+}
+
+static void dhtStartRead(void* arg) {
+  if (dhtPhase != DHT_IDLE) return; // Previous read still running
+  if (dhtSleepLock) esp_pm_lock_acquire(dhtSleepLock);
+  gpio_set_level((gpio_num_t)DHT_PIN, 0);
+  dhtPhase = DHT_START_LOW;
+  esp_timer_start_once(dhtPhaseTimer, DHT_START_LOW_MS * 1000);
+}
+
+void beginDht() {
+  gpio_reset_pin((gpio_num_t)DHT_PIN);
+  gpio_set_level((gpio_num_t)DHT_PIN, 1);
+  gpio_set_direction((gpio_num_t)DHT_PIN, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_pullup_en((gpio_num_t)DHT_PIN);
+  gpio_set_intr_type((gpio_num_t)DHT_PIN, GPIO_INTR_NEGEDGE);
+  esp_err_t err = gpio_install_isr_service(0);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) { // Already installed by attachInterrupt()
+    Serial.printf("GPIO ISR service failed: %d\n", err);
+    return;
+  }
+  gpio_isr_handler_add((gpio_num_t)DHT_PIN, dhtEdgeIsr, nullptr);
+  gpio_intr_disable((gpio_num_t)DHT_PIN);
+  if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "dht", &dhtSleepLock) != ESP_OK) dhtSleepLock = nullptr;
+
+  esp_timer_create_args_t phaseArgs = {};
+  phaseArgs.callback = dhtPhaseStep;
+  phaseArgs.name = "dht_phase";
+  esp_timer_create(&phaseArgs, &dhtPhaseTimer);
+
+  esp_timer_create_args_t periodArgs = {};
+  periodArgs.callback = dhtStartRead;
+  periodArgs.name = "dht_period";
+  esp_timer_create(&periodArgs, &dhtPeriodTimer);
+  esp_timer_start_periodic(dhtPeriodTimer, DHT_INTERVAL_MS * 1000ULL);
+}
+
+DhtReading latestDhtReading() {
+  portENTER_CRITICAL(&dhtMux);
+  DhtReading reading = dhtReading;
+  portEXIT_CRITICAL(&dhtMux);
+  return reading;
+}
+
+SensorSnapshot readAllSensors() {
+  ProfileScope profile(PROF_READ_SENSORS);
+  SensorSnapshot snapshot = {};
+  PowerReading reading = latestPowerReading();
+  if (reading.windows > 0) {
+    snapshot.voltageRMS = reading.voltageRMS;
+    snapshot.currentRMS = reading.currentRMS;
+    snapshot.power = reading.realPower;
+    snapshot.apparentPower = reading.apparentPower;
+    snapshot.powerFactor = reading.powerFactor;
+    snapshot.energyWh = reading.energyWh;
+    currentOffset = reading.currentOffset;
+  }
+#if BRANCH_METERING
+  for (int i = 0; i < BRANCH_METER_COUNT; i++) {
+    snapshot.switchPower[i] = latestBranchReading(i).realPower;
+  }
+#endif
+
+  DhtReading dhtNow = latestDhtReading();
+  if (dhtNow.valid) {
+    lastTemp = dhtNow.temp;
+    lastHum = dhtNow.hum;
+    haveTemp = true;
+  }
+  snapshot.temp = lastTemp;
+  snapshot.hum = lastHum;
+
+  snapshot.ldrValue = readLux();
+  snapshot.takenAtMs = millis();
+  return snapshot;
+}
+#endif
+
+// =======================================================================
+//   SIMULATED SENSORS
+// =======================================================================
+// With SIMULATED_SENSORS (PROFILE_BASIC), readAllSensors() makes up a plausible reading
+// instead of measuring one, so a board without the metering front end still drives the
+// whole pipeline: rollups, telemetry, journal and automation. Every load a relay has
+// switched on draws about 1 A. None of the ADC, calibration or DHT code above is built.
+#if SIMULATED_SENSORS
+float simulatedEnergyWh = 0;
+
+SensorSnapshot readAllSensors() {
+  ProfileScope profile(PROF_READ_SENSORS);
+  uint32_t loadsOn = loadOnBits(relayLevels);
+  int loads = 0;
+  for (const RelayChannel& relay : RELAYS) {
+    if (loadsOn & (1u << relay.switchId)) loads++;
+  }
+
+  SensorSnapshot snapshot = {};
+  snapshot.voltageRMS = 230.0 + random(-5, 5);
+  snapshot.currentRMS = loads * (1.0 + random(-20, 20) / 100.0);
+  snapshot.apparentPower = snapshot.voltageRMS * snapshot.currentRMS;
+  snapshot.powerFactor = loads ? random(85, 100) / 100.0 : 0;
+  snapshot.power = snapshot.apparentPower * snapshot.powerFactor;
+  simulatedEnergyWh += snapshot.power * (SENSOR_INTERVAL_MS / 3600000.0);
+  snapshot.energyWh = simulatedEnergyWh;
+  lastTemp = 25.0 + random(-2, 2);
+  lastHum = 60.0 + random(-10, 10);
+  haveTemp = true;
+  snapshot.temp = lastTemp;
+  snapshot.hum = lastHum;
+  snapshot.ldrValue = random(0, 4096);
+  snapshot.takenAtMs = millis();
+  return snapshot;
+}
+#endif
+
+// =======================================================================
+//   ROLLUP ENGINE
+// =======================================================================
+// Every snapshot is folded into a FIREBASE_INTERVAL_MS rollup. Closed interval rollups are
+// merged into a 1-minute tier, and closed minutes into a 15-minute tier; the last
+// ROLLUP_MINUTES_KEPT and ROLLUP_QUARTERS_KEPT of each stay in RAM for on-device history.
+// Only sensingTask() writes the tiers; other tasks read them through rollupHistory().
+// What gets uploaded is decided separately by reportStep() below.
+#define ROLLUP_MINUTE_MS 60000
+#define ROLLUP_QUARTER_MS 900000
+#define ROLLUP_MINUTES_KEPT 60 // 1 h
+#define ROLLUP_QUARTERS_KEPT 96 // 24 h
+
+enum RollupTier {
+  ROLLUP_TIER_MINUTE,
+  ROLLUP_TIER_QUARTER,
+};
+
+struct RollupTierState {
+  Rollup open;
+  Rollup* history;
+  uint32_t kept;
+  uint32_t lengthMs;
+  uint32_t closed; // Total closed so far; history[(closed - 1) % kept] is the newest
+};
+
+Rollup intervalRollup = {};
+Rollup minuteHistory[ROLLUP_MINUTES_KEPT];
+Rollup quarterHistory[ROLLUP_QUARTERS_KEPT];
+RollupTierState rollupTiers[] = {
+  { {}, minuteHistory, ROLLUP_MINUTES_KEPT, ROLLUP_MINUTE_MS, 0 },
+  { {}, quarterHistory, ROLLUP_QUARTERS_KEPT, ROLLUP_QUARTER_MS, 0 },
+};
+portMUX_TYPE rollupMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void snapshotMetrics(const SensorSnapshot& snapshot, float values[ROLLUP_METRIC_COUNT]) {
+  values[ROLLUP_VOLTAGE] = snapshot.voltageRMS;
+  values[ROLLUP_CURRENT] = snapshot.currentRMS;
+  values[ROLLUP_POWER] = snapshot.power;
+  values[ROLLUP_APPARENT_POWER] = snapshot.apparentPower;
+  values[ROLLUP_POWER_FACTOR] = snapshot.powerFactor;
+  values[ROLLUP_TEMPERATURE] = snapshot.temp;
+  values[ROLLUP_HUMIDITY] = snapshot.hum;
+  values[ROLLUP_LDR] = (float)snapshot.ldrValue;
+}
+
+void rollupAdd(Rollup& rollup, const SensorSnapshot& snapshot) {
+  float values[ROLLUP_METRIC_COUNT];
+  snapshotMetrics(snapshot, values);
+  if (rollup.samples == 0) {
+    rollup.startedAtMs = snapshot.takenAtMs;
+    rollup.energyStartWh = snapshot.energyWh;
+    for (int m = 0; m < ROLLUP_METRIC_COUNT; m++) {
+      rollup.sum[m] = 0;
+      rollup.min[m] = values[m];
+      rollup.max[m] = values[m];
+    }
+#if BRANCH_METERING
+    for (int b = 0; b < BRANCH_METER_COUNT; b++) rollup.switchPowerSum[b] = 0;
+#endif
+  }
+  for (int m = 0; m < ROLLUP_METRIC_COUNT; m++) {
+    rollup.sum[m] += values[m];
+    if (values[m] < rollup.min[m]) rollup.min[m] = values[m];
+    if (values[m] > rollup.max[m]) rollup.max[m] = values[m];
+  }
+#if BRANCH_METERING
+  for (int b = 0; b < BRANCH_METER_COUNT; b++) rollup.switchPowerSum[b] += snapshot.switchPower[b];
+#endif
+  rollup.samples++;
+  rollup.endedAtMs = snapshot.takenAtMs;
+  rollup.energyEndWh = snapshot.energyWh;
+}
+
+// Folds a closed rollup into a longer one. Means stay exact because sums are merged.
+void rollupMerge(Rollup& into, const Rollup& from) {
+  if (from.samples == 0) return;
+  if (into.samples == 0) {
+    into = from;
+    return;
+  }
+  for (int m = 0; m < ROLLUP_METRIC_COUNT; m++) {
+    into.sum[m] += from.sum[m];
+    if (from.min[m] < into.min[m]) into.min[m] = from.min[m];
+    if (from.max[m] > into.max[m]) into.max[m] = from.max[m];
+  }
+#if BRANCH_METERING
+  for (int b = 0; b < BRANCH_METER_COUNT; b++) into.switchPowerSum[b] += from.switchPowerSum[b];
+#endif
+  into.samples += from.samples;
+  into.endedAtMs = from.endedAtMs;
+  into.energyEndWh = from.energyEndWh;
+}
+
+// Merges a closed rollup into the tier; closes the tier's own rollup once it spans
+// lengthMs and returns true with that rollup in 'closed'.
+static bool rollupTierAdd(RollupTierState& tier, const Rollup& rollup, Rollup& closed) {
+  rollupMerge(tier.open, rollup);
+  if (tier.open.endedAtMs - tier.open.startedAtMs + SENSOR_INTERVAL_MS < tier.lengthMs) return false;
+  closed = tier.open;
+  portENTER_CRITICAL(&rollupMux);
+  tier.history[tier.closed % tier.kept] = closed;
+  tier.closed++;
+  portEXIT_CRITICAL(&rollupMux);
+  tier.open = {};
+  return true;
+}
+
+// Adds a snapshot to the interval rollup and, each FIREBASE_INTERVAL_MS, to the tiers.
+void rollupStep(const SensorSnapshot& snapshot) {
+  rollupAdd(intervalRollup, snapshot);
+  if (intervalRollup.endedAtMs - intervalRollup.startedAtMs + SENSOR_INTERVAL_MS < FIREBASE_INTERVAL_MS) {
+    return;
+  }
+  Rollup closed = intervalRollup;
+  intervalRollup = {};
+
+  Rollup minute, quarter;
+  if (rollupTierAdd(rollupTiers[ROLLUP_TIER_MINUTE], closed, minute)) {
+    rollupTierAdd(rollupTiers[ROLLUP_TIER_QUARTER], minute, quarter);
+  }
+}
+
+// Copies the closed rollup 'ago' steps back in a tier (0 = newest). False if there is none.
+bool rollupHistory(RollupTier tier, uint32_t ago, Rollup& out) {
+  const RollupTierState& state = rollupTiers[tier];
+  bool found = false;
+  portENTER_CRITICAL(&rollupMux);
+  if (ago < state.closed && ago < state.kept) {
+    out = state.history[(state.closed - 1 - ago) % state.kept];
+    found = true;
+  }
+  portEXIT_CRITICAL(&rollupMux);
+  return found;
+}
+
+// =======================================================================
+//   CONSUMPTION FORECASTER
+// =======================================================================
+// Predicts the energy used over the next hour from the quarter tier, on the device, so the
+// dashboard's forecast refreshes with every reading instead of waiting for a cloud model
+// call. Each closed quarter's energy (mean power x 15 min) updates a Holt-Winters forecaster
+// (CONSUMPTION FORECASTER in solaris_core.h) that learns a daily profile in quarter slots of
+// UTC time. The next-hour forecast and its ~95 % band travel with every telemetry reading
+// as forecastWh and forecastBandWh; forecastWh is -1 until FORECAST_MIN_UPDATES quarters
+// have been seen and while the clock is not set. The model is 400 bytes and is saved to
+// NVS every FORECAST_SAVE_QUARTERS, so a reboot does not throw away the learned profile.
+//
+// Quarters closed before SNTP has set the clock still update the level and trend, just not
+// the daily profile, since their time of day is unknown. No forecast is published from
+// them: without the slot of the next hour it would ignore the daily profile.
+#define FORECAST_HORIZON_QUARTERS 4 // 1 h
+#define FORECAST_MIN_UPDATES 4
+#define FORECAST_SAVE_QUARTERS 4
+#define FORECAST_STATE_VERSION 1
+
+struct StoredForecaster {
+  uint32_t version;
+  Forecaster model;
+};
+
+struct ConsumptionForecast {
+  float nextHourWh; // -1 while the model is warming up
+  float bandWh;
+};
+
+Preferences forecastPrefs;
+Forecaster forecaster = {};  // Owned by sensingTask()
+uint32_t forecastQuartersSeen = 0;
+ConsumptionForecast latestForecast = { -1, 0 };
+portMUX_TYPE forecastMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Quarter-of-the-day slot of a device millis time, or -1 before SNTP has set the clock
+static int forecastSlot(uint32_t takenAtMs) {
+  time_t now = time(nullptr);
+  if (now < CLOCK_VALID_AFTER) return -1;
+  int64_t unixMs = (int64_t)now * 1000 - (int64_t)(millis() - takenAtMs);
+  return (int)((unixMs / ROLLUP_QUARTER_MS) % FORECAST_SEASON_SLOTS);
+}
+
+static void publishForecast(const ConsumptionForecast& forecast) {
+  portENTER_CRITICAL(&forecastMux);
+  latestForecast = forecast;
+  portEXIT_CRITICAL(&forecastMux);
+}
+
+// Restores the saved model. Runs in setup(), before the tasks start.
+void beginForecast() {
+  forecastPrefs.begin("forecast", false);
+  StoredForecaster stored;
+  size_t length = forecastPrefs.getBytes("model", &stored, sizeof(stored));
+  if (length == sizeof(stored) && stored.version == FORECAST_STATE_VERSION) {
+    forecaster = stored.model;
+    Serial.printf("Forecast: restored model after %lu quarters\n", (unsigned long)forecaster.updates);
+  }
+  forecastQuartersSeen = rollupTiers[ROLLUP_TIER_QUARTER].closed;
+}
+
+// Feeds every newly closed quarter into the model and refreshes the forecast. Called by
+// sensingTask() after rollupStep().
+void forecastStep() {
+  uint32_t closed = rollupTiers[ROLLUP_TIER_QUARTER].closed;
+  if (closed == forecastQuartersSeen) return;
+  forecastQuartersSeen = closed;
+
+  Rollup quarter;
+  if (!rollupHistory(ROLLUP_TIER_QUARTER, 0, quarter)) return;
+  float energyWh = quarter.mean(ROLLUP_POWER) * (ROLLUP_QUARTER_MS / 3600000.0f);
+  uint32_t middleMs = quarter.startedAtMs + (quarter.endedAtMs - quarter.startedAtMs) / 2;
+  int slot = forecastSlot(middleMs);
+  forecasterUpdate(forecaster, energyWh, slot);
+
+  ConsumptionForecast forecast = { -1, 0 };
+  if (slot >= 0 && forecaster.updates >= FORECAST_MIN_UPDATES) {
+    int next = (slot + 1) % FORECAST_SEASON_SLOTS;
+    forecast.nextHourWh = forecasterPredict(forecaster, next, FORECAST_HORIZON_QUARTERS);
+    forecast.bandWh = forecasterBand(forecaster, FORECAST_HORIZON_QUARTERS);
+  }
+  publishForecast(forecast);
+
+  if (forecaster.updates % FORECAST_SAVE_QUARTERS == 0) {
+    StoredForecaster stored = { FORECAST_STATE_VERSION, forecaster };
+    forecastPrefs.putBytes("model", &stored, sizeof(stored));
+  }
+}
+
+ConsumptionForecast currentForecast() {
+  portENTER_CRITICAL(&forecastMux);
+  ConsumptionForecast forecast = latestForecast;
+  portEXIT_CRITICAL(&forecastMux);
+  return forecast;
+}
+
+// =======================================================================
+//   REPORT BY EXCEPTION
+// =======================================================================
+// With REPORT_BY_EXCEPTION enabled, a steady load is reported once per REPORT_HEARTBEAT_MS
+// (a rollup of everything since the last report) instead of every FIREBASE_INTERVAL_MS.
+// When power, current or voltage moves beyond its deadband from the last reported value,
+// the readings so far are closed as one rollup and the new reading is reported on its own
+// straight away. Reports are sparse in this mode, so networkTask() uploads each one as it
+// arrives rather than holding it for a batch. With it disabled a rollup is reported every
+// FIREBASE_INTERVAL_MS and batched as before.
+#define REPORT_BY_EXCEPTION 1
+#define REPORT_HEARTBEAT_MS 60000
+#define DEADBAND_POWER_W 50.0
+#define DEADBAND_CURRENT_A 0.2
+#define DEADBAND_VOLTAGE_V 5.0
+
+Rollup reportRollup = {};
+Rollup lastReported = {}; // samples == 0 until the first report
+
+static void reportRollupNow(Rollup& rollup) {
+  if (rollup.samples == 0) return;
+  if (!telemetryRing.push(rollup)) Serial.println("Network task is behind, dropping a report.");
+  lastReported = rollup;
+  rollup = {};
+}
+
+static bool outsideDeadband(const SensorSnapshot& snapshot) {
+  if (lastReported.samples == 0) return true;
+  return fabsf(snapshot.power - lastReported.mean(ROLLUP_POWER)) > DEADBAND_POWER_W ||
+         fabsf(snapshot.currentRMS - lastReported.mean(ROLLUP_CURRENT)) > DEADBAND_CURRENT_A ||
+         fabsf(snapshot.voltageRMS - lastReported.mean(ROLLUP_VOLTAGE)) > DEADBAND_VOLTAGE_V;
+}
+
+void reportStep(const SensorSnapshot& snapshot) {
+#if REPORT_BY_EXCEPTION
+  if (outsideDeadband(snapshot)) {
+    reportRollupNow(reportRollup); // What led up to the change, as a normal report
+    rollupAdd(reportRollup, snapshot);
+    reportRollupNow(reportRollup);
+    return;
+  }
+  const uint32_t periodMs = REPORT_HEARTBEAT_MS;
+#else
+  const uint32_t periodMs = FIREBASE_INTERVAL_MS;
+#endif
+  rollupAdd(reportRollup, snapshot);
+  if (reportRollup.endedAtMs - reportRollup.startedAtMs + SENSOR_INTERVAL_MS >= periodMs) {
+    reportRollupNow(reportRollup);
+  }
+}
+
+// =======================================================================
+//   CONNECTION STATE MACHINE
+// =======================================================================
+// Boot never waits for the network: relays are already in their safe state and sampling
+// is running before WiFi.begin() is issued. networkTask() steps this machine every 100 ms
+// and WiFi events only flip a flag, so a dropped link, a failed connect or a dead stream
+// are each recovered here instead of relying on Firebase.reconnectWiFi().
+#define WIFI_CONNECT_TIMEOUT_MS 20000
+#define RECONNECT_BACKOFF_MIN_MS 1000
+#define RECONNECT_BACKOFF_MAX_MS 60000
+#define STREAM_RECOVERY_MS 30000 // Restart the switch stream after this long disconnected
+
+enum ConnectionState {
+  CONN_WIFI_IDLE,       // Waiting out the reconnect backoff
+  CONN_WIFI_CONNECTING, // WiFi.begin() issued, waiting for an IP
+  CONN_CLOUD_STARTING,  // Starting Firebase and the /app/switchStates stream
+  CONN_ONLINE,
+};
+
+std::atomic<bool> wifiLinkUp{false};
+ConnectionState connectionState = CONN_WIFI_IDLE;
+unsigned long connectionStateSince = 0;
+unsigned long reconnectBackoffMs = 0; // The first attempt is immediate
+bool firebaseStarted = false;
+bool streamStarted = false;
+bool cloudRetryPending = false;
+unsigned long streamDownSince = 0;
+
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    wifiLinkUp = true;
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED || event == ARDUINO_EVENT_WIFI_STA_LOST_IP) {
+    wifiLinkUp = false;
+  }
+}
+
+static void enterConnectionState(ConnectionState next) {
+  connectionState = next;
+  connectionStateSince = millis();
+}
+
+static void scheduleReconnect() {
+  reconnectBackoffMs = reconnectBackoffMs ? reconnectBackoffMs * 2 : RECONNECT_BACKOFF_MIN_MS;
+  if (reconnectBackoffMs > RECONNECT_BACKOFF_MAX_MS) reconnectBackoffMs = RECONNECT_BACKOFF_MAX_MS;
+  Serial.printf("Network unavailable, retrying in %lu ms\n", reconnectBackoffMs);
+  enterConnectionState(CONN_WIFI_IDLE);
+}
+
+// This is the crucial part that listens for changes from your web app.
+// The path "/app/switchStates" must exactly match what the web app uses.
+// With the MQTT command channel there is no stream; commandTask() carries the commands.
+bool startSwitchStream() {
+  if (COMMAND_TRANSPORT != COMMAND_TRANSPORT_STREAM) return true;
+  if (!Firebase.RTDB.beginStream(&stream, "/app/switchStates")) {
+    Serial.printf("Could not begin stream: %s\n", stream.errorReason().c_str());
+    return false;
+  }
+  Firebase.RTDB.setStreamCallback(&stream, streamCallback, streamTimeoutCallback);
+  return true;
+}
+
+bool isOnline() {
+  return connectionState == CONN_ONLINE;
+}
+
+void connectionStep() {
+  unsigned long elapsed = millis() - connectionStateSince;
+
+  switch (connectionState) {
+    case CONN_WIFI_IDLE:
+      if (elapsed >= reconnectBackoffMs) {
+        Serial.println("Connecting to WiFi...");
+        WiFi.disconnect();
+        WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+        enterConnectionState(CONN_WIFI_CONNECTING);
+      }
+      break;
+
+    case CONN_WIFI_CONNECTING:
+      if (wifiLinkUp) {
+        Serial.println("WiFi Connected!");
+        enterConnectionState(CONN_CLOUD_STARTING);
+      } else if (elapsed > WIFI_CONNECT_TIMEOUT_MS) {
+        scheduleReconnect();
+      }
+      break;
+
+    case CONN_CLOUD_STARTING:
+      if (!wifiLinkUp) {
+        cloudRetryPending = false;
+        scheduleReconnect();
+      } else if (!cloudRetryPending || elapsed >= RECONNECT_BACKOFF_MIN_MS) {
+        if (!firebaseStarted) {
+          Firebase.begin(&config, &auth);
+          configTime(0, 0, "pool.ntp.org", "time.google.com"); // Wall clock for the journal
+          firebaseStarted = true;
+        }
+        if (!streamStarted) streamStarted = startSwitchStream();
+        if (streamStarted) {
+          Serial.println("Online. Listening for switch changes.");
+          reconnectBackoffMs = 0;
+          streamDownSince = 0;
+          cloudRetryPending = false;
+          enterConnectionState(CONN_ONLINE);
+        } else {
+          cloudRetryPending = true; // Try again after RECONNECT_BACKOFF_MIN_MS
+          enterConnectionState(CONN_CLOUD_STARTING);
+        }
+      }
+      break;
+
+    case CONN_ONLINE:
+      if (!wifiLinkUp) {
+        Serial.println("WiFi connection lost.");
+        scheduleReconnect();
+      } else if (COMMAND_TRANSPORT != COMMAND_TRANSPORT_STREAM || stream.httpConnected()) {
+        streamDownSince = 0;
+      } else if (streamDownSince == 0) {
+        streamDownSince = millis();
+      } else if (millis() - streamDownSince > STREAM_RECOVERY_MS) {
+        Serial.println("Switch stream is down, restarting it...");
+        Firebase.RTDB.endStream(&stream);
+        streamStarted = false;
+        enterConnectionState(CONN_CLOUD_STARTING);
+      }
+      break;
+  }
+}
+
+// =======================================================================
+//   MQTT COMMAND CHANNEL
+// =======================================================================
+// With COMMAND_TRANSPORT_MQTT, switch commands arrive as COMMAND_FRAME_SIZE-byte binary
+// frames (solaris_core.h) on COMMAND_TOPIC_PREFIX<id>. The web app's updateSwitchState()
+// still writes /app/switchStates as the source of truth, and publishes the same change as
+// a frame (src/lib/command-channel.ts). A toggle costs one 8-byte payload plus MQTT
+// framing, and it is pushed on an already-open socket straight into commandTask(). There
+// is no SSE parsing and no JSON. Frames are retained per switch, so on every (re)connect
+// the broker replays the latest frame of each switch rather than the whole switchStates
+// tree. Switches the broker has no frame for are loaded once per boot from the database by
+// networkTask() (syncCommandStates()). commandTask() owns the MQTT client and only polls
+// it, so a slow broker never holds up telemetry.
+#if COMMAND_TRANSPORT == COMMAND_TRANSPORT_MQTT
+#define COMMAND_POLL_MS 20
+#define COMMAND_KEEPALIVE_S 30
+#define COMMAND_SYNC_WAIT_MS 3000 // Time the broker gets to replay retained frames
+
+WiFiClientSecure commandClient;
+PubSubClient commandMqtt(commandClient);
+volatile uint32_t commandReceivedMask = 0; // Switches with a frame since boot
+volatile bool commandSyncDue = false;      // Set by commandTask(), handled by networkTask()
+bool commandSynced = false;
+unsigned long commandSubscribedAt = 0;
+
+void commandFrameCallback(char* topic, uint8_t* payload, unsigned int length) {
+  ProfileScope profile(PROF_STREAM_CALLBACK);
+  int64_t receivedUs = esp_timer_get_time();
+  CommandFrame frame;
+  if (!parseCommandFrame(payload, length, frame)) {
+    Serial.printf("Ignoring malformed command frame on %s\n", topic);
+    return;
+  }
+  commandReceivedMask |= 1u << frame.switchId;
+  uint32_t seq[MAX_SWITCH_ID + 1];
+  seq[frame.switchId] = frame.seq;
+  SwitchSnapshot one = { 1u << frame.switchId, frame.state ? (1u << frame.switchId) : 0 };
+  executeCommands(one, seq, receivedUs);
+}
+
+static bool connectCommandChannel() {
+  if (!commandMqtt.connect(MQTT_CLIENT_ID, MQTT_USERNAME, MQTT_PASSWORD)) {
+    Serial.printf("Command channel connect failed: state %d\n", commandMqtt.state());
+    return false;
+  }
+  if (!commandMqtt.subscribe(COMMAND_TOPIC_PREFIX "+", 1)) {
+    commandMqtt.disconnect();
+    return false;
+  }
+  commandSubscribedAt = millis();
+  Serial.println("Command channel connected.");
+  return true;
+}
+
+// Applies the database state of every switch the broker had no frame for. Runs once per
+// boot from networkTask(), which owns fbdo.
+void syncCommandStates() {
+  if (!commandSyncDue || !Firebase.ready()) return;
+  commandSyncDue = false;
+  if (!Firebase.RTDB.getJSON(&fbdo, "/app/switchStates")) {
+    Serial.printf("Could not load switch states: %s\n", fbdo.errorReason().c_str());
+    commandSynced = false; // commandTask() asks again
+    return;
+  }
+  SwitchSnapshot snapshot;
+  uint32_t seq[MAX_SWITCH_ID + 1];
+  if (!parseSwitchSnapshot(fbdo.jsonString().c_str(), snapshot, seq)) return;
+  snapshot.present &= ~commandReceivedMask; // A frame is newer than the database read
+  if (snapshot.present) executeCommands(snapshot, seq, esp_timer_get_time());
+}
+
+void commandTask(void* param) {
+  commandClient.setInsecure(); // Same trust as the uploads; use setCACert() to pin the broker
+  commandMqtt.setServer(MQTT_HOST, MQTT_PORT);
+  commandMqtt.setCallback(commandFrameCallback);
+  commandMqtt.setKeepAlive(COMMAND_KEEPALIVE_S);
+  unsigned long backoffMs = 0, lastAttemptAt = 0;
+  for (;;) {
+    if (!isOnline()) {
+      if (commandMqtt.connected()) commandMqtt.disconnect();
+    } else if (!commandMqtt.connected()) {
+      if (millis() - lastAttemptAt >= backoffMs) {
+        lastAttemptAt = millis();
+        if (connectCommandChannel()) {
+          backoffMs = 0;
+        } else {
+          backoffMs = backoffMs ? backoffMs * 2 : RECONNECT_BACKOFF_MIN_MS;
+          if (backoffMs > RECONNECT_BACKOFF_MAX_MS) backoffMs = RECONNECT_BACKOFF_MAX_MS;
+        }
+      }
+    } else {
+      commandMqtt.loop();
+      if (!commandSynced && millis() - commandSubscribedAt >= COMMAND_SYNC_WAIT_MS) {
+        commandSynced = true;
+        commandSyncDue = true;
+      }
+    }
+    vTaskDelay(pdMS_TO_TICKS(COMMAND_POLL_MS));
+  }
+}
+#endif
+
+bool telemetryDelivered = false; // A reading has reached the cloud since boot (OTA UPDATES trial)
+
+bool sendSensorDataToFirebase(const Rollup& rollup) {
+  if (!isOnline() || !Firebase.ready()) return false;
+  ProfileScope profile(PROF_UPLOAD);
+
+  Serial.println("Sending sensor data to Firebase...");
+
+  // Use a JSON object to send all data at once to a new timestamped entry
+  FirebaseJson json;
+  json.set("voltage", rollup.mean(ROLLUP_VOLTAGE));
+  json.set("current", rollup.mean(ROLLUP_CURRENT));
+  json.set("power", rollup.mean(ROLLUP_POWER));
+  json.set("apparentPower", rollup.mean(ROLLUP_APPARENT_POWER));
+  json.set("powerFactor", rollup.mean(ROLLUP_POWER_FACTOR));
+  json.set("energy", rollup.energyUsedWh());
+  json.set("temperature", rollup.mean(ROLLUP_TEMPERATURE));
+  json.set("humidity", rollup.mean(ROLLUP_HUMIDITY));
+  json.set("ldr", (int)lroundf(rollup.mean(ROLLUP_LDR)));
+  json.set("voltageMin", rollup.min[ROLLUP_VOLTAGE]);
+  json.set("voltageMax", rollup.max[ROLLUP_VOLTAGE]);
+  json.set("currentMax", rollup.max[ROLLUP_CURRENT]);
+  json.set("powerMin", rollup.min[ROLLUP_POWER]);
+  json.set("powerMax", rollup.max[ROLLUP_POWER]);
+  ConsumptionForecast forecast = currentForecast();
+  json.set("forecastWh", forecast.nextHourWh);
+  json.set("forecastBandWh", forecast.bandWh);
+  PowerQualitySummary pq = currentPowerQuality();
+  json.set("frequency", pq.frequencyHz);
+  json.set("thdVoltage", pq.thdVoltage);
+  json.set("thdCurrent", pq.thdCurrent);
+  // Complete only with continuous sampling; see eventCoverage in /app/powerQuality
+  json.set("voltageSags", (unsigned long)pq.sags);
+  json.set("voltageSwells", (unsigned long)pq.swells);
+#if BRANCH_METERING
+  for (int b = 0; b < BRANCH_METER_COUNT; b++) {
+    char field[24];
+    snprintf(field, sizeof(field), "switch%uPower", (unsigned)BRANCH_SENSORS[b].switchId);
+    json.set(field, rollup.switchPowerMean(b));
+  }
+#endif
+  json.set("timestamp/.sv", "timestamp"); // Correct way to set server value timestamp
+
+  // Push a new entry under /app/energyData
+  if (Firebase.RTDB.pushJSON(&fbdo, "/app/energyData", &json)) {
+    Serial.println("Sensor data sent successfully.");
+    telemetryDelivered = true;
+    return true;
+  }
+  Serial.printf("Failed to send data: %s\n", fbdo.errorReason().c_str());
+  return false;
+}
+
+// Publishes the profiling window and heap watermarks to /app/diagnostics (and Serial), then
+// starts a new window. Runs from networkTask() every DIAGNOSTICS_INTERVAL_MS while online.
+void publishDiagnostics() {
+  ProfileStats stats[PROF_STAGE_COUNT];
+  portENTER_CRITICAL(&profileMux);
+  memcpy(stats, profileStats, sizeof(stats));
+  memset(profileStats, 0, sizeof(profileStats));
+  portEXIT_CRITICAL(&profileMux);
+
+  const float cyclesPerUs = getCpuFrequencyMhz();
+  FirebaseJson json;
+  json.set("firmware", FIRMWARE_VERSION);
+  json.set("uptimeS", (unsigned long)(millis() / 1000));
+  json.set("heap/free", (unsigned long)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  json.set("heap/minFree", (unsigned long)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+  json.set("heap/largestBlock", (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  json.set("heap/minLargestBlock", (unsigned long)minLargestFreeBlock);
+  HeapHealth health = heapHealth();
+  unsigned long inLevel = millis() - heapGuard.since;
+  json.set("heap/health", health == HEAP_CRITICAL ? "critical" : health == HEAP_TIGHT ? "tight" : "healthy");
+  json.set("heap/degradations", (unsigned long)heapGuard.degradations);
+  json.set("heap/tightS", (double)((heapGuard.tightMs + (health != HEAP_HEALTHY ? inLevel : 0)) / 1000));
+  json.set("heap/criticalS", (double)((heapGuard.criticalMs + (health == HEAP_CRITICAL ? inLevel : 0)) / 1000));
+  PowerBudget budget = lastPowerBudget;
+  json.set("commands/applied", (unsigned long)commandStats.applied);
+  json.set("commands/unchanged", (unsigned long)commandStats.unchanged);
+  json.set("commands/stale", (unsigned long)commandStats.stale);
+  json.set("commands/lastLatencyUs", (unsigned long)actuationLatency.lastUs);
+  json.set("commands/maxLatencyUs", (unsigned long)actuationLatency.maxUs);
+  Serial.printf("power: sampler duty %.1f %%, ~%.1f mA, saves ~%.1f mA (%.3f mAh per %d s interval)\n",
+                budget.samplerDuty * 100, budget.estimatedMa, budget.savedMa, budget.savedMah,
+                FIREBASE_INTERVAL_MS / 1000);
+
+  Serial.println("stage            count    min us    avg us    max us    p99 us");
+  for (int i = 0; i < PROF_STAGE_COUNT; i++) {
+    const ProfileStats& stage = stats[i];
+    if (stage.count == 0) continue;
+    float minUs = stage.minCycles / cyclesPerUs;
+    float avgUs = stage.totalCycles / (float)stage.count / cyclesPerUs;
+    float maxUs = stage.maxCycles / cyclesPerUs;
+    float p99Us = profileP99(stage) / cyclesPerUs;
+    Serial.printf("%-15s %6lu %9.1f %9.1f %9.1f %9.1f\n", PROFILE_STAGE_NAMES[i], (unsigned long)stage.count,
+                  minUs, avgUs, maxUs, p99Us);
+
+    char path[48];
+    const char* name = PROFILE_STAGE_NAMES[i];
+    snprintf(path, sizeof(path), "stages/%s/count", name);
+    json.set(path, (unsigned long)stage.count);
+    snprintf(path, sizeof(path), "stages/%s/minUs", name);
+    json.set(path, minUs);
+    snprintf(path, sizeof(path), "stages/%s/avgUs", name);
+    json.set(path, avgUs);
+    snprintf(path, sizeof(path), "stages/%s/maxUs", name);
+    json.set(path, maxUs);
+    snprintf(path, sizeof(path), "stages/%s/p99Us", name);
+    json.set(path, p99Us);
+  }
+  json.set("updatedAt/.sv", "timestamp");
+
+  if (!Firebase.RTDB.setJSON(&fbdo, "/app/diagnostics", &json)) {
+    Serial.printf("Failed to publish diagnostics: %s\n", fbdo.errorReason().c_str());
+  }
+}
+
+// Writes each relay's measured load under /app/switchStates/<id> (power, current,
+// powerFactor, energy) in one multi-path update, so the app sees per-load data next to the
+// switch state. Only switches whose power moved by SWITCH_POWER_DEADBAND_W since their
+// last write are included. Runs from networkTask() every SWITCH_METERING_INTERVAL_MS.
+#define SWITCH_METERING_INTERVAL_MS 10000
+#define SWITCH_POWER_DEADBAND_W 2.0
+
+void publishSwitchMetering() {
+#if BRANCH_METERING
+  static float lastPublishedSwitchPower[BRANCH_METER_COUNT];
+  static uint32_t switchPowerPublished = 0; // Bit n set once BRANCH_SENSORS[n] has been written
+  FirebaseJson json;
+  uint32_t included = 0;
+  for (int b = 0; b < BRANCH_METER_COUNT; b++) {
+    BranchReading reading = latestBranchReading(b);
+    if (reading.windows == 0) continue;
+    if ((switchPowerPublished & (1u << b)) &&
+        fabsf(reading.realPower - lastPublishedSwitchPower[b]) < SWITCH_POWER_DEADBAND_W) {
+      continue;
+    }
+    char path[24];
+    unsigned id = BRANCH_SENSORS[b].switchId;
+    snprintf(path, sizeof(path), "%u/power", id);
+    json.set(path, reading.realPower);
+    snprintf(path, sizeof(path), "%u/current", id);
+    json.set(path, reading.currentRMS);
+    snprintf(path, sizeof(path), "%u/powerFactor", id);
+    json.set(path, reading.powerFactor);
+    snprintf(path, sizeof(path), "%u/energy", id);
+    json.set(path, reading.energyWh);
+    lastPublishedSwitchPower[b] = reading.realPower;
+    included |= 1u << b;
+  }
+  if (!included) return;
+
+  if (Firebase.RTDB.updateNodeSilent(&fbdo, "/app/switchStates", &json)) {
+    switchPowerPublished |= included;
+  } else {
+    Serial.printf("Failed to publish per-relay metering: %s\n", fbdo.errorReason().c_str());
+  }
+#endif
+}
+
+// =======================================================================
+//   BATCHED TELEMETRY UPLINK
+// =======================================================================
+// With TELEMETRY_BATCHING enabled, networkTask() appends each interval rollup (one per
+// FIREBASE_INTERVAL_MS) to a RAM batch instead of pushing it, and posts the whole batch to
+// /api/data once it holds BATCH_MAX_SAMPLES readings or BATCH_FLUSH_INTERVAL_MS has
+// passed. Readings are sent as scaled integers; the first row is absolute and each later
+// row is the delta from the one before it. src/lib/telemetry.ts decodes this format.
+#ifndef TELEMETRY_BATCHING
+#define TELEMETRY_BATCHING 1          // 0 = one pushJSON per reading
+#endif
+#define BATCH_FORMAT_VERSION 1
+#define BATCH_FLUSH_INTERVAL_MS 60000
+#define BATCH_MAX_SAMPLES 30
+#define BATCH_BASE_FIELD_COUNT 21
+#define BATCH_FIELD_COUNT (BATCH_BASE_FIELD_COUNT + BRANCH_METER_COUNT)
+#define BATCH_PAYLOAD_SIZE 9216
+#define SWITCH_POWER_SCALE 10
+
+// Means first, under the names the dashboard already reads, with "energy" as the Wh used in
+// the interval rather than the meter's running total. Then the interval extremes, the
+// next-hour forecast and the power quality summary. They are followed by one
+// "switch<id>Power" mean per BRANCH_SENSORS[] row. The forecast only changes once per
+// quarter and the sag/swell counts only with an event, so their deltas are almost always 0.
+const char* const BATCH_FIELDS[BATCH_BASE_FIELD_COUNT] = {
+  "voltage", "current", "power", "apparentPower", "powerFactor", "energy", "temperature", "humidity", "ldr",
+  "voltageMin", "voltageMax", "currentMax", "powerMin", "powerMax", "forecastWh", "forecastBandWh",
+  "frequency", "thdVoltage", "thdCurrent", "voltageSags", "voltageSwells"
+};
+const int32_t BATCH_SCALE[BATCH_BASE_FIELD_COUNT] = {
+  10, 1000, 10, 10, 1000, 1000, 10, 10, 1, 10, 10, 1000, 10, 10, 10, 10, 100, 10, 10, 1, 1
+};
+
+static inline int32_t batchScale(int field) {
+  return field < BATCH_BASE_FIELD_COUNT ? BATCH_SCALE[field] : SWITCH_POWER_SCALE;
+}
+
+struct BatchRow {
+  uint64_t takenAtMs; // Device millis, or Unix ms for rows replayed from the journal
+  int32_t values[BATCH_FIELD_COUNT];
+};
+
+BatchRow batchRows[BATCH_MAX_SAMPLES];
+int batchCount = 0;
+unsigned long batchStartedAt = 0;
+char batchPayload[BATCH_PAYLOAD_SIZE];
+
+BatchRow toBatchRow(const Rollup& rollup) {
+  ConsumptionForecast forecast = currentForecast();
+  PowerQualitySummary pq = currentPowerQuality();
+  const float values[BATCH_BASE_FIELD_COUNT] = {
+    rollup.mean(ROLLUP_VOLTAGE), rollup.mean(ROLLUP_CURRENT), rollup.mean(ROLLUP_POWER),
+    rollup.mean(ROLLUP_APPARENT_POWER), rollup.mean(ROLLUP_POWER_FACTOR), rollup.energyUsedWh(),
+    rollup.mean(ROLLUP_TEMPERATURE), rollup.mean(ROLLUP_HUMIDITY), rollup.mean(ROLLUP_LDR),
+    rollup.min[ROLLUP_VOLTAGE], rollup.max[ROLLUP_VOLTAGE], rollup.max[ROLLUP_CURRENT],
+    rollup.min[ROLLUP_POWER], rollup.max[ROLLUP_POWER], forecast.nextHourWh, forecast.bandWh,
+    pq.frequencyHz, pq.thdVoltage, pq.thdCurrent, (float)pq.sags, (float)pq.swells
+  };
+  BatchRow row;
+  row.takenAtMs = rollup.endedAtMs;
+  for (int f = 0; f < BATCH_BASE_FIELD_COUNT; f++) {
+    row.values[f] = lroundf(values[f] * BATCH_SCALE[f]);
+  }
+#if BRANCH_METERING
+  for (int b = 0; b < BRANCH_METER_COUNT; b++) {
+    row.values[BATCH_BASE_FIELD_COUNT + b] = lroundf(rollup.switchPowerMean(b) * SWITCH_POWER_SCALE);
+  }
+#endif
+  return row;
+}
+
+// Readings per flush; smaller while the heap is tight (MEMORY BUDGET)
+int batchSampleLimit() {
+  return heapHealth() == HEAP_HEALTHY ? BATCH_MAX_SAMPLES : BATCH_TIGHT_SAMPLES;
+}
+
+void appendToBatch(const BatchRow& row) {
+  if (batchCount == BATCH_MAX_SAMPLES) {
+    // The last flush failed and the batch is full: drop the oldest reading
+    memmove(&batchRows[0], &batchRows[1], sizeof(BatchRow) * (BATCH_MAX_SAMPLES - 1));
+    batchCount--;
+  }
+  if (batchCount == 0) batchStartedAt = millis();
+  batchRows[batchCount++] = row;
+}
+
+// printf-style append to batchPayload. Returns false once the payload would overflow.
+static bool payloadAppend(size_t& length, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(batchPayload + length, BATCH_PAYLOAD_SIZE - length, format, args);
+  va_end(args);
+  if (written < 0 || length + written >= BATCH_PAYLOAD_SIZE) return false;
+  length += written;
+  return true;
+}
+
+// Serializes rows into batchPayload and returns its length, or 0 if it did not fit.
+// unixClock marks takenAtMs as Unix ms (journal replay) rather than device millis.
+size_t encodeBatch(const BatchRow* rows, int count, bool unixClock) {
+  ProfileScope profile(PROF_BATCH_ENCODE);
+  size_t length = 0;
+  bool ok = payloadAppend(length, "{\"batch\":%d,\"fields\":[", BATCH_FORMAT_VERSION);
+  for (int f = 0; ok && f < BATCH_BASE_FIELD_COUNT; f++) {
+    ok = payloadAppend(length, f ? ",\"%s\"" : "\"%s\"", BATCH_FIELDS[f]);
+  }
+  for (int b = 0; ok && b < BRANCH_METER_COUNT; b++) {
+    ok = payloadAppend(length, ",\"switch%uPower\"", (unsigned)BRANCH_SENSORS[b].switchId);
+  }
+  ok = ok && payloadAppend(length, "],\"scale\":[");
+  for (int f = 0; ok && f < BATCH_FIELD_COUNT; f++) {
+    ok = payloadAppend(length, f ? ",%ld" : "%ld", (long)batchScale(f));
+  }
+  ok = ok && payloadAppend(length, "],\"t\":[");
+  for (int r = 0; ok && r < count; r++) {
+    int64_t t = r ? (int64_t)(rows[r].takenAtMs - rows[r - 1].takenAtMs) : (int64_t)rows[r].takenAtMs;
+    ok = payloadAppend(length, r ? ",%lld" : "%lld", (long long)t);
+  }
+  ok = ok && payloadAppend(length, "],\"d\":[");
+  for (int r = 0; ok && r < count; r++) {
+    for (int f = 0; ok && f < BATCH_FIELD_COUNT; f++) {
+      int32_t v = r ? rows[r].values[f] - rows[r - 1].values[f] : rows[r].values[f];
+      ok = payloadAppend(length, (r || f) ? ",%ld" : "%ld", (long)v);
+    }
+  }
+  if (unixClock) {
+    ok = ok && payloadAppend(length, "],\"clock\":\"unix\"}");
+  } else {
+    ok = ok && payloadAppend(length, "],\"sentAt\":%lu}", (unsigned long)millis());
+  }
+  return ok ? length : 0;
+}
+
+// Uploads share one long-lived TLS connection instead of a fresh handshake per post, and
+// speak HTTP/1.1 on it directly from the UPLOAD ARENA below: the request head is formatted
+// into uploadHead and the response is read line by line into uploadLine, so a post makes
+// no heap allocation of its own. Batch flushes and journal replays that follow each other
+// closely reuse the socket; if the server has closed a reused connection in the meantime,
+// the request is sent once more on a fresh one. The socket is closed when the device goes
+// offline, after a transport error, while the heap is critical and after
+// UPLOAD_IDLE_CLOSE_MS without an upload.
+#define UPLOAD_TIMEOUT_MS 5000
+#define UPLOAD_IDLE_CLOSE_MS 120000
+#define UPLOAD_HEAD_SIZE 384
+#define UPLOAD_LINE_SIZE 160
+#define UPLOAD_NO_RESPONSE -1  // Failed before the status line: safe to resend
+#define UPLOAD_BROKEN -2       // Failed after it
+
+WiFiClientSecure uploadClient;
+bool uploadClientReady = false;
+unsigned long lastUploadAt = 0;
+
+// UPLOAD ARENA: APP_INGEST_URL split once, plus the request and response line buffers
+char uploadHost[96];
+char uploadPath[128];
+uint16_t uploadPort = 443;
+char uploadHead[UPLOAD_HEAD_SIZE];
+char uploadLine[UPLOAD_LINE_SIZE];
+
+static bool parseIngestUrl() {
+  const char* const scheme = "https://";
+  const char* host = APP_INGEST_URL;
+  if (strncmp(host, scheme, strlen(scheme)) != 0) return false;
+  host += strlen(scheme);
+  const char* path = strchr(host, '/');
+  if (!path) path = host + strlen(host);
+  const char* colon = (const char*)memchr(host, ':', path - host);
+  size_t hostLength = (colon ? colon : path) - host;
+  if (hostLength == 0 || hostLength >= sizeof(uploadHost) || strlen(path) >= sizeof(uploadPath)) return false;
+  memcpy(uploadHost, host, hostLength);
+  uploadHost[hostLength] = '\0';
+  uploadPort = colon ? (uint16_t)atoi(colon + 1) : 443;
+  snprintf(uploadPath, sizeof(uploadPath), "%s", *path ? path : "/");
+  return true;
+}
+
+// Reads one line of the response into uploadLine, without its CRLF and lowercased (only
+// case-insensitive parts are parsed). Overlong lines are truncated. Returns the length, or
+// -1 once the connection closes or the UPLOAD_TIMEOUT_MS since startedAt have passed.
+static int uploadReadLine(unsigned long startedAt) {
+  int length = 0;
+  for (;;) {
+    int c = uploadClient.read();
+    if (c < 0) {
+      if (!uploadClient.connected() || millis() - startedAt > UPLOAD_TIMEOUT_MS) return -1;
+      delay(1);
+      continue;
+    }
+    if (c == '\n') break;
+    if (c != '\r' && length < UPLOAD_LINE_SIZE - 1) uploadLine[length++] = (char)tolower(c);
+  }
+  uploadLine[length] = '\0';
+  return length;
+}
+
+// Discards `remaining` bytes of response body
+static bool uploadDrain(size_t remaining, unsigned long startedAt) {
+  while (remaining > 0) {
+    int n = uploadClient.read((uint8_t*)uploadLine, remaining < sizeof(uploadLine) ? remaining : sizeof(uploadLine));
+    if (n > 0) {
+      remaining -= n;
+      continue;
+    }
+    if (!uploadClient.connected() || millis() - startedAt > UPLOAD_TIMEOUT_MS) return false;
+    delay(1);
+  }
+  return true;
+}
+
+static bool uploadDrainChunked(unsigned long startedAt) {
+  for (;;) {
+    if (uploadReadLine(startedAt) < 0) return false;
+    size_t size = strtoul(uploadLine, NULL, 16);
+    if (size == 0) break;
+    if (!uploadDrain(size, startedAt) || uploadReadLine(startedAt) != 0) return false;
+  }
+  int length;
+  while ((length = uploadReadLine(startedAt)) > 0) {} // Trailers, up to the blank line
+  return length == 0;
+}
+
+// One request/response on the open connection. Returns the HTTP status, UPLOAD_NO_RESPONSE
+// or UPLOAD_BROKEN. The body is read to its end so the connection can carry the next post.
+static int uploadExchange(size_t length) {
+  int headLength = snprintf(uploadHead, sizeof(uploadHead),
+                            "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\n"
+                            "Device-API-Key: %s\r\nContent-Length: %u\r\nConnection: keep-alive\r\n\r\n",
+                            uploadPath, uploadHost, DEVICE_API_KEY, (unsigned)length);
+  if (headLength <= 0 || headLength >= UPLOAD_HEAD_SIZE) return UPLOAD_BROKEN;
+  if (uploadClient.write((const uint8_t*)uploadHead, headLength) != (size_t)headLength ||
+      uploadClient.write((const uint8_t*)batchPayload, length) != length) {
+    return UPLOAD_NO_RESPONSE;
+  }
+
+  unsigned long startedAt = millis();
+  int status = 0;
+  if (uploadReadLine(startedAt) < 0) return UPLOAD_NO_RESPONSE;
+  if (sscanf(uploadLine, "http/1.%*d %d", &status) != 1) return UPLOAD_BROKEN;
+
+  long contentLength = -1;
+  bool chunked = false;
+  bool keepAlive = true;
+  for (;;) {
+    int lineLength = uploadReadLine(startedAt);
+    if (lineLength < 0) return UPLOAD_BROKEN;
+    if (lineLength == 0) break;
+    if (strncmp(uploadLine, "content-length:", 15) == 0) {
+      contentLength = atol(uploadLine + 15);
+    } else if (strncmp(uploadLine, "transfer-encoding:", 18) == 0) {
+      chunked = strstr(uploadLine + 18, "chunked") != NULL;
+    } else if (strncmp(uploadLine, "connection:", 11) == 0) {
+      keepAlive = strstr(uploadLine + 11, "close") == NULL;
+    }
+  }
+  // A body without a length runs to the end of the connection, which is then not reusable
+  bool drained = chunked ? uploadDrainChunked(startedAt)
+                         : contentLength >= 0 && uploadDrain(contentLength, startedAt);
+  if (!drained || !keepAlive) uploadClient.stop();
+  return status;
+}
+
+void closeUploadConnection() {
+  if (!uploadClientReady) return;
+  uploadClient.stop();
+}
+
+// Call from networkTask: drops the connection while offline or once it has gone idle.
+void uploadConnectionStep() {
+  if (uploadClientReady && uploadClient.connected() &&
+      (!isOnline() || millis() - lastUploadAt > UPLOAD_IDLE_CLOSE_MS)) {
+    closeUploadConnection();
+  }
+}
+
+// POSTs the encoded batch to /api/data. Returns true once the backend has stored it.
+bool postBatchPayload(size_t length) {
+  ProfileScope profile(PROF_UPLOAD);
+  if (!uploadClientReady) {
+    if (!parseIngestUrl()) {
+      Serial.println("APP_INGEST_URL must look like https://host[:port]/path");
+      return false;
+    }
+    uploadClient.setInsecure(); // Use setCACert() to pin the server
+    uploadClient.setHandshakeTimeout(UPLOAD_TIMEOUT_MS / 1000);
+    uploadClientReady = true;
+  }
+
+  int status = UPLOAD_NO_RESPONSE;
+  for (int attempt = 0; attempt < 2 && status == UPLOAD_NO_RESPONSE; attempt++) {
+    bool reused = uploadClient.connected();
+    if (!reused && !uploadClient.connect(uploadHost, uploadPort)) break;
+    status = uploadExchange(length);
+    if (status < 0) uploadClient.stop(); // Transport error: reconnect next time
+    if (!reused) break;                  // Only a stale reused connection earns a resend
+  }
+  lastUploadAt = millis();
+
+  if (status != 200) {
+    Serial.printf("Failed to send batch: HTTP %d\n", status);
+    return false;
+  }
+  telemetryDelivered = true;
+  return true;
+}
+
+bool flushBatch() {
+  if (batchCount == 0) return true;
+  if (!isOnline()) return false;
+
+  size_t length = encodeBatch(batchRows, batchCount, false);
+  if (length == 0) {
+    Serial.println("Telemetry batch does not fit BATCH_PAYLOAD_SIZE, dropping it.");
+    batchCount = 0;
+    return false;
+  }
+
+  Serial.printf("Sending batch of %d readings (%u bytes)...\n", batchCount, (unsigned)length);
+  if (!postBatchPayload(length)) return false;
+  batchCount = 0;
+  return true;
+}
+
+// =======================================================================
+//   OFFLINE TELEMETRY JOURNAL (LittleFS)
+// =======================================================================
+// Readings that cannot be uploaded (offline, or a failed flush) are appended to a ring of
+// numbered segment files under JOURNAL_DIR instead of being dropped. Only the newest
+// segment is ever appended to and segments are deleted whole once drained, so writes
+// rotate through the filesystem and LittleFS spreads them across the flash. When the ring
+// is full the oldest segment is discarded. Once back online, drainJournal() replays the
+// oldest records through /api/data, at most one batch per JOURNAL_DRAIN_INTERVAL_MS, so a
+// long outage does not starve live uploads or the switch stream.
+//
+// Records carry the boot they were taken in and their uptime, plus the wall clock if SNTP
+// had synced. Records from the current boot are resolved from their uptime once the clock
+// syncs; a record from an earlier boot that never synced cannot be placed and is skipped.
+#define JOURNAL_DIR "/journal"
+#define JOURNAL_FORMAT_VERSION 5        // Bump when JournalRecord changes; old segments are wiped
+#define JOURNAL_SEGMENT_RECORDS 256     // 29 KB per segment with five per-relay fields
+#define JOURNAL_MAX_SEGMENTS 22         // ~650 KB, ~15 h of rollups at FIREBASE_INTERVAL_MS
+#define JOURNAL_DRAIN_INTERVAL_MS 5000
+#define JOURNAL_DRAIN_BURST 4           // Batches sent back to back on the warm connection
+
+struct JournalRecord {
+  uint32_t unixTime;  // Seconds, 0 if the clock had not synced yet
+  uint32_t uptimeMs;
+  uint16_t bootId;
+  uint16_t checksum;  // Detects a record torn by a reset mid-write
+  int32_t values[BATCH_FIELD_COUNT]; // Scaled as in batchScale()
+};
+static_assert(sizeof(JournalRecord) == 12 + 4 * BATCH_FIELD_COUNT, "JournalRecord is stored on flash, keep it packed");
+
+Preferences journalPrefs;
+bool journalReady = false;
+uint16_t bootId = 0;
+uint64_t bootEpochMs = 0;      // Unix ms at millis() == 0, once SNTP has synced
+uint32_t journalFirst = 0;     // Oldest segment
+uint32_t journalLast = 0;      // Segment being appended to
+uint32_t journalReadIndex = 0; // Records of journalFirst already uploaded
+unsigned long lastJournalDrain = 0;
+
+static void segmentPath(uint32_t segment, char* path, size_t size) {
+  snprintf(path, size, JOURNAL_DIR "/%08lu.bin", (unsigned long)segment);
+}
+
+static uint16_t journalChecksum(JournalRecord record) {
+  record.checksum = 0;
+  const uint8_t* bytes = (const uint8_t*)&record;
+  uint16_t a = 0, b = 0; // Fletcher-16
+  for (size_t i = 0; i < sizeof(record); i++) {
+    a = (a + bytes[i]) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
+
+static void saveJournalCursor() {
+  journalPrefs.putUInt("seg", journalFirst);
+  journalPrefs.putUInt("idx", journalReadIndex);
+}
+
+// Mounts LittleFS (formatting it on first use), finds the segment range and restores the
+// drain cursor. Runs on the network task so a first-boot format does not delay sensing.
+void beginJournal() {
+  journalPrefs.begin("solaris-jrnl", false);
+  bootId = (uint16_t)(journalPrefs.getUInt("boot", 0) + 1);
+  journalPrefs.putUInt("boot", bootId);
+
+  if (!LittleFS.begin(true)) {
+    Serial.println("LittleFS unavailable, offline readings will not be kept.");
+    return;
+  }
+  if (!LittleFS.exists(JOURNAL_DIR)) LittleFS.mkdir(JOURNAL_DIR);
+
+  bool found = false;
+  File dir = LittleFS.open(JOURNAL_DIR);
+  for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile()) {
+    uint32_t segment = strtoul(entry.name(), nullptr, 10);
+    if (!found || segment < journalFirst) journalFirst = segment;
+    if (!found || segment > journalLast) journalLast = segment;
+    found = true;
+  }
+  dir.close();
+
+  if (found && journalPrefs.getUInt("fmt", 0) != JOURNAL_FORMAT_VERSION) {
+    Serial.println("Journal was written by older firmware, discarding it.");
+    char path[32];
+    for (uint32_t segment = journalFirst; segment <= journalLast; segment++) {
+      segmentPath(segment, path, sizeof(path));
+      LittleFS.remove(path);
+    }
+    journalFirst = journalLast = 0;
+  }
+  journalPrefs.putUInt("fmt", JOURNAL_FORMAT_VERSION);
+
+  journalReadIndex = journalPrefs.getUInt("seg", 0) == journalFirst ? journalPrefs.getUInt("idx", 0) : 0;
+  journalReady = true;
+  Serial.printf("Journal: boot %u, segments %lu..%lu\n", (unsigned)bootId,
+                (unsigned long)journalFirst, (unsigned long)journalLast);
+}
+
+// Latches the boot epoch once SNTP has set the clock.
+void syncJournalClock() {
+  if (bootEpochMs || time(nullptr) < CLOCK_VALID_AFTER) return;
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  bootEpochMs = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - millis();
+}
+
+// Unix ms a record was taken at, or 0 if it cannot be placed.
+static uint64_t journalRecordTime(const JournalRecord& record) {
+  if (record.bootId == bootId && bootEpochMs) return bootEpochMs + record.uptimeMs;
+  return (uint64_t)record.unixTime * 1000;
+}
+
+void journalAppend(const BatchRow& row) {
+  if (!journalReady) return;
+
+  JournalRecord record = {};
+  record.uptimeMs = (uint32_t)row.takenAtMs;
+  record.bootId = bootId;
+  record.unixTime = bootEpochMs ? (uint32_t)((bootEpochMs + row.takenAtMs) / 1000) : 0;
+  memcpy(record.values, row.values, sizeof(record.values));
+  record.checksum = journalChecksum(record);
+
+  char path[32];
+  segmentPath(journalLast, path, sizeof(path));
+  File file = LittleFS.open(path, FILE_APPEND);
+  // Start a new segment when this one is full or ends in a torn record
+  if (file && (file.size() >= JOURNAL_SEGMENT_RECORDS * sizeof(JournalRecord) ||
+               file.size() % sizeof(JournalRecord) != 0)) {
+    file.close();
+    segmentPath(++journalLast, path, sizeof(path));
+    file = LittleFS.open(path, FILE_APPEND);
+  }
+  if (!file || file.write((const uint8_t*)&record, sizeof(record)) != sizeof(record)) {
+    Serial.println("Journal write failed.");
+  }
+  if (file) file.close();
+
+  if (journalLast - journalFirst >= JOURNAL_MAX_SEGMENTS) {
+    Serial.println("Journal full, discarding its oldest segment.");
+    segmentPath(journalFirst++, path, sizeof(path));
+    LittleFS.remove(path);
+    journalReadIndex = 0;
+    saveJournalCursor();
+  }
+}
+
+// Moves the readings waiting in the RAM batch into the journal.
+void journalBatch() {
+  for (int r = 0; r < batchCount; r++) journalAppend(batchRows[r]);
+  batchCount = 0;
+}
+
+// Uploads the next run of journaled readings from the oldest segment. Returns true if
+// it made progress and there may be more to send. A run that does not fit batchPayload is
+// halved until it does; the cursor only moves past the records that were uploaded.
+static bool drainJournalBatch() {
+  char path[32];
+  segmentPath(journalFirst, path, sizeof(path));
+  File file = LittleFS.open(path, FILE_READ);
+  uint32_t stored = file ? file.size() / sizeof(JournalRecord) : 0;
+
+  if (journalReadIndex >= stored) {
+    // Segment fully uploaded: delete it. An empty journal restarts from a fresh segment.
+    if (file) file.close();
+    if (stored == 0 && journalFirst == journalLast) return false;
+    bool more = journalFirst != journalLast;
+    LittleFS.remove(path);
+    if (!more) journalLast++;
+    journalFirst++;
+    journalReadIndex = 0;
+    saveJournalCursor();
+    return more;
+  }
+
+  BatchRow rows[BATCH_MAX_SAMPLES];
+  uint32_t rowEnd[BATCH_MAX_SAMPLES]; // Records consumed up to and including each row
+  int limit = batchSampleLimit();
+  int count = 0;
+  uint32_t consumed = 0;
+  uint32_t skipped = 0;
+  JournalRecord record;
+  file.seek(journalReadIndex * sizeof(JournalRecord));
+  while (count < limit && journalReadIndex + consumed < stored &&
+         file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+    consumed++;
+    uint64_t takenAt = journalRecordTime(record);
+    if (record.checksum != journalChecksum(record) || takenAt == 0) {
+      skipped++;
+      continue;
+    }
+    rows[count].takenAtMs = takenAt;
+    memcpy(rows[count].values, record.values, sizeof(record.values));
+    rowEnd[count] = consumed;
+    count++;
+  }
+  file.close();
+
+  if (count > 0) {
+    size_t length = encodeBatch(rows, count, true);
+    while (length == 0 && count > 1) {
+      count /= 2;
+      consumed = rowEnd[count - 1];
+      skipped = consumed - count;
+      length = encodeBatch(rows, count, true);
+    }
+    if (length == 0) {
+      Serial.println("Journal: reading does not fit a batch payload");
+      return false;
+    }
+    Serial.printf("Replaying %d journaled readings (%u bytes)...\n", count, (unsigned)length);
+    if (!postBatchPayload(length)) return false; // Retry the same records next time
+  }
+  if (skipped) Serial.printf("Journal: skipped %lu unplaceable readings\n", (unsigned long)skipped);
+  journalReadIndex += consumed;
+  saveJournalCursor();
+  return true;
+}
+
+// Replays journaled readings: up to JOURNAL_DRAIN_BURST batches every
+// JOURNAL_DRAIN_INTERVAL_MS, one short batch while the heap is tight.
+void drainJournal() {
+  if (!journalReady || !isOnline() || millis() - lastJournalDrain < JOURNAL_DRAIN_INTERVAL_MS) return;
+  lastJournalDrain = millis();
+  int burst = heapHealth() == HEAP_HEALTHY ? JOURNAL_DRAIN_BURST : 1;
+  for (int b = 0; b < burst; b++) {
+    if (!drainJournalBatch()) break;
+  }
+}
+
+// =======================================================================
+//   LOCAL AUTOMATION
+// =======================================================================
+// Runs the app's rule table (AUTOMATION RULES in solaris_core.h) against every sensor
+// snapshot in sensingTask(), so a rule acts within microseconds of the reading and keeps
+// working offline. Rule commands go through executeCommands() like any other command, with
+// no sequence number: a newer command from the app still overrides them. Their states are
+// written back to /app/switchStates with the acknowledgements (COMMAND PIPELINE).
+//
+// networkTask() polls /app/automation/table every AUTOMATION_POLL_MS. A changed table is
+// validated, stored in NVS, so the rules survive a reboot without the network, and handed
+// to sensingTask() through automationUpdates. Only a summary goes back to the cloud:
+// /app/automation/status holds the installed rule count, the rules currently active and,
+// per rule, how often it fired and when it last did. It is written at most every
+// AUTOMATION_REPORT_MS, and only when something changed.
+#define AUTOMATION_POLL_MS 30000
+#define AUTOMATION_REPORT_MS 60000
+
+struct AutomationSummary {
+  uint8_t ruleCount;
+  uint32_t active;
+  uint32_t fired[AUTOMATION_MAX_RULES];
+  uint32_t lastFiredMs[AUTOMATION_MAX_RULES]; // millis(), 0 for never
+  uint32_t changes;                           // Bumped on every install, fire and release
+};
+
+Preferences automationPrefs;
+AutomationTable automationTable = {};           // Owned by sensingTask()
+AutomationState automationState = {};
+SpscRing<AutomationTable, 2> automationUpdates; // networkTask -> sensingTask
+
+AutomationSummary automationSummary = {};
+portMUX_TYPE automationMux = portMUX_INITIALIZER_UNLOCKED;
+
+// networkTask() side: the table bytes last installed, to spot a change
+uint8_t installedTable[AUTOMATION_TABLE_MAX_SIZE];
+int installedTableLength = -1;
+unsigned long lastAutomationPollAt = 0;
+unsigned long lastAutomationReportAt = 0;
+uint32_t reportedAutomationChanges = 0;
+
+// Loads the stored rule table. Runs in setup(), before the tasks start.
+void beginAutomation() {
+  automationPrefs.begin("automation", false);
+  installedTableLength = (int)automationPrefs.getBytes("table", installedTable, sizeof(installedTable));
+  if (installedTableLength > 0 && parseAutomationTable(installedTable, installedTableLength, automationTable)) {
+    Serial.printf("Automation: %u stored rule(s)\n", (unsigned)automationTable.count);
+  } else {
+    installedTableLength = 0;
+    automationTable.count = 0;
+  }
+  automationSummary.ruleCount = automationTable.count;
+}
+
+// Evaluates the rules against one snapshot and drives what they command. Called by
+// sensingTask() for every snapshot.
+void automationStep(const SensorSnapshot& snapshot) {
+  AutomationTable update;
+  bool installed = false;
+  while (automationUpdates.pop(update)) {
+    automationTable = update;
+    automationState = {};
+    installed = true;
+  }
+  if (installed) {
+    portENTER_CRITICAL(&automationMux);
+    automationSummary = {};
+    automationSummary.ruleCount = automationTable.count;
+    automationSummary.changes = 1;
+    portEXIT_CRITICAL(&automationMux);
+  }
+  if (automationTable.count == 0) return;
+
+  float inputs[AUTOMATION_INPUT_COUNT];
+  inputs[AUTOMATION_INPUT_POWER] = snapshot.power;
+  inputs[AUTOMATION_INPUT_LDR] = (float)snapshot.ldrValue;
+  inputs[AUTOMATION_INPUT_TEMPERATURE] = haveTemp ? snapshot.temp : NAN;
+
+  SwitchSnapshot commands = { 0, 0 };
+  uint32_t wasActive = automationState.active;
+  uint32_t fired = automationEvaluate(automationTable, inputs, automationState, commands);
+  if (commands.present) executeCommands(commands, NULL, esp_timer_get_time(), true);
+  if (!fired && automationState.active == wasActive) return;
+
+  portENTER_CRITICAL(&automationMux);
+  automationSummary.active = automationState.active;
+  for (uint32_t bits = fired; bits; bits &= bits - 1) {
+    int rule = __builtin_ctz(bits);
+    automationSummary.fired[rule]++;
+    automationSummary.lastFiredMs[rule] = snapshot.takenAtMs ? snapshot.takenAtMs : 1;
+  }
+  automationSummary.changes++;
+  portEXIT_CRITICAL(&automationMux);
+}
+
+// Fetches the rule table and installs it if it changed. An empty or missing table removes
+// every rule; a malformed one is ignored and the current rules stay.
+static void pollAutomationTable() {
+  if (!Firebase.RTDB.getString(&fbdo, "/app/automation/table")) {
+    if (fbdo.httpCode() != FIREBASE_ERROR_PATH_NOT_EXIST) {
+      Serial.printf("Could not load automation rules: %s\n", fbdo.errorReason().c_str());
+      return;
+    }
+  }
+  uint8_t table[AUTOMATION_TABLE_MAX_SIZE];
+  int length = 0;
+  if (fbdo.dataTypeEnum() == fb_esp_data_type_string) {
+    length = base64Decode(fbdo.stringData().c_str(), table, sizeof(table));
+  }
+  if (length == installedTableLength && memcmp(table, installedTable, length) == 0) return;
+
+  AutomationTable parsed = {};
+  if (length != 0 && !parseAutomationTable(table, length, parsed)) {
+    Serial.println("Ignoring malformed automation rule table.");
+    return;
+  }
+  if (!automationUpdates.push(parsed)) return; // sensingTask() is behind; retried next poll
+  memcpy(installedTable, table, length);
+  installedTableLength = length;
+  if (length == 0) {
+    automationPrefs.remove("table"); // putBytes() refuses an empty value
+  } else {
+    automationPrefs.putBytes("table", installedTable, length);
+  }
+  Serial.printf("Automation: installed %u rule(s)\n", (unsigned)parsed.count);
+}
+
+static void reportAutomation() {
+  AutomationSummary summary;
+  portENTER_CRITICAL(&automationMux);
+  summary = automationSummary;
+  portEXIT_CRITICAL(&automationMux);
+  if (summary.changes == reportedAutomationChanges) return;
+
+  FirebaseJson json;
+  json.set("rules", (int)summary.ruleCount);
+  json.set("active", (double)summary.active); // Bit i set while rule i holds
+  for (int i = 0; i < summary.ruleCount; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), "fired/%d", i);
+    json.set(path, (unsigned long)summary.fired[i]);
+    if (summary.lastFiredMs[i] && bootEpochMs) {
+      snprintf(path, sizeof(path), "lastFiredAt/%d", i);
+      json.set(path, (double)(bootEpochMs + summary.lastFiredMs[i]));
+    }
+  }
+  json.set("updatedAt/.sv", "timestamp");
+  if (Firebase.RTDB.setJSON(&fbdo, "/app/automation/status", &json)) {
+    reportedAutomationChanges = summary.changes;
+  } else {
+    Serial.printf("Failed to report automation status: %s\n", fbdo.errorReason().c_str());
+  }
+}
+
+// networkTask() side of the automation engine
+void automationNetworkStep() {
+  if (!isOnline() || !Firebase.ready()) return;
+  if (millis() - lastAutomationPollAt >= AUTOMATION_POLL_MS || lastAutomationPollAt == 0) {
+    lastAutomationPollAt = millis();
+    pollAutomationTable();
+  }
+  if (millis() - lastAutomationReportAt >= AUTOMATION_REPORT_MS && heapHealth() == HEAP_HEALTHY) {
+    lastAutomationReportAt = millis();
+    reportAutomation();
+  }
+}
+
+// =======================================================================
+//   COMMAND ACKNOWLEDGEMENT UPLINK
+// =======================================================================
+// Writes every pending acknowledgement whose relay has been driven (see COMMAND PIPELINE)
+// to /app/switchAcks, and the states of device-issued commands to /app/switchStates, in one
+// multi-path update. An acknowledgement still waiting for a
+// stagger step stays pending; one replaced by a newer command before it was written is
+// never sent. appliedAt is left out until SNTP has set the clock.
+void flushCommandAcks() {
+  if (!ackPending || millis() - lastAckFlushAt < COMMAND_ACK_FLUSH_MS) return;
+  if (!isOnline() || !Firebase.ready()) return;
+  lastAckFlushAt = millis();
+
+  CommandAck acks[MAX_SWITCH_ID + 1];
+  uint32_t pending;
+  portENTER_CRITICAL(&ackMux);
+  pending = ackPending;
+  memcpy(acks, pendingAcks, sizeof(acks));
+  portEXIT_CRITICAL(&ackMux);
+
+  int64_t drivenUs[MAX_SWITCH_ID + 1];
+  xSemaphoreTake(relayLock, portMAX_DELAY);
+  memcpy(drivenUs, relayDrivenUs, sizeof(drivenUs));
+  xSemaphoreGive(relayLock);
+
+  FirebaseJson json;
+  uint32_t ready = 0;
+  for (uint32_t bits = pending; bits; bits &= bits - 1) {
+    int switchId = __builtin_ctz(bits);
+    const CommandAck& ack = acks[switchId];
+    int64_t appliedUs = ack.drive ? drivenUs[switchId] : ack.receivedUs;
+    if (appliedUs < ack.receivedUs) continue; // Still waiting for its stagger step
+    uint32_t latencyUs = (uint32_t)(appliedUs - ack.receivedUs);
+    if (ack.drive) {
+      actuationLatency.lastUs = latencyUs;
+      if (latencyUs > actuationLatency.maxUs) actuationLatency.maxUs = latencyUs;
+      actuationLatency.count++;
+    }
+
+    char path[48];
+    snprintf(path, sizeof(path), "switchAcks/%d/seq", switchId);
+    json.set(path, (double)ack.seq);
+    snprintf(path, sizeof(path), "switchAcks/%d/state", switchId);
+    json.set(path, ack.state);
+    snprintf(path, sizeof(path), "switchAcks/%d/deviceLatencyUs", switchId);
+    json.set(path, (int)latencyUs);
+    if (bootEpochMs) {
+      snprintf(path, sizeof(path), "switchAcks/%d/appliedAt", switchId);
+      json.set(path, (double)(bootEpochMs + appliedUs / 1000));
+    }
+    snprintf(path, sizeof(path), "switchAcks/%d/ackedAt/.sv", switchId);
+    json.set(path, "timestamp");
+    if (ack.local) {
+      snprintf(path, sizeof(path), "switchStates/%d/state", switchId);
+      json.set(path, ack.state);
+    }
+    ready |= 1u << switchId;
+
+    Serial.printf("Switch %d seq %lu state %s: relay %s %u us after receipt\n", switchId,
+                  (unsigned long)ack.seq, ack.state ? "true (OFF)" : "false (ON)",
+                  ack.drive ? "driven" : "already set", (unsigned)latencyUs);
+  }
+  if (!ready) return;
+
+  if (!Firebase.RTDB.updateNodeSilent(&fbdo, "/app", &json)) {
+    Serial.printf("Failed to write command acknowledgements: %s\n", fbdo.errorReason().c_str());
+    return; // Still pending, retried on the next flush
+  }
+  // Only clear what was written; a newer command that arrived meanwhile stays pending
+  portENTER_CRITICAL(&ackMux);
+  for (uint32_t bits = ready; bits; bits &= bits - 1) {
+    int switchId = __builtin_ctz(bits);
+    if (pendingAcks[switchId].seq == acks[switchId].seq &&
+        pendingAcks[switchId].receivedUs == acks[switchId].receivedUs) {
+      ackPending &= ~(1u << switchId);
+    }
+  }
+  portEXIT_CRITICAL(&ackMux);
+}
+
+// =======================================================================
+//   OTA UPDATES
+// =======================================================================
+// Updates come from a release the web app stages in RTDB (src/lib/ota.ts):
+//   /app/ota/release           version, targetSha256 (hex), targetSize, imageUrl (optional),
+//                              patches/<source key>: URL of a patch against that image
+//   /app/ota/rollout/<device>  true while this device may install the release
+//   /app/ota/devices/<device>  state written back by the device
+// <device> is the station MAC as 12 hex digits, <source key> the first 16 hex digits of the
+// SHA-256 of the image a patch was made against.
+//
+// networkTask() polls the rollout flag every OTA_POLL_MS while it is online with a healthy
+// heap. When
+// it is set and the release is not the running image, otaTask() downloads the patch for the
+// running image (DELTA PATCHES in solaris_core.h) and applies it as it arrives: COPY ops
+// read the running slot in place and every target byte goes straight to esp_ota_write()
+// on the other slot, so only one OTA_CHUNK_SIZE buffer is held, never an image. Without a
+// patch for the running image the full image at imageUrl is streamed the same way. The
+// result must hash to targetSha256 and pass esp_ota_end()'s image check before the boot
+// slot is switched; any failure leaves the running slot as it was.
+//
+// The new image boots on trial: verifyRollbackLater() stops the Arduino core from accepting
+// it at startup, and otaTrialStep() marks it valid once it is online, has delivered
+// telemetry and has stayed up for OTA_TRIAL_MS. If it is not there by OTA_TRIAL_DEADLINE_MS
+// it rolls back and reboots into the previous image, which reports the release as rolled
+// back and never installs it again. A crash or watchdog reset during the trial is rolled
+// back by the bootloader (CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE).
+//
+// A trial that never got WiFi cannot tell an outage from an image that broke the network,
+// so it still rolls back at the deadline, but the release is not blacklisted for it: the
+// previous image installs it again once it is online. Only after OTA_MAX_OFFLINE_TRIALS
+// such trials in a row is the release treated as failed.
+//
+// Needs a partition table with two OTA slots, as the Arduino default has. A download adds
+// one TLS connection of its own, so it only starts while the heap is healthy and is
+// abandoned if the heap becomes critical.
+#ifndef OTA_UPDATES
+#define OTA_UPDATES 1
+#endif
+#define OTA_POLL_MS 600000
+#define OTA_TRIAL_MS 120000
+#define OTA_TRIAL_DEADLINE_MS 900000
+#define OTA_TIMEOUT_MS 15000         // A download that stalls this long is abandoned
+#define OTA_MAX_ATTEMPTS 3           // Downloads of one release per boot
+#define OTA_MAX_OFFLINE_TRIALS 3     // Trials of one release without WiFi before it is failed
+#define OTA_PROGRESS_REPORT_MS 30000
+#define OTA_CHUNK_SIZE 1024
+#define OTA_URL_SIZE 256
+#define OTA_TASK_PRIORITY 2          // Below networkTask, so a download never delays an upload
+
+#if OTA_UPDATES
+enum OtaState {
+  OTA_IDLE,        // No update for this device, or already running the release
+  OTA_DOWNLOADING, // otaTask() is writing the update to the other slot
+  OTA_INSTALLED,   // Verified and set to boot; networkTask() restarts into it
+  OTA_FAILED,      // The last attempt failed, see error
+  OTA_TRIAL,       // Running a new image that is not confirmed yet
+  OTA_CONFIRMED,   // The new image passed its trial
+  OTA_ROLLED_BACK, // A new image failed its trial; this is the previous one
+};
+
+static const char* const OTA_STATE_NAMES[] = {
+  "idle", "downloading", "installed", "failed", "trial", "confirmed", "rolledBack",
+};
+
+struct OtaJob {
+  char url[OTA_URL_SIZE];
+  bool delta; // url is a patch against the running image, not a full image
+  uint32_t targetSize;
+  uint8_t targetSha256[32];
+  char version[24];
+};
+
+struct OtaStatus {
+  OtaState state;
+  uint32_t received; // Download bytes so far
+  uint32_t changes;  // Bumped on every state or error change
+  char release[24];
+  char error[48];
+};
+
+struct OtaWriter {
+  esp_ota_handle_t handle;
+  mbedtls_sha256_context sha;
+};
+
+Preferences otaPrefs;
+char otaDeviceId[13];
+const esp_partition_t* otaRunning = NULL;
+uint32_t otaRunningSize = 0;
+uint8_t otaRunningSha256[32];
+bool otaRunningHashed = false;
+
+OtaJob otaJob; // Written by networkTask() before otaTask() starts, read-only while it runs
+OtaStatus otaStatus = {};
+portMUX_TYPE otaMux = portMUX_INITIALIZER_UNLOCKED;
+DeltaApplier otaApplier;
+uint8_t otaChunk[OTA_CHUNK_SIZE]; // otaTask() during a download, networkTask() otherwise
+
+// networkTask() side
+uint8_t otaAttemptSha256[32];
+int otaAttempts = 0;
+bool otaTrialSawWifi = false;
+unsigned long lastOtaPollAt = 0;
+unsigned long lastOtaReportAt = 0;
+uint32_t reportedOtaChanges = UINT32_MAX; // First report registers the device and its version
+
+// Keeps a freshly installed image on trial (ESP_OTA_IMG_PENDING_VERIFY) past startup, where
+// the Arduino core would otherwise mark it valid straight away. otaTrialStep() decides.
+extern "C" bool verifyRollbackLater() {
+  return true;
+}
+
+static void otaSetState(OtaState state, const char* error) {
+  portENTER_CRITICAL(&otaMux);
+  if (otaStatus.state != state || strcmp(otaStatus.error, error) != 0) {
+    otaStatus.state = state;
+    snprintf(otaStatus.error, sizeof(otaStatus.error), "%s", error);
+    otaStatus.changes++;
+  }
+  portEXIT_CRITICAL(&otaMux);
+}
+
+static OtaStatus otaCurrentStatus() {
+  OtaStatus status;
+  portENTER_CRITICAL(&otaMux);
+  status = otaStatus;
+  portEXIT_CRITICAL(&otaMux);
+  return status;
+}
+
+static void hexEncode(const uint8_t* data, int length, char* out) {
+  for (int k = 0; k < length; k++) sprintf(out + 2 * k, "%02x", data[k]);
+}
+
+static bool hexDecode(const char* text, uint8_t* out, int length) {
+  if ((int)strlen(text) != 2 * length) return false;
+  for (int k = 0; k < length; k++) {
+    unsigned value;
+    if (!isxdigit((unsigned char)text[2 * k]) || !isxdigit((unsigned char)text[2 * k + 1]) ||
+        sscanf(text + 2 * k, "%2x", &value) != 1) {
+      return false;
+    }
+    out[k] = (uint8_t)value;
+  }
+  return true;
+}
+
+// Works out whether this boot is a trial or the aftermath of a rollback. Runs in setup(),
+// before the tasks start. The slot written by a successful install is only cleared once the
+// image in it has passed its trial, so finding it set while running from the other slot
+// means the update was rolled back.
+void beginOta() {
+  uint8_t mac[6];
+  esp_efuse_mac_get_default(mac);
+  snprintf(otaDeviceId, sizeof(otaDeviceId), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4],
+           mac[5]);
+  otaRunning = esp_ota_get_running_partition();
+  otaPrefs.begin("ota", false);
+  uint32_t slot = otaPrefs.getUInt("slot", 0);
+  if (slot == 0) return;
+
+  otaPrefs.getString("version", otaStatus.release, sizeof(otaStatus.release));
+  if (otaRunning->address == slot) {
+    otaSetState(OTA_TRIAL, "");
+    Serial.printf("OTA: %s is on trial\n", otaStatus.release);
+    return;
+  }
+  // "timedOut" is only set by a trial that never got WiFi; a crash rollback leaves it clear
+  bool offlineOnly = otaPrefs.getBool("timedOut", false);
+  otaPrefs.remove("timedOut");
+  otaPrefs.remove("slot");
+  if (offlineOnly && otaPrefs.getUChar("offline", 0) < OTA_MAX_OFFLINE_TRIALS) {
+    otaSetState(OTA_ROLLED_BACK, "offline during trial, will retry");
+    Serial.printf("OTA: %s was rolled back while offline, will retry\n", otaStatus.release);
+    return;
+  }
+  uint8_t target[32];
+  if (otaPrefs.getBytes("target", target, sizeof(target)) == sizeof(target)) {
+    otaPrefs.putBytes("failed", target, sizeof(target));
+  }
+  otaSetState(OTA_ROLLED_BACK, "");
+  Serial.printf("OTA: %s was rolled back\n", otaStatus.release);
+}
+
+// SHA-256 of the running image as it sits in flash, the same bytes as the .bin it was built
+// as. Patches are made against it. Reads the image once per boot, on the first poll.
+static bool hashRunningImage() {
+  if (otaRunningHashed) return true;
+  esp_partition_pos_t position = { otaRunning->address, otaRunning->size };
+  esp_image_metadata_t image;
+  if (esp_image_get_metadata(&position, &image) != ESP_OK) return false;
+
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  bool ok = true;
+  for (uint32_t offset = 0; ok && offset < image.image_len; offset += OTA_CHUNK_SIZE) {
+    uint32_t n = min((uint32_t)OTA_CHUNK_SIZE, image.image_len - offset);
+    ok = esp_partition_read(otaRunning, offset, otaChunk, n) == ESP_OK;
+    if (ok) mbedtls_sha256_update(&sha, otaChunk, n);
+  }
+  mbedtls_sha256_finish(&sha, otaRunningSha256);
+  mbedtls_sha256_free(&sha);
+  otaRunningSize = image.image_len;
+  otaRunningHashed = ok;
+  return ok;
+}
+
+static bool otaReadSource(void* context, uint32_t offset, uint8_t* out, uint32_t length) {
+  return esp_partition_read(otaRunning, offset, out, length) == ESP_OK;
+}
+
+// Flash writes stall both cores briefly, as the journal's do; the ADC keeps filling its DMA
+// frames meanwhile.
+static bool otaWriteTarget(void* context, const uint8_t* data, uint32_t length) {
+  OtaWriter* writer = (OtaWriter*)context;
+  mbedtls_sha256_update(&writer->sha, data, length);
+  return esp_ota_write(writer->handle, data, length) == ESP_OK;
+}
+
+// Feeds one downloaded piece of a patch to the applier. Returns why it failed, or NULL.
+static const char* otaApplyPiece(uint32_t length, const DeltaIo& io) {
+  uint32_t used = 0;
+  while (used < length) {
+    used += deltaApplyFeed(otaApplier, otaChunk + used, length - used, io);
+    const DeltaPatchHeader& header = otaApplier.header;
+    switch (otaApplier.status) {
+      case DELTA_HEADER_READY:
+        if (header.sourceSize != otaRunningSize || memcmp(header.sourceSha256, otaRunningSha256, 32) != 0) {
+          return "patch is for another image";
+        }
+        if (header.targetSize != otaJob.targetSize || memcmp(header.targetSha256, otaJob.targetSha256, 32) != 0) {
+          return "patch is for another release";
+        }
+        break;
+      case DELTA_MORE:
+        break;
+      case DELTA_DONE:
+        if (used < length) return "data after the end of the patch";
+        break;
+      case DELTA_BAD_PATCH:
+        return "malformed patch";
+      case DELTA_IO_FAILED:
+        return "flash read or write failed";
+    }
+  }
+  return NULL;
+}
+
+// Streams `size` bytes of the response into `slot`, through the patch applier for a delta.
+static const char* otaStream(HTTPClient& http, const esp_partition_t* slot, uint32_t size) {
+  OtaWriter writer;
+  if (esp_ota_begin(slot, OTA_WITH_SEQUENTIAL_WRITES, &writer.handle) != ESP_OK) return "could not open the OTA slot";
+  mbedtls_sha256_init(&writer.sha);
+  mbedtls_sha256_starts(&writer.sha, 0);
+  DeltaIo io = { &writer, otaReadSource, otaWriteTarget };
+  deltaApplyBegin(otaApplier);
+
+  WiFiClient* stream = http.getStreamPtr();
+  const char* error = NULL;
+  uint32_t received = 0;
+  unsigned long lastDataAt = millis();
+  while (!error && received < size) {
+    if (heapHealth() == HEAP_CRITICAL) {
+      error = "heap critical";
+      break;
+    }
+    int available = stream->available();
+    if (available <= 0) {
+      if (!stream->connected() || millis() - lastDataAt > OTA_TIMEOUT_MS) error = "download stalled";
+      else delay(10);
+      continue;
+    }
+    uint32_t n = min((uint32_t)available, min((uint32_t)OTA_CHUNK_SIZE, size - received));
+    int got = stream->read(otaChunk, n);
+    if (got <= 0) continue;
+    lastDataAt = millis();
+    received += got;
+    portENTER_CRITICAL(&otaMux);
+    otaStatus.received = received;
+    portEXIT_CRITICAL(&otaMux);
+    if (otaJob.delta) error = otaApplyPiece(got, io);
+    else if (!otaWriteTarget(&writer, otaChunk, got)) error = "flash write failed";
+  }
+
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&writer.sha, digest);
+  mbedtls_sha256_free(&writer.sha);
+  if (!error && otaJob.delta && otaApplier.status != DELTA_DONE) error = "patch ended early";
+  if (!error && memcmp(digest, otaJob.targetSha256, 32) != 0) error = "image hash does not match the release";
+  if (error) {
+    esp_ota_abort(writer.handle);
+    return error;
+  }
+  if (esp_ota_end(writer.handle) != ESP_OK) return "image failed verification";
+
+  // Record the install before switching, so the new image never boots without its trial
+  uint8_t previous[32];
+  if (otaPrefs.getBytes("target", previous, sizeof(previous)) != sizeof(previous) ||
+      memcmp(previous, otaJob.targetSha256, 32) != 0) {
+    otaPrefs.remove("offline");
+  }
+  otaPrefs.putBytes("target", otaJob.targetSha256, 32);
+  otaPrefs.putString("version", otaJob.version);
+  otaPrefs.putUInt("slot", slot->address);
+  if (esp_ota_set_boot_partition(slot) != ESP_OK) {
+    otaPrefs.remove("slot");
+    otaPrefs.remove("target");
+    otaPrefs.remove("version");
+    return "could not switch the boot slot";
+  }
+  return NULL;
+}
+
+static const char* otaDownload() {
+  static char message[48];
+  const esp_partition_t* slot = esp_ota_get_next_update_partition(NULL);
+  if (!slot) return "no OTA slot in the partition table";
+  if (otaJob.targetSize > slot->size) return "image larger than the OTA slot";
+
+  WiFiClientSecure client;
+  client.setInsecure(); // Use setCACert() to pin the server; the image hash is checked either way
+  HTTPClient http;
+  http.setTimeout(OTA_TIMEOUT_MS);
+  http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+  if (!http.begin(client, otaJob.url)) return "bad download URL";
+
+  const char* error;
+  int status = http.GET();
+  int size = http.getSize();
+  if (status != 200) {
+    snprintf(message, sizeof(message), "download failed: HTTP %d", status);
+    error = message;
+  } else if (size <= 0) {
+    error = "download has no Content-Length";
+  } else if (!otaJob.delta && (uint32_t)size != otaJob.targetSize) {
+    error = "image size does not match the release";
+  } else {
+    error = otaStream(http, slot, (uint32_t)size);
+  }
+  http.end();
+  return error;
+}
+
+void otaTask(void* param) {
+  Serial.printf("OTA: downloading %s %s\n", otaJob.version, otaJob.delta ? "patch" : "image");
+  const char* error = otaDownload();
+  if (error) Serial.printf("OTA: update failed, %s\n", error);
+  otaSetState(error ? OTA_FAILED : OTA_INSTALLED, error ? error : "");
+  vTaskDelete(NULL);
+}
+
+// Reads the rollout flag and, if this device is in the rollout of a release it is not
+// running, finds the patch for the running image and starts otaTask() on it.
+static void pollOtaRelease() {
+  char path[64];
+  snprintf(path, sizeof(path), "/app/ota/rollout/%s", otaDeviceId);
+  if (!Firebase.RTDB.getBool(&fbdo, path)) {
+    if (fbdo.httpCode() != FIREBASE_ERROR_PATH_NOT_EXIST) {
+      Serial.printf("OTA: could not read the rollout flag: %s\n", fbdo.errorReason().c_str());
+    }
+    return;
+  }
+  if (!fbdo.boolData()) return;
+
+  OtaJob job = {};
+  if (!Firebase.RTDB.getString(&fbdo, "/app/ota/release/targetSha256") ||
+      !hexDecode(fbdo.stringData().c_str(), job.targetSha256, 32)) {
+    return; // No release staged
+  }
+  if (!hashRunningImage()) {
+    Serial.println("OTA: could not read the running image");
+    return;
+  }
+  if (memcmp(job.targetSha256, otaRunningSha256, 32) == 0) return; // Already running it
+  uint8_t failed[32];
+  if (otaPrefs.getBytes("failed", failed, sizeof(failed)) == sizeof(failed) &&
+      memcmp(failed, job.targetSha256, 32) == 0) {
+    return; // Rolled back before; only a new release is tried
+  }
+  if (memcmp(job.targetSha256, otaAttemptSha256, 32) != 0) {
+    memcpy(otaAttemptSha256, job.targetSha256, 32);
+    otaAttempts = 0;
+  }
+  if (otaAttempts >= OTA_MAX_ATTEMPTS) return;
+
+  if (!Firebase.RTDB.getInt(&fbdo, "/app/ota/release/targetSize") || fbdo.intData() <= 0) return;
+  job.targetSize = (uint32_t)fbdo.intData();
+  if (Firebase.RTDB.getString(&fbdo, "/app/ota/release/version")) {
+    snprintf(job.version, sizeof(job.version), "%s", fbdo.stringData().c_str());
+  }
+  char key[17];
+  hexEncode(otaRunningSha256, 8, key);
+  snprintf(path, sizeof(path), "/app/ota/release/patches/%s", key);
+  job.delta = Firebase.RTDB.getString(&fbdo, path);
+  if (!job.delta && !Firebase.RTDB.getString(&fbdo, "/app/ota/release/imageUrl")) {
+    portENTER_CRITICAL(&otaMux);
+    snprintf(otaStatus.release, sizeof(otaStatus.release), "%s", job.version);
+    portEXIT_CRITICAL(&otaMux);
+    otaSetState(OTA_FAILED, "no patch for the running image");
+    return;
+  }
+  if (fbdo.stringData().length() >= sizeof(job.url)) return;
+  snprintf(job.url, sizeof(job.url), "%s", fbdo.stringData().c_str());
+
+  otaAttempts++;
+  otaJob = job;
+  portENTER_CRITICAL(&otaMux);
+  snprintf(otaStatus.release, sizeof(otaStatus.release), "%s", job.version);
+  otaStatus.received = 0;
+  portEXIT_CRITICAL(&otaMux);
+  otaSetState(OTA_DOWNLOADING, "");
+  if (xTaskCreatePinnedToCore(otaTask, "ota", 8192, NULL, OTA_TASK_PRIORITY, NULL, 0) != pdPASS) {
+    otaSetState(OTA_FAILED, "could not start the OTA task");
+  }
+}
+
+// Writes the state to /app/ota/devices/<device> once after boot and whenever it changes, and
+// the progress of a download every OTA_PROGRESS_REPORT_MS. The app stages rollouts over the
+// devices listed there.
+static void reportOta() {
+  OtaStatus status = otaCurrentStatus();
+  bool progressDue = status.state == OTA_DOWNLOADING && millis() - lastOtaReportAt >= OTA_PROGRESS_REPORT_MS;
+  if (status.changes == reportedOtaChanges && !progressDue) return;
+
+  FirebaseJson json;
+  json.set("state", OTA_STATE_NAMES[status.state]);
+  json.set("running", FIRMWARE_VERSION);
+  if (status.release[0]) json.set("release", status.release);
+  if (status.error[0]) json.set("error", status.error);
+  if (status.state == OTA_DOWNLOADING) json.set("received", (unsigned long)status.received);
+  json.set("updatedAt/.sv", "timestamp");
+  char path[48];
+  snprintf(path, sizeof(path), "/app/ota/devices/%s", otaDeviceId);
+  lastOtaReportAt = millis();
+  if (Firebase.RTDB.setJSON(&fbdo, path, &json)) {
+    reportedOtaChanges = status.changes;
+  } else {
+    Serial.printf("Failed to report OTA state: %s\n", fbdo.errorReason().c_str());
+  }
+}
+
+// Confirms or rolls back a new image on trial
+static void otaTrialStep() {
+  if (isOnline()) otaTrialSawWifi = true;
+  if (isOnline() && Firebase.ready() && telemetryDelivered && millis() >= OTA_TRIAL_MS) {
+    esp_ota_mark_app_valid_cancel_rollback();
+    otaPrefs.remove("slot");
+    otaPrefs.remove("offline");
+    otaSetState(OTA_CONFIRMED, "");
+    Serial.println("OTA: update confirmed");
+  } else if (millis() >= OTA_TRIAL_DEADLINE_MS) {
+    Serial.println("OTA: update did not come online, rolling back");
+    if (!otaTrialSawWifi) {
+      otaPrefs.putUChar("offline", otaPrefs.getUChar("offline", 0) + 1);
+      otaPrefs.putBool("timedOut", true);
+    }
+    journalBatch();
+    esp_ota_mark_app_invalid_rollback_and_reboot(); // Only returns without a previous image
+    otaPrefs.remove("slot");
+    otaSetState(OTA_FAILED, "trial failed, no previous image");
+  }
+}
+
+// networkTask() side of OTA updates
+void otaNetworkStep(bool reporting) {
+  OtaState state = otaCurrentStatus().state;
+  if (state == OTA_TRIAL) otaTrialStep();
+  if (state == OTA_INSTALLED) {
+    if (reporting) reportOta();
+    journalBatch();
+    Serial.println("OTA: restarting into the update");
+    esp_restart();
+  }
+  if (!reporting) return;
+  reportOta();
+  if (state != OTA_DOWNLOADING && state != OTA_TRIAL &&
+      (lastOtaPollAt == 0 || millis() - lastOtaPollAt >= OTA_POLL_MS)) {
+    lastOtaPollAt = millis();
+    pollOtaRelease();
+  }
+}
+#endif
+
+// =======================================================================
+//   LCD RENDERER
+// =======================================================================
+// lcdTask() renders the current page into lcdFrame, compares it with what the display
+// already shows and writes only the cells that changed, so the display never flickers and
+// an unchanged reading costs no bus traffic. lcd.clear() (~2 ms busy-wait) is only used at
+// boot. At most LCD_MAX_CELLS_PER_TICK cells are written per tick, so a page change is
+// spread over a few ticks instead of one long burst of bit-banged nibbles.
+#if LCD_DISPLAY
+#define LCD_COLS 16
+#define LCD_ROWS 2
+#define LCD_TICK_MS 200
+#define LCD_PAGE_MS 4000
+#define LCD_MAX_CELLS_PER_TICK 16
+
+enum LcdPage {
+  LCD_PAGE_POWER,
+  LCD_PAGE_QUALITY,
+  LCD_PAGE_ENVIRONMENT,
+  LCD_PAGE_HISTORY,
+  LCD_PAGE_COUNT
+};
+
+char lcdFrame[LCD_ROWS][LCD_COLS];
+char lcdShown[LCD_ROWS][LCD_COLS]; // '\0' = unknown, so the first frame writes every cell
+
+// printf into one frame row, padded with spaces to the full width.
+static void lcdRow(int row, const char* format, ...) {
+  char text[LCD_COLS + 1];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (length < 0) length = 0;
+  if (length > LCD_COLS) length = LCD_COLS;
+  memset(lcdFrame[row], ' ', LCD_COLS);
+  memcpy(lcdFrame[row], text, length);
+}
+
+void renderLcdPage(LcdPage page, const SensorSnapshot& snapshot) {
+  switch (page) {
+    case LCD_PAGE_POWER:
+      lcdRow(0, "V:%.0fV A:%.2fA", snapshot.voltageRMS, snapshot.currentRMS);
+      lcdRow(1, "P:%.0fW LDR:%d", snapshot.power, snapshot.ldrValue);
+      break;
+
+    case LCD_PAGE_QUALITY:
+      lcdRow(0, "PF:%.2f %.0fVA", snapshot.powerFactor, snapshot.apparentPower);
+      lcdRow(1, "E:%.3fkWh", snapshot.energyWh / 1000.0);
+      break;
+
+    case LCD_PAGE_ENVIRONMENT:
+      lcdRow(0, "T:%.1fC H:%.0f%%", snapshot.temp, snapshot.hum);
+      lcdRow(1, isOnline() ? "Online" : "Offline");
+      break;
+
+    case LCD_PAGE_HISTORY: {
+      Rollup quarter, newest, oldest;
+      if (rollupHistory(ROLLUP_TIER_QUARTER, 0, quarter)) {
+        lcdRow(0, "15m pk:%.0fW", quarter.max[ROLLUP_POWER]);
+      } else {
+        lcdRow(0, "15m pk: --");
+      }
+      // Energy over the minutes kept, up to the last hour
+      uint32_t ago = ROLLUP_MINUTES_KEPT;
+      while (ago > 0 && !rollupHistory(ROLLUP_TIER_MINUTE, ago - 1, oldest)) ago--;
+      if (ago > 0 && rollupHistory(ROLLUP_TIER_MINUTE, 0, newest)) {
+        lcdRow(1, "%lum:%.3fkWh", (unsigned long)ago, (newest.energyEndWh - oldest.energyStartWh) / 1000.0);
+      } else {
+        lcdRow(1, "1h: --");
+      }
+      break;
+    }
+
+    case LCD_PAGE_COUNT:
+      break;
+  }
+}
+
+// Writes the cells of lcdFrame that differ from lcdShown, one cursor move per changed run.
+void lcdFlush() {
+  int budget = LCD_MAX_CELLS_PER_TICK;
+  for (int row = 0; row < LCD_ROWS && budget > 0; row++) {
+    int col = 0;
+    while (col < LCD_COLS && budget > 0) {
+      if (lcdFrame[row][col] == lcdShown[row][col]) {
+        col++;
+        continue;
+      }
+      lcd.setCursor(col, row);
+      while (col < LCD_COLS && budget > 0 && lcdFrame[row][col] != lcdShown[row][col]) {
+        lcd.write((uint8_t)lcdFrame[row][col]);
+        lcdShown[row][col] = lcdFrame[row][col];
+        col++;
+        budget--;
+      }
+    }
+  }
+}
+#endif
+
+// =======================================================================
+//   TASKS
+// =======================================================================
+// Core 1 (APP_CPU): samplerTask (prio 5), sensingTask (prio 4), lcdTask and pqTask (prio 1)
+// samplerTask and pqTask only exist with measured sensors, lcdTask only with LCD_DISPLAY.
+// Core 0 (PRO_CPU): WiFi stack, commandTask (prio 4, MQTT transport only), networkTask (prio 3),
+//                  otaTask (prio 2, only while an update downloads)
+// The Firebase library runs the /app/switchStates stream on its own task, so a slow
+// pushJSON in networkTask never delays relay actuation or sampling.
+#define SENSING_TASK_PRIORITY 4
+#define COMMAND_TASK_PRIORITY 4 // Above networkTask so a frame is not queued behind an upload
+#define NETWORK_TASK_PRIORITY 3
+#define LCD_TASK_PRIORITY 1
+
+void sensingTask(void* param) {
+#if !SIMULATED_SENSORS
+  beginCalibration(); // Waits at most for the first sample window
+#endif
+  TickType_t lastWake = xTaskGetTickCount();
+  for (;;) {
+    SensorSnapshot snapshot = readAllSensors();
+#if !SIMULATED_SENSORS
+    calibrationStep(snapshot);
+    handleCalibrationCommand(snapshot);
+#endif
+    rollupStep(snapshot);
+    forecastStep();
+    reportStep(snapshot);
+    automationStep(snapshot);
+#if LCD_DISPLAY
+    // A full ring means the LCD is behind; it only needs the latest snapshot anyway.
+    displayRing.push(snapshot);
+#endif
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(SENSOR_INTERVAL_MS));
+  }
+}
+
+void networkTask(void* param) {
+#if PROFILING
+  unsigned long lastDiagnosticsAt = 0;
+#endif
+  unsigned long lastSwitchMeteringAt = 0;
+  unsigned long lastPowerQualityAt = 0;
+  unsigned long lastPowerReportAt = 0;
+  beginJournal();
+  for (;;) {
+    if (heapGuardStep()) {
+      journalBatch();
+      Serial.println("Heap critical for too long, restarting.");
+      esp_restart();
+    }
+    HeapHealth health = heapHealth();
+    bool uploading = isOnline() && health != HEAP_CRITICAL;
+    bool reporting = isOnline() && health == HEAP_HEALTHY && Firebase.ready();
+    connectionStep();
+    flushCommandAcks();
+#if COMMAND_TRANSPORT == COMMAND_TRANSPORT_MQTT
+    syncCommandStates();
+#endif
+    syncJournalClock();
+    Rollup rollup;
+#if TELEMETRY_BATCHING
+    bool flushDue = false;
+#endif
+    while (telemetryRing.pop(rollup)) {
+      BatchRow row = toBatchRow(rollup);
+#if TELEMETRY_BATCHING
+      if (!uploading) {
+        journalBatch();
+        journalAppend(row);
+      } else {
+        appendToBatch(row);
+        flushDue = flushDue || REPORT_BY_EXCEPTION || batchCount >= batchSampleLimit() ||
+                   millis() - batchStartedAt >= BATCH_FLUSH_INTERVAL_MS;
+      }
+#else
+      if (!uploading || !sendSensorDataToFirebase(rollup)) journalAppend(row);
+#endif
+    }
+#if TELEMETRY_BATCHING
+    if (flushDue && !flushBatch()) journalBatch();
+#endif
+    if (uploading) {
+      drainJournal();
+      automationNetworkStep();
+    } else if (health == HEAP_CRITICAL) {
+      closeUploadConnection(); // Frees its TLS buffers until the heap recovers
+    }
+    uploadConnectionStep();
+    powerBudgetStep();
+    if (reporting && millis() - lastPowerReportAt >= POWER_REPORT_MS) {
+      lastPowerReportAt = millis();
+      publishPowerBudget();
+    }
+    if (reporting && millis() - lastSwitchMeteringAt >= SWITCH_METERING_INTERVAL_MS) {
+      lastSwitchMeteringAt = millis();
+      publishSwitchMetering();
+    }
+    if (reporting && millis() - lastPowerQualityAt >= PQ_REPORT_MS) {
+      lastPowerQualityAt = millis();
+      publishPowerQuality();
+    }
+#if OTA_UPDATES
+    otaNetworkStep(reporting);
+#endif
+#if PROFILING
+    if (reporting && millis() - lastDiagnosticsAt >= DIAGNOSTICS_INTERVAL_MS) {
+      lastDiagnosticsAt = millis();
+      publishDiagnostics();
+    }
+#endif
+    vTaskDelay(pdMS_TO_TICKS(100));
+  }
+}
+
+#if LCD_DISPLAY
+void lcdTask(void* param) {
+  SensorSnapshot snapshot = {};
+  bool haveSnapshot = false;
+  int page = LCD_PAGE_POWER;
+  unsigned long pageSince = millis();
+  for (;;) {
+    while (displayRing.pop(snapshot)) haveSnapshot = true;
+    if (millis() - pageSince >= LCD_PAGE_MS) {
+      page = (page + 1) % LCD_PAGE_COUNT;
+      pageSince = millis();
+    }
+    if (haveSnapshot) {
+      ProfileScope profile(PROF_LCD);
+      renderLcdPage((LcdPage)page, snapshot);
+      lcdFlush();
+    }
+    vTaskDelay(pdMS_TO_TICKS(LCD_TICK_MS));
+  }
+}
+#endif
+
+void startTasks() {
+  xTaskCreatePinnedToCore(sensingTask, "sensing", 4096, NULL, SENSING_TASK_PRIORITY, NULL, 1);
+  xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, NETWORK_TASK_PRIORITY, NULL, 0);
+#if LCD_DISPLAY
+  xTaskCreatePinnedToCore(lcdTask, "lcd", 2048, NULL, LCD_TASK_PRIORITY, NULL, 1);
+#endif
+#if COMMAND_TRANSPORT == COMMAND_TRANSPORT_MQTT
+  xTaskCreatePinnedToCore(commandTask, "command", 8192, NULL, COMMAND_TASK_PRIORITY, NULL, 0);
+#endif
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  // Safe relay state and sampling come first; nothing before them may block
+  beginRelays();
+  beginCommandPipeline();
+  beginPowerManagement();
+#if !SIMULATED_SENSORS
+  beginSampling();
+  beginDht();
+#endif
+  beginPowerQuality();
+  beginAutomation();
+  beginForecast();
+#if OTA_UPDATES
+  beginOta();
+#endif
+#if LCD_DISPLAY
+  pinMode(CONST_PIN, OUTPUT);
+  analogWrite(CONST_PIN, 80); // Set LCD brightness
+  lcd.begin(16, 2);
+  lcd.clear();
+  lcd.print("System Booting...");
+#endif
+
+  // Configure Firebase. The connection itself is made by connectionStep().
+  config.database_url = FIREBASE_HOST;
+  config.signer.tokens.legacy_token = FIREBASE_AUTH_SECRET;
+  Firebase.reconnectWiFi(false);
+  fbdo.setResponseSize(FIREBASE_RESPONSE_BYTES);
+
+  WiFi.mode(WIFI_STA);
+#if POWER_SAVE
+  WiFi.setSleep(WIFI_POWER_SAVE); // Listen interval WIFI_LISTEN_INTERVAL bounds command latency
+#endif
+  WiFi.setAutoReconnect(false);
+  WiFi.onEvent(onWiFiEvent);
+
+  // The LCD task owns the display from here on, if there is one
+  startTasks();
+  Serial.println("Setup complete. Relays safe, sampling running, connecting in the background.");
+}
+
+void loop() {
+  // All work runs in the tasks started by startTasks(), and the stream for switches
+  // runs in the Firebase library's own task. The Arduino loop task is not needed.
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,1061 @@
+/**
+ * =================================================================================================
+ * SOLARIS - HARDWARE-FREE FIRMWARE CORE
+ * =================================================================================================
+ *
+ * The signal processing, power quality analysis, stream parsing, command decoding and
+ * sequencing, automation rule engine, consumption forecaster and delta patch applier used by
+ * firmware.cpp, with no Arduino or ESP-IDF dependencies, so the same code builds for the ESP32
+ * and natively on a PC. firmware.cpp owns the hardware: it feeds ADC samples in, hands stream
+ * text, command frames, rule tables, closed rollups and firmware patches in, and decides what
+ * to do with the results.
+ * bench/solaris_bench.cpp replays captures and stream events through this file on the host.
+ *
+ * Keep it that way: only standard C/C++ headers here, no globals, no locking.
+ *
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// =======================================================================
+//   POWER ACCUMULATOR
+// =======================================================================
+// One simultaneous voltage/current ADC sample pair at a time is folded into integer
+// accumulators for V^2, I^2 and V*I. When a window is complete, powerWindowResult() turns
+// them into true RMS, real power, apparent power and power factor.
+#define VOLTAGE_MIDPOINT 2048        // Bias of the voltage divider in ADC counts
+#define CURRENT_FRAC_BITS 4          // Centered current is kept as Q4 counts
+#define OFFSET_FRAC_BITS 16          // Current offset is tracked as Q16 counts
+#define OFFSET_EMA_SHIFT 14          // Offset time constant: 2^14 samples (~1.6 s at 10 kHz)
+#define CURRENT_NOISE_FLOOR_A 0.05f  // Below this the ACS712 reading is noise
+
+struct PowerAccumulator {
+  int32_t currentOffsetQ16;
+  int64_t sumV2;
+  int64_t sumI2;
+  int64_t sumVI;
+  uint32_t count;
+};
+
+// ADC counts -> volts at the source, and ADC counts -> amps through the current sensor
+struct PowerScale {
+  float voltsPerCount;
+  float ampsPerCount;
+};
+
+struct PowerWindow {
+  float voltageRMS;
+  float currentRMS;
+  float realPower;
+  float apparentPower;
+  float powerFactor;
+};
+
+inline void powerAccumulatorSetOffset(PowerAccumulator& acc, float offset) {
+  acc.currentOffsetQ16 = (int32_t)(offset * (1 << OFFSET_FRAC_BITS));
+}
+
+inline float powerAccumulatorOffset(const PowerAccumulator& acc) {
+  return acc.currentOffsetQ16 / (float)(1 << OFFSET_FRAC_BITS);
+}
+
+// Drops a partly accumulated window (the offset is kept).
+inline void powerAccumulatorClear(PowerAccumulator& acc) {
+  acc.sumV2 = 0;
+  acc.sumI2 = 0;
+  acc.sumVI = 0;
+  acc.count = 0;
+}
+
+// Adds one sample pair. With trackOffset the current offset follows the input through an
+// EMA, which is only correct while no load draws current. Returns true once `windowSamples`
+// pairs have been accumulated.
+inline bool powerAccumulate(PowerAccumulator& acc, uint16_t rawVoltage, uint16_t rawCurrent,
+                            bool trackOffset, uint32_t windowSamples) {
+  int32_t rawCurrentQ16 = (int32_t)rawCurrent << OFFSET_FRAC_BITS;
+  if (trackOffset) {
+    acc.currentOffsetQ16 += (rawCurrentQ16 - acc.currentOffsetQ16) >> OFFSET_EMA_SHIFT;
+  }
+
+  int32_t v = (int32_t)rawVoltage - VOLTAGE_MIDPOINT;
+  int32_t i = (rawCurrentQ16 - acc.currentOffsetQ16) >> (OFFSET_FRAC_BITS - CURRENT_FRAC_BITS);
+
+  acc.sumV2 += v * v;
+  acc.sumI2 += i * i;
+  acc.sumVI += v * i;
+  return ++acc.count >= windowSamples;
+}
+
+// Turns the accumulated window into readings and clears the sums (the offset is kept).
+inline PowerWindow powerWindowResult(PowerAccumulator& acc, const PowerScale& scale) {
+  const float n = (float)acc.count;
+  const float currentScale = scale.ampsPerCount / (1 << CURRENT_FRAC_BITS);
+
+  PowerWindow w;
+  w.voltageRMS = sqrtf(acc.sumV2 / n) * scale.voltsPerCount;
+  w.currentRMS = sqrtf(acc.sumI2 / n) * currentScale;
+  w.realPower = (acc.sumVI / n) * scale.voltsPerCount * currentScale;
+  if (w.currentRMS < CURRENT_NOISE_FLOOR_A) {
+    w.currentRMS = 0.0;
+    w.realPower = 0.0;
+  }
+  w.apparentPower = w.voltageRMS * w.currentRMS;
+  w.powerFactor = (w.apparentPower > 0.0) ? fabsf(w.realPower) / w.apparentPower : 0.0;
+  if (w.powerFactor > 1.0) w.powerFactor = 1.0;
+
+  powerAccumulatorClear(acc);
+  return w;
+}
+
+// ----- Block kernel -----
+// powerAccumulateBlock() takes a block of pairs at once, held as two contiguous int16 arrays
+// of samples centered on mid-scale, and leaves exactly the sums powerAccumulate() would have.
+// With the offset fixed the centered current is 16 * r + c for one constant c per block, so
+// the block only needs the plain moments of v and r, which a kernel can take in int16 lanes:
+//   sumV2 += S(vv)   sumI2 += 256 S(rr) + 32 c S(r) + n c^2   sumVI += 16 S(vr) + c S(v)
+// While the offset is being tracked every sample moves it, so that case goes pair by pair.
+#define CURRENT_BLOCK_BIAS 2048 // Current samples are stored as raw - CURRENT_BLOCK_BIAS
+#define POWER_BLOCK_MAX 256     // Pairs per kernel call; 256 * 2^22 keeps its int32 sums exact
+
+struct PowerMoments {
+  int32_t sumV;
+  int32_t sumR;
+  int32_t sumVV;
+  int32_t sumRR;
+  int32_t sumVR;
+};
+
+// Takes the moments of n <= POWER_BLOCK_MAX pairs. A target-specific kernel must give the
+// same result; firmware.cpp checks that at boot before it uses one.
+typedef void (*PowerMomentsKernel)(const int16_t* v, const int16_t* r, uint32_t n, PowerMoments& m);
+
+// Plain loop with independent int32 sums, which compilers vectorize where the target can.
+inline void powerMomentsScalar(const int16_t* v, const int16_t* r, uint32_t n, PowerMoments& m) {
+  int32_t sv = 0, sr = 0, svv = 0, srr = 0, svr = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    int32_t a = v[k], b = r[k];
+    sv += a;
+    sr += b;
+    svv += a * a;
+    srr += b * b;
+    svr += a * b;
+  }
+  m.sumV = sv;
+  m.sumR = sr;
+  m.sumVV = svv;
+  m.sumRR = srr;
+  m.sumVR = svr;
+}
+
+// Adds up to n pairs, v[k] = raw voltage - VOLTAGE_MIDPOINT and r[k] = raw current -
+// CURRENT_BLOCK_BIAS. Stops at the end of a window so the caller can close it, and returns
+// the number of pairs taken.
+inline uint32_t powerAccumulateBlock(PowerAccumulator& acc, const int16_t* v, const int16_t* r, uint32_t n,
+                                     bool trackOffset, uint32_t windowSamples,
+                                     PowerMomentsKernel kernel = powerMomentsScalar) {
+  uint32_t room = (acc.count < windowSamples) ? windowSamples - acc.count : 1;
+  if (n > room) n = room;
+
+  if (trackOffset) {
+    for (uint32_t k = 0; k < n; k++) {
+      powerAccumulate(acc, (uint16_t)(v[k] + VOLTAGE_MIDPOINT), (uint16_t)(r[k] + CURRENT_BLOCK_BIAS), true, windowSamples);
+    }
+    return n;
+  }
+
+  // (raw << 16 - offset) >> 12 with raw = r + bias is 16 * r + c, exactly, for this c
+  const int64_t c = ((int32_t)CURRENT_BLOCK_BIAS * (1 << OFFSET_FRAC_BITS) - acc.currentOffsetQ16)
+                    >> (OFFSET_FRAC_BITS - CURRENT_FRAC_BITS);
+  const int64_t scale = 1 << CURRENT_FRAC_BITS;
+  for (uint32_t done = 0; done < n;) {
+    uint32_t chunk = (n - done < POWER_BLOCK_MAX) ? n - done : POWER_BLOCK_MAX;
+    PowerMoments m;
+    kernel(v + done, r + done, chunk, m);
+    acc.sumV2 += m.sumVV;
+    acc.sumI2 += scale * scale * m.sumRR + 2 * scale * c * m.sumR + (int64_t)chunk * c * c;
+    acc.sumVI += scale * m.sumVR + c * m.sumV;
+    done += chunk;
+  }
+  acc.count += n;
+  return n;
+}
+
+// =======================================================================
+//   STREAM PAYLOAD PARSER
+// =======================================================================
+// Single pass, fixed-buffer parsing of /app/switchStates stream events. Nothing here
+// allocates: switch IDs and states are read straight out of the path and payload text.
+#define MAX_SWITCH_ID 31 // Switch IDs are tracked as bits of a uint32_t
+
+// Desired states collected from one payload. Bit n is set in `present` when switch n had
+// a boolean "state", and in `state` when that state was true.
+struct SwitchSnapshot {
+  uint32_t present;
+  uint32_t state;
+};
+
+// Parses a decimal switch ID from `text`, stopping at `end` or the first non-digit.
+// Returns 0 for anything that is not a valid ID.
+inline int parseSwitchId(const char* text, const char** end) {
+  int id = 0;
+  const char* p = text;
+  while (*p >= '0' && *p <= '9') {
+    id = id * 10 + (*p - '0');
+    if (id > MAX_SWITCH_ID) return 0;
+    p++;
+  }
+  if (end) *end = p;
+  return (p == text) ? 0 : id;
+}
+
+// Returns the switch ID for a "/<id>/state" path, or 0 if the path is anything else.
+inline int parseSwitchStatePath(const char* path) {
+  if (*path == '/') path++;
+  const char* rest;
+  int id = parseSwitchId(path, &rest);
+  return (id > 0 && strcmp(rest, "/state") == 0) ? id : 0;
+}
+
+// Returns the switch ID for a "/<id>" path (a whole switch object), or 0.
+inline int parseSwitchObjectPath(const char* path) {
+  if (*path == '/') path++;
+  const char* rest;
+  int id = parseSwitchId(path, &rest);
+  return (id > 0 && *rest == '\0') ? id : 0;
+}
+
+// Reads the unsigned decimal after a key's colon, or 0 if there is none.
+inline uint32_t parseSwitchSeq(const char* p) {
+  uint32_t value = 0;
+  while (*p >= '0' && *p <= '9') value = value * 10 + (uint32_t)(*p++ - '0');
+  return value;
+}
+
+// Shared scanner behind parseSwitchSnapshot() and parseSwitchObject(). With singleId 0 the
+// payload is the whole tree and switch objects sit at depth 2; otherwise the payload is the
+// object of switch `singleId` itself, at depth 1.
+inline bool parseSwitchTree(const char* json, int singleId, SwitchSnapshot& out, uint32_t* seq) {
+  out.present = 0;
+  out.state = 0;
+  if (seq) memset(seq, 0, sizeof(uint32_t) * (MAX_SWITCH_ID + 1));
+
+  const int objectDepth = singleId ? 1 : 2;
+  int depth = 0;
+  uint32_t arrayMask = 0; // Bit d set when the container at depth d is an array
+  bool expectKey = false;
+  int switchId = 0;       // Switch whose object is open at objectDepth, 0 for none
+  char key[8];
+
+  const char* p = json;
+  while (*p) {
+    char c = *p++;
+    if (c == '{' || c == '[') {
+      if (++depth >= 32) return false;
+      if (c == '[') arrayMask |= (1u << depth); else arrayMask &= ~(1u << depth);
+      expectKey = (c == '{');
+      if (singleId && depth == 1 && c == '{') switchId = singleId;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0) return false; // Closes more than was opened
+      if (depth == objectDepth) switchId = 0;
+      depth--;
+      expectKey = false;
+    } else if (c == ',') {
+      expectKey = !(arrayMask & (1u << depth));
+    } else if (c == '"') {
+      size_t n = 0;
+      bool truncated = false;
+      while (*p && *p != '"') {
+        if (*p == '\\' && p[1]) p++;
+        if (n < sizeof(key) - 1) key[n++] = *p; else truncated = true;
+        p++;
+      }
+      if (!*p) return false; // Unterminated string
+      p++;
+      key[n] = '\0';
+      if (!expectKey) continue;
+      expectKey = false;
+
+      if (!singleId && depth == 1) {
+        const char* rest;
+        int id = truncated ? 0 : parseSwitchId(key, &rest);
+        switchId = (id > 0 && *rest == '\0') ? id : 0;
+      } else if (depth == objectDepth && switchId && !truncated) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == ':') p++;
+        if (strcmp(key, "state") == 0) {
+          if (strncmp(p, "true", 4) == 0) {
+            out.present |= (1u << switchId);
+            out.state |= (1u << switchId);
+          } else if (strncmp(p, "false", 5) == 0) {
+            out.present |= (1u << switchId);
+          }
+        } else if (seq && strcmp(key, "seq") == 0) {
+          seq[switchId] = parseSwitchSeq(p);
+        }
+      }
+    }
+  }
+  return depth == 0;
+}
+
+// Scans {"<id>":{"name":"...","state":<bool>,"seq":<n>},...} and records every switch state
+// in `out`, and with `seq` (MAX_SWITCH_ID + 1 entries) each switch's command sequence number,
+// 0 where there is none. Values other than a switch's "state" and "seq" are skipped without
+// being decoded. Returns false if the payload is not a complete JSON object.
+inline bool parseSwitchSnapshot(const char* json, SwitchSnapshot& out, uint32_t* seq = nullptr) {
+  return parseSwitchTree(json, 0, out, seq);
+}
+
+// Same for the payload of a "/<id>" event, i.e. {"state":<bool>,"seq":<n>,...} of one switch.
+inline bool parseSwitchObject(int switchId, const char* json, SwitchSnapshot& out, uint32_t* seq = nullptr) {
+  if (switchId <= 0 || switchId > MAX_SWITCH_ID) return false;
+  return parseSwitchTree(json, switchId, out, seq);
+}
+
+// =======================================================================
+//   COMMAND FRAMES
+// =======================================================================
+// Binary switch command sent over the MQTT command channel, one frame per switch, all
+// fields little-endian. Must match encodeCommandFrame() in src/lib/command-channel.ts.
+//
+//   0  u8   version (COMMAND_FRAME_VERSION)
+//   1  u8   switch ID
+//   2  u8   state as stored in /app/switchStates/<id>/state (1 = true = relay output HIGH)
+//   3  u8   reserved, 0
+//   4  u32  sequence number, assigned by the app per command
+#define COMMAND_FRAME_VERSION 1
+#define COMMAND_FRAME_SIZE 8
+
+struct CommandFrame {
+  uint8_t switchId;
+  bool state;
+  uint32_t seq;
+};
+
+// Returns false for anything that is not a well-formed frame for a valid switch ID.
+inline bool parseCommandFrame(const uint8_t* data, size_t length, CommandFrame& out) {
+  if (length != COMMAND_FRAME_SIZE || data[0] != COMMAND_FRAME_VERSION) return false;
+  if (data[1] == 0 || data[1] > MAX_SWITCH_ID || data[2] > 1) return false;
+  out.switchId = data[1];
+  out.state = data[2] == 1;
+  out.seq = (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+  return true;
+}
+
+// =======================================================================
+//   COMMAND SEQUENCING
+// =======================================================================
+// Every switch command the app issues carries a sequence number from one counter
+// (/app/commandSeq), so a larger number is always a newer command. The sequencer remembers,
+// per switch, the newest number it has accepted and the state it last commanded, and sorts
+// each incoming command before it reaches a relay:
+//
+//   COMMAND_APPLY      newer, or the first command for this switch, and changes its state
+//   COMMAND_UNCHANGED  newer but asks for the state already commanded; nothing to drive
+//   COMMAND_STALE      not newer than the last accepted one: a replay or out-of-order copy
+//
+// Sequence 0 means the command has no number (a bare state write). It is never stale, only
+// compared by value. Numbers are compared with wrap-around, like TCP sequence numbers.
+enum CommandVerdict {
+  COMMAND_APPLY,
+  COMMAND_UNCHANGED,
+  COMMAND_STALE,
+};
+
+struct CommandSequencer {
+  uint32_t lastSeq[MAX_SWITCH_ID + 1];
+  uint32_t commanded; // Bit n: last commanded state of switch n
+  uint32_t known;     // Bit n: switch n has been commanded since boot
+};
+
+inline CommandVerdict commandAccept(CommandSequencer& seqr, int switchId, bool state, uint32_t seq) {
+  uint32_t bit = 1u << switchId;
+  if (seq != 0) {
+    if (seqr.lastSeq[switchId] != 0 && (int32_t)(seq - seqr.lastSeq[switchId]) <= 0) return COMMAND_STALE;
+    seqr.lastSeq[switchId] = seq;
+  }
+  if ((seqr.known & bit) && ((seqr.commanded & bit) != 0) == state) return COMMAND_UNCHANGED;
+  seqr.known |= bit;
+  if (state) seqr.commanded |= bit; else seqr.commanded &= ~bit;
+  return COMMAND_APPLY;
+}
+
+// =======================================================================
+//   AUTOMATION RULES
+// =======================================================================
+// Local rules evaluated against every sensor snapshot, so "shed switch 4 above 1500 W" or
+// "lights on below LDR 800" act without a round trip to the cloud. The app sends the rule
+// table as base64 text (encodeAutomationTable() in src/lib/automation.ts); all fields are
+// little-endian:
+//
+//   table   0  u8   version (AUTOMATION_TABLE_VERSION)
+//           1  u8   rule count, at most AUTOMATION_MAX_RULES
+//           2  ...  rules, AUTOMATION_RULE_SIZE bytes each
+//
+//   rule    0  u8   input (AutomationInput)
+//           1  u8   comparison (AutomationOp)
+//           2  u8   switch ID
+//           3  u8   flags: AUTOMATION_FLAG_STATE is the DB state to command (set = true =
+//                   relay HIGH), AUTOMATION_FLAG_RESTORE commands the opposite on release
+//           4  f32  threshold
+//           8  f32  hysteresis, >= 0: how far back past the threshold releases the rule
+//          12  u16  samples the condition must hold before the rule fires, 0 = 1
+//          14  u16  reserved, 0
+//
+// Rules are edge-triggered: a rule commands its state once when its condition starts to
+// hold and again (with RESTORE) once it is released, so a switch the user changes while a
+// rule is active stays as the user left it. When rules for the same switch fire in the
+// same step, the later one in the table wins.
+#define AUTOMATION_TABLE_VERSION 1
+#define AUTOMATION_MAX_RULES 16
+#define AUTOMATION_RULE_SIZE 16
+#define AUTOMATION_TABLE_MAX_SIZE (2 + AUTOMATION_MAX_RULES * AUTOMATION_RULE_SIZE)
+#define AUTOMATION_FLAG_STATE (1 << 0)
+#define AUTOMATION_FLAG_RESTORE (1 << 1)
+
+enum AutomationInput {
+  AUTOMATION_INPUT_POWER,       // W
+  AUTOMATION_INPUT_LDR,         // ADC counts
+  AUTOMATION_INPUT_TEMPERATURE, // C
+  AUTOMATION_INPUT_COUNT,
+};
+
+enum AutomationOp {
+  AUTOMATION_ABOVE,
+  AUTOMATION_BELOW,
+};
+
+struct AutomationRule {
+  uint8_t input;
+  uint8_t op;
+  uint8_t switchId;
+  uint8_t flags;
+  float threshold;
+  float hysteresis;
+  uint16_t holdSamples;
+};
+
+struct AutomationTable {
+  uint8_t count;
+  AutomationRule rules[AUTOMATION_MAX_RULES];
+};
+
+// Per-rule evaluation state. Bit i of `active` is set while rule i's condition holds.
+struct AutomationState {
+  uint16_t held[AUTOMATION_MAX_RULES];
+  uint32_t active;
+};
+
+// Decodes standard base64 (padding optional) into `out`. Returns the decoded length, or
+// -1 for a character outside the alphabet or output longer than `capacity`.
+inline int base64Decode(const char* text, uint8_t* out, size_t capacity) {
+  uint32_t bits = 0;
+  int bitCount = 0;
+  size_t length = 0;
+  for (const char* p = text; *p && *p != '='; p++) {
+    char c = *p;
+    int value;
+    if (c >= 'A' && c <= 'Z') value = c - 'A';
+    else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+    else if (c >= '0' && c <= '9') value = c - '0' + 52;
+    else if (c == '+') value = 62;
+    else if (c == '/') value = 63;
+    else return -1;
+    bits = (bits << 6) | (uint32_t)value;
+    bitCount += 6;
+    if (bitCount >= 8) {
+      bitCount -= 8;
+      if (length >= capacity) return -1;
+      out[length++] = (uint8_t)(bits >> bitCount);
+    }
+  }
+  return (int)length;
+}
+
+inline float readFloatLE(const uint8_t* p) {
+  uint32_t raw = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  float value;
+  memcpy(&value, &raw, sizeof(value));
+  return value;
+}
+
+// Returns false, leaving `out` empty, unless the whole table is well formed.
+inline bool parseAutomationTable(const uint8_t* data, size_t length, AutomationTable& out) {
+  out.count = 0;
+  if (length < 2 || data[0] != AUTOMATION_TABLE_VERSION || data[1] > AUTOMATION_MAX_RULES) return false;
+  if (length != 2 + (size_t)data[1] * AUTOMATION_RULE_SIZE) return false;
+  for (int i = 0; i < data[1]; i++) {
+    const uint8_t* p = data + 2 + i * AUTOMATION_RULE_SIZE;
+    AutomationRule& rule = out.rules[i];
+    rule.input = p[0];
+    rule.op = p[1];
+    rule.switchId = p[2];
+    rule.flags = p[3];
+    rule.threshold = readFloatLE(p + 4);
+    rule.hysteresis = readFloatLE(p + 8);
+    rule.holdSamples = (uint16_t)(p[12] | (p[13] << 8));
+    if (rule.input >= AUTOMATION_INPUT_COUNT || rule.op > AUTOMATION_BELOW) return false;
+    if (rule.switchId == 0 || rule.switchId > MAX_SWITCH_ID) return false;
+    if (!(rule.threshold == rule.threshold) || !(rule.hysteresis >= 0)) return false; // NaN
+  }
+  out.count = data[1];
+  return true;
+}
+
+// Evaluates every rule against `inputs` (AUTOMATION_INPUT_COUNT values; NAN for an input
+// with no reading, which leaves its rules as they are) and adds the switch commands of
+// rules that fire or are released to `out`. Returns the rules that fired in this step.
+inline uint32_t automationEvaluate(const AutomationTable& table, const float* inputs, AutomationState& state,
+                                   SwitchSnapshot& out) {
+  uint32_t fired = 0;
+  for (int i = 0; i < table.count; i++) {
+    const AutomationRule& rule = table.rules[i];
+    float value = inputs[rule.input];
+    if (!(value == value)) {
+      state.held[i] = 0;
+      continue;
+    }
+    uint32_t bit = 1u << i;
+    uint32_t switchBit = 1u << rule.switchId;
+    bool above = rule.op == AUTOMATION_ABOVE;
+    bool command;
+
+    if (!(state.active & bit)) {
+      bool holds = above ? value > rule.threshold : value < rule.threshold;
+      if (!holds) {
+        state.held[i] = 0;
+        continue;
+      }
+      uint16_t needed = rule.holdSamples ? rule.holdSamples : 1;
+      if (++state.held[i] < needed) continue;
+      state.held[i] = 0;
+      state.active |= bit;
+      fired |= bit;
+      command = rule.flags & AUTOMATION_FLAG_STATE;
+    } else {
+      bool released = above ? value < rule.threshold - rule.hysteresis : value > rule.threshold + rule.hysteresis;
+      if (!released) continue;
+      state.active &= ~bit;
+      if (!(rule.flags & AUTOMATION_FLAG_RESTORE)) continue;
+      command = !(rule.flags & AUTOMATION_FLAG_STATE);
+    }
+    out.present |= switchBit;
+    if (command) out.state |= switchBit; else out.state &= ~switchBit;
+  }
+  return fired;
+}
+
+// =======================================================================
+//   CONSUMPTION FORECASTER
+// =======================================================================
+// Additive Holt-Winters exponential smoothing over fixed-length periods (15-minute rollups on
+// the device): a level, a trend and one seasonal offset per period of the day, with an
+// exponentially weighted variance of the one-step errors for the confidence band. Fixed
+// memory, one update per closed period, no history kept.
+//
+// `slot` is the period of the day a value belongs to (0 .. FORECAST_SEASON_SLOTS - 1), or -1
+// when the time of day is unknown; such updates skip the seasonal part and forecasts made
+// without a slot are level and trend only.
+#define FORECAST_SEASON_SLOTS 96  // 15-minute periods per day
+#define FORECAST_ALPHA 0.05f      // Level smoothing; low, so the season carries the daily shape
+#define FORECAST_BETA 0.01f       // Trend smoothing
+#define FORECAST_GAMMA 0.4f       // Seasonal smoothing; high, as a slot is seen once a day
+#define FORECAST_ERROR_WEIGHT 0.1f
+#define FORECAST_BAND_Z 1.96f     // ~95 % band, assuming normal, independent errors
+
+struct Forecaster {
+  uint32_t updates;
+  float level;
+  float trend;
+  float errorVar;
+  float season[FORECAST_SEASON_SLOTS];
+};
+
+inline float forecasterSeason(const Forecaster& f, int slot) {
+  return slot >= 0 ? f.season[slot % FORECAST_SEASON_SLOTS] : 0.0f;
+}
+
+inline void forecasterUpdate(Forecaster& f, float value, int slot) {
+  if (f.updates == 0) {
+    f.level = value - forecasterSeason(f, slot);
+    f.trend = 0;
+    f.errorVar = 0;
+    f.updates = 1;
+    return;
+  }
+  float season = forecasterSeason(f, slot);
+  float error = value - (f.level + f.trend + season);
+  f.errorVar = (f.updates == 1) ? error * error : f.errorVar + FORECAST_ERROR_WEIGHT * (error * error - f.errorVar);
+
+  float level = FORECAST_ALPHA * (value - season) + (1 - FORECAST_ALPHA) * (f.level + f.trend);
+  f.trend = FORECAST_BETA * (level - f.level) + (1 - FORECAST_BETA) * f.trend;
+  f.level = level;
+  if (slot >= 0) {
+    float& s = f.season[slot % FORECAST_SEASON_SLOTS];
+    s = FORECAST_GAMMA * (value - level) + (1 - FORECAST_GAMMA) * s;
+  }
+  f.updates++;
+}
+
+// Sum of the next `steps` periods, the first of which is `slot` (or -1). Each period is
+// clamped at 0, since consumption cannot be negative.
+inline float forecasterPredict(const Forecaster& f, int slot, int steps) {
+  float total = 0;
+  for (int h = 1; h <= steps; h++) {
+    float value = f.level + h * f.trend + forecasterSeason(f, slot >= 0 ? slot + h - 1 : -1);
+    if (value > 0) total += value;
+  }
+  return total;
+}
+
+// Half-width of the confidence band of forecasterPredict() over `steps` periods.
+inline float forecasterBand(const Forecaster& f, int steps) {
+  return FORECAST_BAND_Z * sqrtf(f.errorVar * steps);
+}
+
+// =======================================================================
+//   POWER QUALITY
+// =======================================================================
+// Frequency, harmonics and THD from a snapshot of a few mains cycles, and sag/swell events
+// from the continuous voltage stream.
+//
+// pqAnalyze() times the rising zero crossings of the voltage, then resamples exactly
+// PQ_CYCLES measured cycles of both channels onto PQ_FFT_SIZE points, so harmonic h falls on
+// bin PQ_CYCLES * h whatever the mains frequency is, with no window and no leakage. Voltage
+// goes in as the real and current as the imaginary part of one fixed-point radix-2 FFT, and
+// the two spectra are separated afterwards. Linear interpolation attenuates a harmonic at f
+// by sinc^2(f / sampleRate), which is divided back out.
+#define PQ_FFT_BITS 10
+#define PQ_FFT_SIZE (1 << PQ_FFT_BITS)
+#define PQ_CYCLES 10                    // Mains cycles per FFT frame; bins are f / PQ_CYCLES apart
+#define PQ_HARMONICS 25                 // Harmonics measured, THD is taken over 2..PQ_HARMONICS
+#define PQ_INPUT_SHIFT 16               // Centered 12-bit samples enter the FFT as Q16
+#define PQ_MIN_FUNDAMENTAL_COUNTS 10.0f // Below this a channel's THD is reported as -1
+
+struct PqTwiddles {
+  int16_t cosQ15[PQ_FFT_SIZE / 2];
+  int16_t sinQ15[PQ_FFT_SIZE / 2];
+};
+
+// FFT buffers and twiddles, kept by the caller (about 10 KB), so nothing here allocates.
+struct PqWorkspace {
+  int32_t re[PQ_FFT_SIZE];
+  int32_t im[PQ_FFT_SIZE];
+  PqTwiddles twiddles;
+};
+
+struct PowerQuality {
+  float frequencyHz;
+  float voltageFundamental;             // RMS of the first harmonic, ADC counts
+  float currentFundamental;
+  float thdVoltage;                     // % of the fundamental, -1 when the channel is idle
+  float thdCurrent;
+  float voltageHarmonics[PQ_HARMONICS]; // Harmonic h at [h - 1], % of the fundamental
+  float currentHarmonics[PQ_HARMONICS];
+};
+
+inline void pqInit(PqWorkspace& ws) {
+  for (int k = 0; k < PQ_FFT_SIZE / 2; k++) {
+    float angle = 6.28318531f * k / PQ_FFT_SIZE;
+    ws.twiddles.cosQ15[k] = (int16_t)lroundf(cosf(angle) * 32767.0f);
+    ws.twiddles.sinQ15[k] = (int16_t)lroundf(sinf(angle) * 32767.0f);
+  }
+}
+
+// In-place decimation-in-time FFT of PQ_FFT_SIZE points. Every stage halves its outputs, so
+// the result is X[k] / PQ_FFT_SIZE and values never grow past the input range.
+inline void pqFft(int32_t* re, int32_t* im, const PqTwiddles& tw) {
+  const uint32_t n = PQ_FFT_SIZE;
+  for (uint32_t i = 1, j = 0; i < n; i++) {
+    uint32_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      int32_t t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  for (uint32_t length = 2; length <= n; length <<= 1) {
+    const uint32_t half = length / 2, stride = n / length;
+    for (uint32_t start = 0; start < n; start += length) {
+      for (uint32_t k = 0; k < half; k++) {
+        const int64_t wr = tw.cosQ15[k * stride], wi = -tw.sinQ15[k * stride]; // e^(-2 pi i k / length)
+        const uint32_t a = start + k, b = a + half;
+        int32_t tr = (int32_t)((re[b] * wr - im[b] * wi) >> 15);
+        int32_t ti = (int32_t)((re[b] * wi + im[b] * wr) >> 15);
+        re[b] = (re[a] - tr) >> 1;
+        im[b] = (im[a] - ti) >> 1;
+        re[a] = (re[a] + tr) >> 1;
+        im[a] = (im[a] + ti) >> 1;
+      }
+    }
+  }
+}
+
+// Rising zero crossings of v around `mean`, at sub-sample precision. A crossing counts once
+// the signal has been below -hysteresis since the last one, so noise at zero is ignored.
+inline int pqZeroCrossings(const uint16_t* v, uint32_t n, float mean, float hysteresis, float* out, int maxOut) {
+  int found = 0;
+  bool armed = false;
+  for (uint32_t k = 1; k < n && found < maxOut; k++) {
+    float a = v[k - 1] - mean, b = v[k] - mean;
+    if (a < -hysteresis) armed = true;
+    if (armed && a < 0 && b >= 0) {
+      out[found++] = (k - 1) + a / (a - b);
+      armed = false;
+    }
+  }
+  return found;
+}
+
+// Analyzes n simultaneous voltage/current samples taken at sampleRate, raw ADC counts. Needs
+// PQ_CYCLES + 1 rising crossings, so at least PQ_CYCLES + 2 cycles to be safe; returns false
+// when the voltage shows fewer (no mains, or too short a snapshot).
+inline bool pqAnalyze(const uint16_t* v, const uint16_t* i, uint32_t n, float sampleRate, PqWorkspace& ws,
+                      PowerQuality& out) {
+  if (n < 3) return false;
+  float mean = 0, low = 4095, high = 0;
+  for (uint32_t k = 0; k < n; k++) {
+    mean += v[k];
+    low = fminf(low, v[k]);
+    high = fmaxf(high, v[k]);
+  }
+  mean /= n;
+  float crossings[PQ_CYCLES + 1];
+  if (pqZeroCrossings(v, n, mean, (high - low) * 0.05f + 1.0f, crossings, PQ_CYCLES + 1) < PQ_CYCLES + 1) return false;
+
+  // Means over the whole cycles, then both channels resampled onto the frame
+  const float start = crossings[0], span = crossings[PQ_CYCLES] - crossings[0];
+  const uint32_t first = (uint32_t)start, last = (uint32_t)crossings[PQ_CYCLES] + 1;
+  float meanV = 0, meanI = 0;
+  for (uint32_t k = first; k <= last; k++) {
+    meanV += v[k];
+    meanI += i[k];
+  }
+  meanV /= (last - first + 1);
+  meanI /= (last - first + 1);
+  const float step = span / PQ_FFT_SIZE, gain = (float)(1 << PQ_INPUT_SHIFT);
+  for (uint32_t k = 0; k < PQ_FFT_SIZE; k++) {
+    float t = start + k * step;
+    uint32_t at = (uint32_t)t;
+    float frac = t - at;
+    ws.re[k] = (int32_t)lroundf((v[at] + frac * (v[at + 1] - v[at]) - meanV) * gain);
+    ws.im[k] = (int32_t)lroundf((i[at] + frac * (i[at + 1] - i[at]) - meanI) * gain);
+  }
+  pqFft(ws.re, ws.im, ws.twiddles);
+
+  // Z = V + jI:  V[m] = (Z[m] + conj Z[N - m]) / 2,  I[m] = (Z[m] - conj Z[N - m]) / 2j
+  out.frequencyHz = PQ_CYCLES * sampleRate / span;
+  float sumV = 0, sumI = 0;
+  for (int h = 1; h <= PQ_HARMONICS; h++) {
+    const uint32_t m = h * PQ_CYCLES, mirror = PQ_FFT_SIZE - m;
+    float vr = 0.5f * (ws.re[m] + ws.re[mirror]), vi = 0.5f * (ws.im[m] - ws.im[mirror]);
+    float ir = 0.5f * (ws.im[m] + ws.im[mirror]), ii = -0.5f * (ws.re[m] - ws.re[mirror]);
+    float x = 3.14159265f * h * out.frequencyHz / sampleRate;
+    float sinc = sinf(x) / x;
+    // |X[m]| / N is half the amplitude: RMS = 2 |X[m]| / N / sqrt(2)
+    float scale = 1.41421356f / (gain * sinc * sinc);
+    float hv = sqrtf(vr * vr + vi * vi) * scale, hi = sqrtf(ir * ir + ii * ii) * scale;
+    out.voltageHarmonics[h - 1] = hv;
+    out.currentHarmonics[h - 1] = hi;
+    if (h > 1) {
+      sumV += hv * hv;
+      sumI += hi * hi;
+    }
+  }
+  out.voltageFundamental = out.voltageHarmonics[0];
+  out.currentFundamental = out.currentHarmonics[0];
+  for (int h = PQ_HARMONICS; h >= 1; h--) {
+    out.voltageHarmonics[h - 1] = out.voltageFundamental > 0 ? 100.0f * out.voltageHarmonics[h - 1] / out.voltageFundamental : 0;
+    out.currentHarmonics[h - 1] = out.currentFundamental > 0 ? 100.0f * out.currentHarmonics[h - 1] / out.currentFundamental : 0;
+  }
+  out.thdVoltage = out.voltageFundamental >= PQ_MIN_FUNDAMENTAL_COUNTS ? 100.0f * sqrtf(sumV) / out.voltageFundamental : -1;
+  out.thdCurrent = out.currentFundamental >= PQ_MIN_FUNDAMENTAL_COUNTS ? 100.0f * sqrtf(sumI) / out.currentFundamental : -1;
+  return true;
+}
+
+// ----- Sag/swell detection -----
+// The RMS over one cycle, refreshed every half cycle as in IEC 61000-4-30, is compared with a
+// sliding reference: an average of the RMS outside events with a time constant of about a
+// minute. That needs no voltage calibration and follows slow drift of the supply. An event
+// starts below PQ_SAG_LIMIT or above PQ_SWELL_LIMIT times the reference and ends once the
+// RMS is PQ_EVENT_HYSTERESIS back inside.
+#define PQ_SAG_LIMIT 0.90f
+#define PQ_SWELL_LIMIT 1.10f
+#define PQ_EVENT_HYSTERESIS 0.02f
+#define PQ_REFERENCE_HALF_CYCLES 6000 // Sliding reference time constant, ~1 min at 50 Hz
+#define PQ_MIN_REFERENCE_COUNTS 50.0f // No events are detected while the reference is this low
+
+enum VoltageEventKind { VOLTAGE_EVENT_NONE, VOLTAGE_EVENT_SAG, VOLTAGE_EVENT_SWELL };
+
+struct VoltageEvent {
+  VoltageEventKind kind;
+  uint32_t halfCycles; // Duration
+  float extreme;       // Lowest (sag) or highest (swell) RMS over the reference
+};
+
+struct VoltageEventDetector {
+  uint32_t halfCycleSamples;
+  uint32_t count;
+  int64_t sum;         // v^2 of the half cycle being collected
+  int64_t previousSum; // and of the one before it
+  bool havePrevious;
+  float reference;     // Sliding reference RMS in counts, 0 until the first cycle
+  VoltageEvent current;
+};
+
+inline void voltageEventInit(VoltageEventDetector& det, uint32_t halfCycleSamples) {
+  memset(&det, 0, sizeof(det));
+  det.halfCycleSamples = halfCycleSamples;
+}
+
+// Drops the partial cycle, for a gap in the samples; the reference and an ongoing event
+// are kept.
+inline void voltageEventRestart(VoltageEventDetector& det) {
+  det.count = 0;
+  det.sum = 0;
+  det.havePrevious = false;
+}
+
+// Adds one voltage sample centered on VOLTAGE_MIDPOINT. Returns true when an event has
+// just ended, with it in `out`.
+inline bool voltageEventUpdate(VoltageEventDetector& det, int32_t v, VoltageEvent& out) {
+  det.sum += v * v;
+  if (++det.count < det.halfCycleSamples) return false;
+  int64_t half = det.sum;
+  det.sum = 0;
+  det.count = 0;
+  if (!det.havePrevious) {
+    det.previousSum = half;
+    det.havePrevious = true;
+    return false;
+  }
+  float rms = sqrtf((half + det.previousSum) / (2.0f * det.halfCycleSamples));
+  det.previousSum = half;
+  if (det.reference <= 0) {
+    det.reference = rms;
+    return false;
+  }
+
+  float ratio = rms / det.reference;
+  VoltageEvent& e = det.current;
+  if (e.kind == VOLTAGE_EVENT_NONE) {
+    if (det.reference >= PQ_MIN_REFERENCE_COUNTS && (ratio < PQ_SAG_LIMIT || ratio > PQ_SWELL_LIMIT)) {
+      e.kind = ratio < PQ_SAG_LIMIT ? VOLTAGE_EVENT_SAG : VOLTAGE_EVENT_SWELL;
+      e.halfCycles = 1;
+      e.extreme = ratio;
+    } else {
+      det.reference += (rms - det.reference) / PQ_REFERENCE_HALF_CYCLES;
+    }
+    return false;
+  }
+
+  e.halfCycles++;
+  bool ended;
+  if (e.kind == VOLTAGE_EVENT_SAG) {
+    e.extreme = fminf(e.extreme, ratio);
+    ended = ratio >= PQ_SAG_LIMIT + PQ_EVENT_HYSTERESIS;
+  } else {
+    e.extreme = fmaxf(e.extreme, ratio);
+    ended = ratio <= PQ_SWELL_LIMIT - PQ_EVENT_HYSTERESIS;
+  }
+  if (!ended) return false;
+  e.halfCycles--; // The half cycle that ended it is back inside the limits
+  out = e;
+  e.kind = VOLTAGE_EVENT_NONE;
+  return true;
+}
+
+// =======================================================================
+//   DELTA PATCHES
+// =======================================================================
+// A firmware update sent as the difference from the image the device is running. The
+// patch is a list of ops that rebuild the new image front to back: COPY takes a run of
+// bytes from the running image, INSERT carries new bytes in the patch. deltaApplyFeed()
+// takes the patch in whatever pieces it arrives in and emits the new image through
+// DeltaIo as it goes, so neither image is ever held in memory: the caller reads the
+// source in place and writes the target straight to flash. Made by createDeltaPatch() in
+// src/lib/ota.ts; all fields little-endian.
+//
+//   header  0  u32    DELTA_PATCH_MAGIC ("SDP1")
+//           4  u32    source size: bytes of the image the patch applies to
+//           8  u8[32] SHA-256 of the source
+//          40  u32    target size, > 0
+//          44  u8[32] SHA-256 of the target
+//          76  ops, until target size bytes have been produced
+//
+//   op      u8 DELTA_OP_COPY, then LEB128 varints: source offset as a zigzag delta from
+//              the end of the previous copy (0 at the start), length > 0
+//           u8 DELTA_OP_INSERT, then a LEB128 length > 0 and that many bytes
+//
+// Neither hash is checked here. The caller compares the source hash when the header is
+// ready, before any target byte is written, and hashes the target bytes as they pass
+// through writeTarget.
+#define DELTA_PATCH_MAGIC 0x31504453u // "SDP1"
+#define DELTA_HEADER_SIZE 76
+#define DELTA_OP_COPY 1
+#define DELTA_OP_INSERT 2
+#define DELTA_COPY_CHUNK 256 // Source bytes moved per readSource/writeTarget pair
+
+enum DeltaStatus {
+  DELTA_MORE,         // Waiting for more patch bytes
+  DELTA_HEADER_READY, // Header parsed, nothing written yet; check it, then feed the rest
+  DELTA_DONE,         // Target complete
+  DELTA_BAD_PATCH,    // Malformed, or an op reaches outside either image
+  DELTA_IO_FAILED,    // readSource or writeTarget returned false
+};
+
+enum DeltaPhase {
+  DELTA_PHASE_HEADER,
+  DELTA_PHASE_OP,
+  DELTA_PHASE_COPY_OFFSET,
+  DELTA_PHASE_COPY_LENGTH,
+  DELTA_PHASE_INSERT_LENGTH,
+  DELTA_PHASE_INSERT_DATA,
+};
+
+struct DeltaPatchHeader {
+  uint32_t sourceSize;
+  uint8_t sourceSha256[32];
+  uint32_t targetSize;
+  uint8_t targetSha256[32];
+};
+
+struct DeltaIo {
+  void* context;
+  bool (*readSource)(void* context, uint32_t offset, uint8_t* out, uint32_t length);
+  bool (*writeTarget)(void* context, const uint8_t* data, uint32_t length);
+};
+
+struct DeltaApplier {
+  DeltaPatchHeader header;
+  DeltaStatus status;
+  DeltaPhase phase;
+  uint8_t headerBytes[DELTA_HEADER_SIZE];
+  uint32_t headerFill;
+  uint64_t varint;       // Varint being decoded
+  uint32_t varintShift;
+  int64_t copyFrom;      // Source offset of the COPY being decoded
+  uint32_t sourceCursor; // End of the previous COPY
+  uint32_t insertLeft;   // INSERT bytes still to come
+  uint32_t written;      // Target bytes produced
+  uint8_t chunk[DELTA_COPY_CHUNK];
+};
+
+inline uint32_t readU32LE(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline void deltaApplyBegin(DeltaApplier& a) {
+  memset(&a, 0, sizeof(a));
+  a.status = DELTA_MORE;
+  a.phase = DELTA_PHASE_HEADER;
+}
+
+// Adds one LEB128 byte. Returns 1 once the number is in a.varint, 0 for more, -1 if it is
+// longer than any offset or length can be.
+inline int deltaVarintByte(DeltaApplier& a, uint8_t byte) {
+  if (a.varintShift > 35) return -1;
+  a.varint |= (uint64_t)(byte & 0x7f) << a.varintShift;
+  a.varintShift += 7;
+  return (byte & 0x80) ? 0 : 1;
+}
+
+inline bool deltaCopy(DeltaApplier& a, uint32_t from, uint32_t length, const DeltaIo& io) {
+  while (length > 0) {
+    uint32_t n = length < DELTA_COPY_CHUNK ? length : DELTA_COPY_CHUNK;
+    if (!io.readSource(io.context, from, a.chunk, n) || !io.writeTarget(io.context, a.chunk, n)) return false;
+    from += n;
+    length -= n;
+    a.written += n;
+  }
+  return true;
+}
+
+inline void deltaOpDone(DeltaApplier& a) {
+  a.phase = DELTA_PHASE_OP;
+  if (a.written == a.header.targetSize) a.status = DELTA_DONE;
+}
+
+// Applies up to `length` patch bytes and returns how many it consumed. That is all of them
+// unless the status has left DELTA_MORE: the header has just been parsed (call again with
+// the rest once you have checked it), the target is complete (bytes left over mean a bad
+// download) or the patch failed. After the last byte anything but DELTA_DONE is a
+// truncated patch.
+inline uint32_t deltaApplyFeed(DeltaApplier& a, const uint8_t* data, uint32_t length, const DeltaIo& io) {
+  if (a.status == DELTA_HEADER_READY) a.status = DELTA_MORE;
+  uint32_t used = 0;
+  while (used < length && a.status == DELTA_MORE) {
+    switch (a.phase) {
+      case DELTA_PHASE_HEADER: {
+        uint32_t n = DELTA_HEADER_SIZE - a.headerFill;
+        if (n > length - used) n = length - used;
+        memcpy(a.headerBytes + a.headerFill, data + used, n);
+        a.headerFill += n;
+        used += n;
+        if (a.headerFill < DELTA_HEADER_SIZE) break;
+        const uint8_t* h = a.headerBytes;
+        a.header.sourceSize = readU32LE(h + 4);
+        memcpy(a.header.sourceSha256, h + 8, 32);
+        a.header.targetSize = readU32LE(h + 40);
+        memcpy(a.header.targetSha256, h + 44, 32);
+        bool valid = readU32LE(h) == DELTA_PATCH_MAGIC && a.header.targetSize > 0;
+        a.phase = DELTA_PHASE_OP;
+        a.status = valid ? DELTA_HEADER_READY : DELTA_BAD_PATCH;
+        break;
+      }
+      case DELTA_PHASE_OP: {
+        uint8_t op = data[used++];
+        if (op == DELTA_OP_COPY) a.phase = DELTA_PHASE_COPY_OFFSET;
+        else if (op == DELTA_OP_INSERT) a.phase = DELTA_PHASE_INSERT_LENGTH;
+        else a.status = DELTA_BAD_PATCH;
+        break;
+      }
+      case DELTA_PHASE_COPY_OFFSET:
+      case DELTA_PHASE_COPY_LENGTH:
+      case DELTA_PHASE_INSERT_LENGTH: {
+        int complete = deltaVarintByte(a, data[used++]);
+        if (complete < 0) a.status = DELTA_BAD_PATCH;
+        if (complete <= 0) break;
+        uint64_t value = a.varint;
+        a.varint = 0;
+        a.varintShift = 0;
+        uint32_t targetLeft = a.header.targetSize - a.written;
+        if (a.phase == DELTA_PHASE_COPY_OFFSET) {
+          int64_t delta = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+          a.copyFrom = (int64_t)a.sourceCursor + delta;
+          a.phase = DELTA_PHASE_COPY_LENGTH;
+        } else if (value == 0 || value > targetLeft) {
+          a.status = DELTA_BAD_PATCH;
+        } else if (a.phase == DELTA_PHASE_INSERT_LENGTH) {
+          a.insertLeft = (uint32_t)value;
+          a.phase = DELTA_PHASE_INSERT_DATA;
+        } else if (a.copyFrom < 0 || a.copyFrom + (int64_t)value > (int64_t)a.header.sourceSize) {
+          a.status = DELTA_BAD_PATCH;
+        } else if (!deltaCopy(a, (uint32_t)a.copyFrom, (uint32_t)value, io)) {
+          a.status = DELTA_IO_FAILED;
+        } else {
+          a.sourceCursor = (uint32_t)(a.copyFrom + (int64_t)value);
+          deltaOpDone(a);
+        }
+        break;
+      }
+      case DELTA_PHASE_INSERT_DATA: {
+        uint32_t n = a.insertLeft < length - used ? a.insertLeft : length - used;
+        if (!io.writeTarget(io.context, data + used, n)) {
+          a.status = DELTA_IO_FAILED;
+          break;
+        }
+        used += n;
+        a.insertLeft -= n;
+        a.written += n;
+        if (a.insertLeft == 0) deltaOpDone(a);
+        break;
+      }
+    }
+  }
+  return used;
+}
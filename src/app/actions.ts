@@ -8,6 +8,9 @@ import { getDatabase, ref, get, child, set, serverTimestamp, push } from 'fireba
 import { initializeApp, getApps, getApp } from 'firebase/app';
 import { firebaseConfig } from '../firebase/config';
 import { randomUUID } from 'crypto';
+import { nextCommandSeq, publishSwitchCommand } from '../lib/command-channel';
+import { encodeAutomationTable, AutomationRule } from '../lib/automation';
+import { OtaRelease, rolloutStage } from '../lib/ota';
 
 // Server-side specific initialization
 function initializeFirebaseOnServer() {
@@ -119,18 +122,29 @@ export async function updateSwitchState(switchId: number, name: string, state: b
     // UI "ON" (true) becomes `false` in DB. UI "OFF" (false) becomes `true` in DB.
     const dbState = !state;
 
-    // Use PUT to directly set the boolean value at the 'state' path.
-    const path = `app/switchStates/${switchId}/state.json?auth=${secret}`;
+    // Every command is numbered, so the device can drop replays and out-of-order copies,
+    // and stamped with the server time it was issued at. The device acknowledges under
+    // app/switchAcks/<id> with the same seq and the time it drove the relay.
+    const seq = await nextCommandSeq(databaseUrl, secret);
+    const path = `app/switchStates/${switchId}.json?auth=${secret}`;
     const url = `${databaseUrl}/${path}`;
 
-    const response = await fetch(url, {
-      method: 'PUT',
-      headers: {
-        'Content-Type': 'application/json',
-      },
-      // Send the inverted boolean value directly.
-      body: JSON.stringify(dbState),
-    });
+    // The database stays the source of truth; when a command broker is configured the
+    // change is also pushed to the device over MQTT, in parallel with the write. A failed
+    // publish only costs latency, as the device still gets the command from the stream.
+    const [response] = await Promise.all([
+      fetch(url, {
+        method: 'PATCH',
+        headers: {
+          'Content-Type': 'application/json',
+        },
+        // The inverted boolean, with the command's number and issue time.
+        body: JSON.stringify({ state: dbState, seq, issuedAt: { '.sv': 'timestamp' } }),
+      }),
+      publishSwitchCommand(switchId, dbState, seq).catch(error => {
+        console.warn(`Could not publish the command for switch ${switchId} to the broker:`, error);
+      }),
+    ]);
 
     if (!response.ok) {
       const errorData = await response.json();
@@ -157,6 +171,106 @@ export async function getSwitchStates() {
   }
 }
 
+// Replaces the device's local automation rules. The device picks the table up within its
+// poll interval and keeps running it offline; `rules` is stored next to it for display.
+export async function updateAutomationRules(rules: AutomationRule[]) {
+  try {
+    const databaseUrl = firebaseConfig.databaseURL;
+    const secret = process.env.FIREBASE_DATABASE_SECRET;
+    if (!secret) {
+      throw new Error('Server configuration error: Missing database secret.');
+    }
+
+    const table = encodeAutomationTable(rules);
+    const response = await fetch(`${databaseUrl}/app/automation.json?auth=${secret}`, {
+      method: 'PATCH',
+      headers: { 'Content-Type': 'application/json' },
+      body: JSON.stringify({ table, rules, updatedAt: { '.sv': 'timestamp' } }),
+    });
+
+    if (!response.ok) {
+      const errorData = await response.json();
+      throw new Error(errorData.error || 'Failed to update automation rules.');
+    }
+    return { success: true };
+  } catch (error: any) {
+    console.error('Error updating automation rules:', error);
+    return { success: false, error: error.message || 'Failed to update automation rules.' };
+  }
+}
+
+// Stages a firmware release built with buildOtaRelease(). It changes nothing in the field
+// until stageOtaRollout() sets the rollout flags of some devices.
+export async function publishOtaRelease(release: OtaRelease) {
+  try {
+    const databaseUrl = firebaseConfig.databaseURL;
+    const secret = process.env.FIREBASE_DATABASE_SECRET;
+    if (!secret) {
+      throw new Error('Server configuration error: Missing database secret.');
+    }
+
+    const response = await fetch(`${databaseUrl}/app/ota/release.json?auth=${secret}`, {
+      method: 'PUT',
+      headers: { 'Content-Type': 'application/json' },
+      body: JSON.stringify({ ...release, publishedAt: { '.sv': 'timestamp' } }),
+    });
+
+    if (!response.ok) {
+      const errorData = await response.json();
+      throw new Error(errorData.error || 'Failed to publish the firmware release.');
+    }
+    return { success: true };
+  } catch (error: any) {
+    console.error('Error publishing firmware release:', error);
+    return { success: false, error: error.message || 'Failed to publish the firmware release.' };
+  }
+}
+
+// Offers the staged release to `percent` of the devices that have reported under
+// /app/ota/devices and withdraws it from the rest. Raising the percentage keeps every
+// device already chosen (see rolloutStage()); 0 stops the rollout. A device that has
+// started its download finishes it.
+export async function stageOtaRollout(percent: number) {
+  try {
+    const databaseUrl = firebaseConfig.databaseURL;
+    const secret = process.env.FIREBASE_DATABASE_SECRET;
+    if (!secret) {
+      throw new Error('Server configuration error: Missing database secret.');
+    }
+
+    const [versionResponse, devicesResponse] = await Promise.all([
+      fetch(`${databaseUrl}/app/ota/release/version.json?auth=${secret}`),
+      fetch(`${databaseUrl}/app/ota/devices.json?shallow=true&auth=${secret}`),
+    ]);
+    const version = await versionResponse.json();
+    const devices = await devicesResponse.json();
+    if (!versionResponse.ok || !devicesResponse.ok) {
+      throw new Error(version?.error || devices?.error || 'Failed to read the fleet.');
+    }
+    if (typeof version !== 'string') {
+      throw new Error('No firmware release is staged.');
+    }
+
+    const deviceIds = Object.keys(devices ?? {});
+    const selected = new Set(rolloutStage(deviceIds, version, percent));
+    const flags = Object.fromEntries(deviceIds.map(id => [id, selected.has(id)]));
+    const response = await fetch(`${databaseUrl}/app/ota/rollout.json?auth=${secret}`, {
+      method: 'PUT',
+      headers: { 'Content-Type': 'application/json' },
+      body: JSON.stringify(flags),
+    });
+
+    if (!response.ok) {
+      const errorData = await response.json();
+      throw new Error(errorData.error || 'Failed to update the rollout.');
+    }
+    return { success: true, data: { version, devices: deviceIds.length, selected: selected.size } };
+  } catch (error: any) {
+    console.error('Error staging firmware rollout:', error);
+    return { success: false, error: error.message || 'Failed to update the rollout.' };
+  }
+}
+
 export async function simulateBatteryLevel(level: number) {
   try {
     const databaseUrl = firebaseConfig.databaseURL;
@@ -1,8 +1,9 @@
 
 import { NextResponse, type NextRequest } from 'next/server';
 import { initializeApp, getApp, getApps } from 'firebase/app';
-import { getDatabase, ref, get, child } from 'firebase/database';
+import { getDatabase, ref, get, onValue } from 'firebase/database';
 import { firebaseConfig } from '../../../firebase/config';
+import { isTelemetryBatch, decodeTelemetryBatch, decodeTelemetryRecord, createPushId } from '../../../lib/telemetry';
 
 // Server-side specific initialization for API routes
 function initializeFirebaseOnServer() {
@@ -12,22 +13,56 @@ function initializeFirebaseOnServer() {
   return initializeApp(firebaseConfig, 'api-route');
 }
 
+// Module state (the key cache and its listener) lives as long as the server process, so
+// this route must run on the Node.js runtime. Node's fetch also keeps a keep-alive
+// connection pool per origin, so the RTDB REST writes below reuse warm TLS connections.
+export const runtime = 'nodejs';
+
 const serverApp = initializeFirebaseOnServer();
 const database = getDatabase(serverApp);
 
+// The device API key is read once and then kept current by an RTDB listener, so an
+// ingest costs a single outbound round trip (the write) instead of a read plus a write.
+let cachedApiKey: string | null = null;
+let apiKeyLoaded: Promise<void> | null = null;
+
+function loadApiKey(): Promise<void> {
+  if (!apiKeyLoaded) {
+    apiKeyLoaded = new Promise(resolve => {
+      onValue(
+        ref(database, 'app/apiKey'),
+        snapshot => {
+          cachedApiKey = snapshot.exists() ? snapshot.val() : null;
+          resolve();
+        },
+        error => {
+          // Listener was cancelled (e.g. rules changed): fall back to a one-off read and
+          // start a new listener on the next request.
+          console.error('API key listener cancelled:', error);
+          apiKeyLoaded = null;
+          get(ref(database, 'app/apiKey'))
+            .then(snapshot => { cachedApiKey = snapshot.exists() ? snapshot.val() : null; })
+            .catch(() => { cachedApiKey = null; })
+            .finally(resolve);
+        }
+      );
+    });
+  }
+  return apiKeyLoaded;
+}
+
 export async function POST(request: NextRequest) {
   try {
     const apiKey = request.headers.get('Device-API-Key');
-    const body = await request.json();
-
-    const dbRef = ref(database);
-    const snapshot = await get(child(dbRef, 'app/apiKey'));
-    const expectedApiKey = snapshot.exists() ? snapshot.val() : null;
+    await loadApiKey();
 
-    if (!apiKey || apiKey !== expectedApiKey) {
+    if (!apiKey || apiKey !== cachedApiKey) {
       return NextResponse.json({ success: false, error: 'Device API Key is invalid or missing.' }, { status: 401 });
     }
 
+    const isBinary = (request.headers.get('Content-Type') || '').startsWith('application/octet-stream');
+    const body = isBinary ? await request.arrayBuffer() : await request.json();
+
     if (!body || typeof body !== 'object') {
         return NextResponse.json({ success: false, error: 'Invalid request body.' }, { status: 400 });
     }
@@ -42,15 +77,57 @@ export async function POST(request: NextRequest) {
     const path = `app/energyData.json?auth=${secret}`;
     const url = `${databaseUrl}/${path}`;
 
+    // Batched uplink: fan the readings out into individual energyData entries with a
+    // single multi-path update.
+    if (!(body instanceof ArrayBuffer) && isTelemetryBatch(body)) {
+      let entries;
+      try {
+        entries = decodeTelemetryBatch(body, Date.now());
+      } catch (error: any) {
+        return NextResponse.json({ success: false, error: error.message }, { status: 400 });
+      }
+
+      const updates: Record<string, unknown> = {};
+      for (const entry of entries) {
+        updates[createPushId(Date.parse(entry.timestamp as string))] = entry;
+      }
+
+      const batchResponse = await fetch(url, {
+        method: 'PATCH',
+        headers: {
+          'Content-Type': 'application/json',
+        },
+        body: JSON.stringify(updates),
+      });
+
+      if (!batchResponse.ok) {
+        const errorData = await batchResponse.json();
+        throw new Error(errorData.error || 'Failed to write energy data batch to database.');
+      }
+
+      return NextResponse.json({ success: true, message: `Batch of ${entries.length} readings received successfully.` });
+    }
+
+    let entry;
+    if (body instanceof ArrayBuffer) {
+      try {
+        entry = decodeTelemetryRecord(body, Date.now());
+      } catch (error: any) {
+        return NextResponse.json({ success: false, error: error.message }, { status: 400 });
+      }
+    } else {
+      entry = {
+        ...body,
+        timestamp: new Date().toISOString(),
+      };
+    }
+
     const response = await fetch(url, {
       method: 'POST', // POST to push a new entry with a unique ID
       headers: {
         'Content-Type': 'application/json',
       },
-      body: JSON.stringify({
-        ...body,
-        timestamp: new Date().toISOString(),
-      }),
+      body: JSON.stringify(entry),
     });
 
     if (!response.ok) {
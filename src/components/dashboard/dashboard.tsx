@@ -5,7 +5,7 @@ import React, { useState, useEffect, useCallback, useRef } from 'react';
 import { useToast } from '../../hooks/use-toast';
 import { runEnergyPrediction, runIntelligentSwitchControl, updateSwitchState, getSwitchStates } from '../../app/actions';
 import { INITIAL_ENERGY_DATA, INITIAL_SWITCHES } from '../../lib/data';
-import type { EnergyData, SwitchState } from '../../lib/types';
+import type { DeviceForecast, EnergyData, SwitchAck, SwitchState } from '../../lib/types';
 import { EnergyMetrics } from './energy-metrics';
 import { SwitchControl } from './switch-control';
 import { UsageHistory } from './usage-history';
@@ -19,6 +19,7 @@ export function Dashboard() {
   const [switches, setSwitches] = useState<SwitchState[]>(INITIAL_SWITCHES);
   const [userPreferences, setUserPreferences] = useState('Prioritize extending battery life and reducing cost. Only turn on essential appliances if battery is below 40%.');
   const [prediction, setPrediction] = useState<PredictEnergyConsumptionOutput | null>(null);
+  const [deviceForecast, setDeviceForecast] = useState<DeviceForecast | null>(null);
   const [isPredictionLoading, setIsPredictionLoading] = useState(false);
   const [isOptimizing, setIsOptimizing] = useState(false);
   const [aiReasoning, setAiReasoning] = useState('');
@@ -26,6 +27,11 @@ export function Dashboard() {
   const database = useDatabase();
 
   const previousBatteryLevel = useRef<number | null>(null);
+  // Latest command per switch (seq and server issue time) and the device's acknowledgement
+  // of it; together they give the end-to-end toggle latency shown on each switch.
+  const commandIssues = useRef<Record<number, { seq: number; issuedAt: number }>>({});
+  const commandAcks = useRef<Record<number, SwitchAck>>({});
+  const [toggleLatencyMs, setToggleLatencyMs] = useState<Record<number, number>>({});
 
   useEffect(() => {
     previousBatteryLevel.current = energyData.batteryLevel;
@@ -38,8 +44,8 @@ export function Dashboard() {
     if (result.success && result.data) {
       setPrediction(result.data);
       toast({
-        title: "Prediction Ready",
-        description: "Future energy consumption has been forecasted.",
+        title: "Analysis Ready",
+        description: "Usage patterns and analysis have been updated.",
       });
     } else {
       toast({
@@ -116,12 +122,22 @@ export function Dashboard() {
 
   }, [prediction, userPreferences, handlePrediction, toast, updateAllSwitches]);
 
-  useEffect(() => {
-    handlePrediction(); // Initial prediction on load
-  }, [handlePrediction]);
-
   const energyDataQuery = useMemoFirebase(() => database ? query(ref(database, 'app/energyData'), orderByChild('timestamp'), limitToLast(1)) : null, [database]);
   const switchStatesRef = useMemoFirebase(() => database ? ref(database, 'app/switchStates') : null, [database]);
+  const switchAcksRef = useMemoFirebase(() => database ? ref(database, 'app/switchAcks') : null, [database]);
+
+  // Issue-to-relay latency of every switch whose latest command has been acknowledged.
+  // appliedAt is the device's clock and issuedAt the server's, both SNTP/NTP synced.
+  const updateToggleLatency = useCallback(() => {
+    const latencies: Record<number, number> = {};
+    for (const [id, issue] of Object.entries(commandIssues.current)) {
+      const ack = commandAcks.current[Number(id)];
+      if (ack && ack.seq === issue.seq && typeof ack.appliedAt === 'number') {
+        latencies[Number(id)] = Math.max(0, ack.appliedAt - issue.issuedAt);
+      }
+    }
+    setToggleLatencyMs(latencies);
+  }, []);
 
   useEffect(() => {
     if (!energyDataQuery) return;
@@ -138,7 +154,8 @@ export function Dashboard() {
                 voltage: latestData.voltage ?? INITIAL_ENERGY_DATA.voltage,
                 current: latestData.current ?? INITIAL_ENERGY_DATA.current,
                 batteryLevel: latestData.batteryLevel ?? INITIAL_ENERGY_DATA.batteryLevel,
-                power: (latestData.voltage && latestData.current) ? latestData.voltage * latestData.current : INITIAL_ENERGY_DATA.power,
+                // Firmware with the streaming power meter reports real power; older firmware only sends V and I.
+                power: latestData.power ?? ((latestData.voltage && latestData.current) ? latestData.voltage * latestData.current : INITIAL_ENERGY_DATA.power),
                 temperature: latestData.temperature ?? INITIAL_ENERGY_DATA.temperature,
                 humidity: latestData.humidity ?? INITIAL_ENERGY_DATA.humidity,
                 totalConsumption: latestData.totalConsumption ?? INITIAL_ENERGY_DATA.totalConsumption,
@@ -146,6 +163,14 @@ export function Dashboard() {
             };
 
             setEnergyData(newEnergyData);
+
+            // The device sends forecastWh -1 until its model has warmed up
+            if (typeof latestData.forecastWh === 'number' && latestData.forecastWh >= 0) {
+              setDeviceForecast({
+                nextHourKwh: latestData.forecastWh / 1000,
+                bandKwh: (latestData.forecastBandWh ?? 0) / 1000,
+              });
+            }
             
             if (prevBatteryLevel !== null && newBatteryLevel < 40 && prevBatteryLevel >= 40) {
                 handleOptimization(newEnergyData, true);
@@ -161,6 +186,13 @@ export function Dashboard() {
     const unsubscribe = onValue(switchStatesRef, (snapshot) => {
       const data = snapshot.val();
       if (data) {
+        Object.entries(data).forEach(([id, s]: [string, any]) => {
+          if (typeof s?.seq === 'number' && typeof s?.issuedAt === 'number') {
+            commandIssues.current[parseInt(id, 10)] = { seq: s.seq, issuedAt: s.issuedAt };
+          }
+        });
+        updateToggleLatency();
+
         setSwitches(prevSwitches => {
           const updatedSwitches = [...prevSwitches];
           let hasChanged = false;
@@ -190,7 +222,16 @@ export function Dashboard() {
       }
     });
     return () => unsubscribe();
-  }, [switchStatesRef]);
+  }, [switchStatesRef, updateToggleLatency]);
+
+  useEffect(() => {
+    if (!switchAcksRef) return;
+    const unsubscribe = onValue(switchAcksRef, (snapshot) => {
+      commandAcks.current = snapshot.val() || {};
+      updateToggleLatency();
+    });
+    return () => unsubscribe();
+  }, [switchAcksRef, updateToggleLatency]);
 
   const handleSwitchChange = async (id: number, checked: boolean) => {
     const targetSwitch = switches.find(s => s.id === id);
@@ -216,6 +257,7 @@ export function Dashboard() {
         <EnergyMetrics energyData={energyData} />
         <SwitchControl
           switches={switches}
+          toggleLatencyMs={toggleLatencyMs}
           userPreferences={userPreferences}
           aiReasoning={aiReasoning}
           isOptimizing={isOptimizing}
@@ -229,6 +271,7 @@ export function Dashboard() {
       <div className="lg:col-span-4 xl:col-span-3 space-y-6">
          <PredictionAnalytics
           prediction={prediction}
+          deviceForecast={deviceForecast}
           isLoading={isPredictionLoading}
           onPredict={handlePrediction}
         />
@@ -1,4 +1,5 @@
 import type { PredictEnergyConsumptionOutput } from '../../ai/flows/predict-energy-consumption';
+import type { DeviceForecast } from '../../lib/types';
 import { Card, CardContent, CardHeader, CardTitle, CardDescription } from '../ui/card';
 import { Button } from '../ui/button';
 import { Loader2, Zap, BrainCircuit, Sparkles } from 'lucide-react';
@@ -6,11 +7,18 @@ import { Separator } from '../ui/separator';
 
 type PredictionAnalyticsProps = {
   prediction: PredictEnergyConsumptionOutput | null;
+  deviceForecast: DeviceForecast | null; // Refreshed with every reading; preferred for the numbers
   isLoading: boolean;
   onPredict: () => void;
 };
 
-export function PredictionAnalytics({ prediction, isLoading, onPredict }: PredictionAnalyticsProps) {
+export function PredictionAnalytics({ prediction, deviceForecast, isLoading, onPredict }: PredictionAnalyticsProps) {
+  const consumption = deviceForecast
+    ? { value: deviceForecast.nextHourKwh, band: deviceForecast.bandKwh, label: 'Predicted Consumption (next hour, on-device)' }
+    : prediction
+      ? { value: prediction.predictedConsumption, band: prediction.confidenceInterval, label: 'Predicted Consumption' }
+      : null;
+
   return (
     <Card className="shadow-lg bg-card/50 backdrop-blur-sm">
       <CardHeader className="pb-4">
@@ -23,32 +31,40 @@ export function PredictionAnalytics({ prediction, isLoading, onPredict }: Predic
       <CardContent className="space-y-4">
          <Button onClick={onPredict} disabled={isLoading} className="w-full">
           {isLoading ? <Loader2 className="mr-2 h-4 w-4 animate-spin" /> : <BrainCircuit className="mr-2 h-4 w-4" />}
-          {isLoading ? 'Forecasting...' : 'Run New Forecast'}
+          {isLoading ? 'Analyzing...' : 'Run AI Analysis'}
         </Button>
         <Separator />
-        {prediction ? (
+        {consumption || prediction ? (
           <div className="space-y-4 text-sm animate-in fade-in-0">
-            <div>
-              <p className="font-semibold text-muted-foreground">Predicted Consumption</p>
-              <p className="text-2xl font-bold text-primary">{prediction.predictedConsumption.toFixed(2)} kWh</p>
-            </div>
-            <div>
-              <p className="font-semibold text-muted-foreground">Confidence Interval</p>
-              <p className="text-foreground/80">&plusmn;{prediction.confidenceInterval.toFixed(2)} kWh</p>
-            </div>
-             <div>
-              <p className="font-semibold text-muted-foreground">User Usage Patterns</p>
-              <p className="text-foreground/80 italic">"{prediction.userUsagePatterns}"</p>
-            </div>
-            <div>
-              <p className="font-semibold text-muted-foreground">AI Analysis</p>
-              <p className="text-foreground/80 italic">"{prediction.analysis}"</p>
-            </div>
+            {consumption && (
+              <>
+                <div>
+                  <p className="font-semibold text-muted-foreground">{consumption.label}</p>
+                  <p className="text-2xl font-bold text-primary">{consumption.value.toFixed(2)} kWh</p>
+                </div>
+                <div>
+                  <p className="font-semibold text-muted-foreground">Confidence Interval</p>
+                  <p className="text-foreground/80">&plusmn;{consumption.band.toFixed(2)} kWh</p>
+                </div>
+              </>
+            )}
+            {prediction && (
+              <>
+                <div>
+                  <p className="font-semibold text-muted-foreground">User Usage Patterns</p>
+                  <p className="text-foreground/80 italic">"{prediction.userUsagePatterns}"</p>
+                </div>
+                <div>
+                  <p className="font-semibold text-muted-foreground">AI Analysis</p>
+                  <p className="text-foreground/80 italic">"{prediction.analysis}"</p>
+                </div>
+              </>
+            )}
           </div>
         ) : (
           <div className="text-center text-muted-foreground py-8">
              <Zap className="mx-auto h-12 w-12 text-gray-500" />
-            <p className="mt-4">Run a forecast to see energy predictions.</p>
+            <p className="mt-4">The device forecast appears after its first hour of readings. Run an AI analysis for usage patterns.</p>
           </div>
         )}
       </CardContent>
@@ -17,6 +17,7 @@ const switchIcons: { [key: string]: React.ReactNode } = {
 
 type SwitchControlProps = {
   switches: SwitchState[];
+  toggleLatencyMs: Record<number, number>; // Per switch, once the device has acknowledged
   userPreferences: string;
   aiReasoning: string;
   isOptimizing: boolean;
@@ -28,6 +29,7 @@ type SwitchControlProps = {
 
 export function SwitchControl({
   switches,
+  toggleLatencyMs,
   userPreferences,
   aiReasoning,
   isOptimizing,
@@ -48,7 +50,12 @@ export function SwitchControl({
             <div key={s.id} className="flex items-center justify-between p-4 border rounded-lg bg-background/50 hover:bg-muted/50 transition-colors">
               <div className="flex items-center space-x-3">
                 <div className="text-primary">{switchIcons[s.name] || <ToggleRight className="h-5 w-5" />}</div>
-                <label htmlFor={`switch-${s.id}`} className="text-sm font-medium">{s.name}</label>
+                <div>
+                  <label htmlFor={`switch-${s.id}`} className="text-sm font-medium">{s.name}</label>
+                  {toggleLatencyMs[s.id] !== undefined && (
+                    <p className="text-xs text-muted-foreground">Applied in {toggleLatencyMs[s.id]} ms</p>
+                  )}
+                </div>
               </div>
               <Switch
                 id={`switch-${s.id}`}
@@ -0,0 +1,96 @@
+/**
+ * Local automation rules run by the ESP32 firmware (LOCAL AUTOMATION in docs/firmware.cpp).
+ *
+ * Rules are evaluated on the device against every sensor reading, so they act without a
+ * round trip through the cloud and keep working offline. The app only sends the rule table,
+ * encoded by encodeAutomationTable() as base64 at /app/automation/table, and reads back a
+ * summary the device writes to /app/automation/status.
+ *
+ * A rule is edge-triggered: it switches once when its condition starts to hold and, with
+ * `restore`, switches back once the input has moved `hysteresis` past the threshold again.
+ */
+
+export const AUTOMATION_TABLE_VERSION = 1;
+export const AUTOMATION_MAX_RULES = 16;
+export const AUTOMATION_RULE_SIZE = 16;
+
+const AUTOMATION_FLAG_STATE = 1 << 0;
+const AUTOMATION_FLAG_RESTORE = 1 << 1;
+
+// Order matches AutomationInput in docs/solaris_core.h
+export const AUTOMATION_INPUTS = ['power', 'ldr', 'temperature'] as const;
+export type AutomationInput = typeof AUTOMATION_INPUTS[number];
+
+export type AutomationRule = {
+  input: AutomationInput; // power in W, ldr in ADC counts, temperature in C
+  op: 'above' | 'below';
+  threshold: number;
+  hysteresis?: number;    // Default 0
+  holdSamples?: number;   // Consecutive readings the condition must hold, default 1
+  switchId: number;
+  turnOn: boolean;        // What the rule does to the switch, in UI terms
+  restore?: boolean;      // Switch back when the rule is released
+};
+
+export type AutomationStatus = {
+  rules: number;
+  active: number;                      // Bit i set while rule i holds
+  fired?: Record<string, number>;      // Per rule index
+  lastFiredAt?: Record<string, number>; // Unix ms, per rule index
+  updatedAt?: number;
+};
+
+/**
+ * Table layout, all fields little-endian. Must match the AUTOMATION RULES section of
+ * docs/solaris_core.h.
+ *
+ *   table   0  u8   version (AUTOMATION_TABLE_VERSION)
+ *           1  u8   rule count
+ *           2  ...  rules, AUTOMATION_RULE_SIZE bytes each
+ *
+ *   rule    0  u8   input (index into AUTOMATION_INPUTS)
+ *           1  u8   comparison, 0 above, 1 below
+ *           2  u8   switch ID
+ *           3  u8   flags: bit 0 DB state to command, bit 1 restore on release
+ *           4  f32  threshold
+ *           8  f32  hysteresis
+ *          12  u16  hold samples
+ *          14  u16  reserved
+ */
+export function encodeAutomationTable(rules: AutomationRule[]): string {
+  if (rules.length > AUTOMATION_MAX_RULES) {
+    throw new Error(`At most ${AUTOMATION_MAX_RULES} automation rules fit on the device.`);
+  }
+  const bytes = new Uint8Array(2 + rules.length * AUTOMATION_RULE_SIZE);
+  const view = new DataView(bytes.buffer);
+  view.setUint8(0, AUTOMATION_TABLE_VERSION);
+  view.setUint8(1, rules.length);
+
+  rules.forEach((rule, i) => {
+    const input = AUTOMATION_INPUTS.indexOf(rule.input);
+    const hysteresis = rule.hysteresis ?? 0;
+    const holdSamples = rule.holdSamples ?? 1;
+    if (input < 0) throw new Error(`Rule ${i + 1}: unknown input ${rule.input}.`);
+    if (!Number.isInteger(rule.switchId) || rule.switchId < 1 || rule.switchId > 31) {
+      throw new Error(`Rule ${i + 1}: switch ID ${rule.switchId} is out of range.`);
+    }
+    if (!Number.isFinite(rule.threshold) || !Number.isFinite(hysteresis) || hysteresis < 0) {
+      throw new Error(`Rule ${i + 1}: threshold and hysteresis must be numbers, hysteresis >= 0.`);
+    }
+    if (!Number.isInteger(holdSamples) || holdSamples < 1 || holdSamples > 0xffff) {
+      throw new Error(`Rule ${i + 1}: holdSamples must be between 1 and 65535.`);
+    }
+
+    // INVERTED FOR NORMALLY CLOSED RELAYS: UI "ON" is DB state false
+    const dbState = !rule.turnOn;
+    const offset = 2 + i * AUTOMATION_RULE_SIZE;
+    view.setUint8(offset, input);
+    view.setUint8(offset + 1, rule.op === 'below' ? 1 : 0);
+    view.setUint8(offset + 2, rule.switchId);
+    view.setUint8(offset + 3, (dbState ? AUTOMATION_FLAG_STATE : 0) | (rule.restore ? AUTOMATION_FLAG_RESTORE : 0));
+    view.setFloat32(offset + 4, rule.threshold, true);
+    view.setFloat32(offset + 8, hysteresis, true);
+    view.setUint16(offset + 12, holdSamples, true);
+  });
+  return Buffer.from(bytes).toString('base64');
+}
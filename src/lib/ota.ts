@@ -0,0 +1,219 @@
+import { createHash } from 'crypto';
+
+/**
+ * Over-the-air firmware releases for the ESP32 firmware (OTA UPDATES in docs/firmware.cpp).
+ *
+ * A release is staged at /app/ota/release and reaches only the devices whose flag under
+ * /app/ota/rollout/<deviceId> is true, so an update can go to a few sites first and to the
+ * rest of the fleet once those have confirmed it. Each device reports its state to
+ * /app/ota/devices/<deviceId>; the device ID is its station MAC as 12 hex digits.
+ *
+ * Devices download a patch against the image they are running when the release has one
+ * (createDeltaPatch(), keyed by sourceKey() of that image), otherwise the full image at
+ * `imageUrl`. Patches and images are served from any HTTPS URL, e.g. Firebase Storage.
+ */
+
+export const DELTA_PATCH_MAGIC = 0x31504453; // "SDP1"
+export const DELTA_HEADER_SIZE = 76;
+const DELTA_OP_COPY = 1;
+const DELTA_OP_INSERT = 2;
+
+// Matcher tuning; the device does not depend on these
+const MATCH_BLOCK = 16;  // Bytes hashed to find where a run of the target came from
+const MIN_COPY = 24;     // Shorter matches cost more as a COPY than as INSERT bytes
+const HASH_BITS = 20;
+const MAX_CHAIN = 32;    // Candidates tried per position
+
+export type OtaRelease = {
+  version: string;
+  targetSha256: string;            // Hex SHA-256 of the new image
+  targetSize: number;
+  imageUrl?: string;               // Full image, for devices with no patch
+  patches?: Record<string, string>; // sourceKey() of a running image -> patch URL
+  publishedAt?: number;
+};
+
+export type OtaDeviceState = 'idle' | 'downloading' | 'installed' | 'failed' | 'trial' | 'confirmed' | 'rolledBack';
+
+export type OtaDeviceStatus = {
+  state: OtaDeviceState;
+  running: string;   // FIRMWARE_VERSION of the running image
+  release?: string;  // Version the state refers to
+  error?: string;
+  received?: number; // Download bytes so far, while downloading
+  updatedAt?: number;
+};
+
+export function sha256Hex(image: Uint8Array): string {
+  return createHash('sha256').update(image).digest('hex');
+}
+
+// Key of a running image under /app/ota/release/patches
+export function sourceKey(image: Uint8Array): string {
+  return sha256Hex(image).slice(0, 16);
+}
+
+export function buildOtaRelease(
+  version: string,
+  target: Uint8Array,
+  patches: { source: Uint8Array; url: string }[],
+  imageUrl?: string,
+): OtaRelease {
+  const release: OtaRelease = { version, targetSha256: sha256Hex(target), targetSize: target.length };
+  if (imageUrl) release.imageUrl = imageUrl;
+  if (patches.length) {
+    release.patches = Object.fromEntries(patches.map(patch => [sourceKey(patch.source), patch.url]));
+  }
+  return release;
+}
+
+/**
+ * Picks the devices for a rollout stage: the same `percent` of `deviceIds` every time for
+ * one version, and a superset of them at any higher percent, so widening a rollout never
+ * drops a device that already has the update.
+ */
+export function rolloutStage(deviceIds: string[], version: string, percent: number): string[] {
+  const ranked = deviceIds
+    .map(id => ({ id, rank: createHash('sha256').update(`${version}/${id}`).digest('hex') }))
+    .sort((a, b) => (a.rank < b.rank ? -1 : a.rank > b.rank ? 1 : 0));
+  const count = Math.ceil((ranked.length * Math.min(Math.max(percent, 0), 100)) / 100);
+  return ranked.slice(0, count).map(entry => entry.id);
+}
+
+class ByteWriter {
+  private bytes = new Uint8Array(4096);
+  length = 0;
+
+  private reserve(extra: number) {
+    if (this.length + extra <= this.bytes.length) return;
+    let size = this.bytes.length * 2;
+    while (size < this.length + extra) size *= 2;
+    const grown = new Uint8Array(size);
+    grown.set(this.bytes.subarray(0, this.length));
+    this.bytes = grown;
+  }
+
+  byte(value: number) {
+    this.reserve(1);
+    this.bytes[this.length++] = value;
+  }
+
+  u32(value: number) {
+    for (let k = 0; k < 4; k++) this.byte((value >>> (8 * k)) & 0xff);
+  }
+
+  // LEB128; plain arithmetic, as offsets can exceed 31 bits once zigzagged
+  varint(value: number) {
+    while (value >= 0x80) {
+      this.byte((value % 0x80) | 0x80);
+      value = Math.floor(value / 0x80);
+    }
+    this.byte(value);
+  }
+
+  append(data: Uint8Array) {
+    this.reserve(data.length);
+    this.bytes.set(data, this.length);
+    this.length += data.length;
+  }
+
+  result(): Uint8Array {
+    return this.bytes.slice(0, this.length);
+  }
+}
+
+function blockHash(data: Uint8Array, at: number): number {
+  let h = 2166136261;
+  for (let k = 0; k < MATCH_BLOCK; k++) h = Math.imul(h ^ data[at + k], 16777619);
+  return h >>> (32 - HASH_BITS);
+}
+
+/**
+ * Encodes `target` as a patch against `source`, both complete .bin images. Layout, all
+ * fields little-endian. Must match the DELTA PATCHES section of docs/solaris_core.h.
+ *
+ *   header  0  u32    DELTA_PATCH_MAGIC
+ *           4  u32    source size
+ *           8  u8[32] SHA-256 of the source
+ *          40  u32    target size
+ *          44  u8[32] SHA-256 of the target
+ *          76  ops, until the target is complete
+ *
+ *   op      u8 1 (COPY), varint zigzag source offset from the end of the previous copy,
+ *              varint length
+ *           u8 2 (INSERT), varint length, then that many bytes
+ *
+ * A greedy matcher: at each target position it tries the source position right after the
+ * previous copy (the common case after an edit of the same size) and up to MAX_CHAIN
+ * earlier positions with the same MATCH_BLOCK hash, and copies the longest match.
+ */
+export function createDeltaPatch(source: Uint8Array, target: Uint8Array): Uint8Array {
+  if (target.length === 0) throw new Error('The target image is empty.');
+  const out = new ByteWriter();
+  out.u32(DELTA_PATCH_MAGIC);
+  out.u32(source.length);
+  out.append(createHash('sha256').update(source).digest());
+  out.u32(target.length);
+  out.append(createHash('sha256').update(target).digest());
+
+  const head = new Int32Array(1 << HASH_BITS).fill(-1);
+  const chain = new Int32Array(source.length).fill(-1);
+  for (let i = 0; i + MATCH_BLOCK <= source.length; i++) {
+    const h = blockHash(source, i);
+    chain[i] = head[h];
+    head[h] = i;
+  }
+
+  const matchLength = (from: number, at: number) => {
+    let n = 0;
+    while (from + n < source.length && at + n < target.length && source[from + n] === target[at + n]) n++;
+    return n;
+  };
+  const insert = (from: number, to: number) => {
+    if (to <= from) return;
+    out.byte(DELTA_OP_INSERT);
+    out.varint(to - from);
+    out.append(target.subarray(from, to));
+  };
+
+  let i = 0;
+  let literalStart = 0;
+  let cursor = 0;
+  while (i + MATCH_BLOCK <= target.length) {
+    let bestLength = 0;
+    let bestFrom = 0;
+    const guess = cursor + (i - literalStart);
+    if (guess < source.length) {
+      bestLength = matchLength(guess, i);
+      bestFrom = guess;
+    }
+    let candidate = head[blockHash(target, i)];
+    for (let steps = 0; candidate >= 0 && steps < MAX_CHAIN; steps++, candidate = chain[candidate]) {
+      const n = matchLength(candidate, i);
+      if (n > bestLength) {
+        bestLength = n;
+        bestFrom = candidate;
+      }
+    }
+    if (bestLength < MIN_COPY) {
+      i++;
+      continue;
+    }
+    // Take back any bytes of the pending INSERT that the match also covers
+    while (i > literalStart && bestFrom > 0 && source[bestFrom - 1] === target[i - 1]) {
+      i--;
+      bestFrom--;
+      bestLength++;
+    }
+    insert(literalStart, i);
+    const delta = bestFrom - cursor;
+    out.byte(DELTA_OP_COPY);
+    out.varint(delta >= 0 ? delta * 2 : -delta * 2 - 1);
+    out.varint(bestLength);
+    cursor = bestFrom + bestLength;
+    i += bestLength;
+    literalStart = i;
+  }
+  insert(literalStart, target.length);
+  return out.result();
+}
@@ -0,0 +1,149 @@
+/**
+ * Decoding for the compact telemetry formats sent by the ESP32 firmware (docs/firmware.cpp).
+ *
+ * A batch carries many readings in one request. Every value is sent as an integer
+ * (`value * scale`), the first row is absolute and each later row holds the difference
+ * from the row before it, so a steady load compresses to runs of zeros.
+ *
+ * Live batches are stamped with device millis and placed relative to `sentAt`. Batches
+ * replayed from the device's offline journal are sent with `clock: 'unix'` instead: their
+ * `t` column is Unix milliseconds taken on the device, so readings recorded hours earlier
+ * (or before a reboot) land at the time they were measured rather than the time they
+ * arrived.
+ */
+
+export const TELEMETRY_BATCH_VERSION = 1;
+
+export type TelemetryBatch = {
+  batch: number;     // Format version, TELEMETRY_BATCH_VERSION
+  fields: string[];  // Column names, e.g. ["voltage", "current", ...]
+  scale: number[];   // Divisor per column to turn the integer back into a reading
+  t: number[];       // Time per row (see `clock`): first absolute, later rows as deltas
+  d: number[];       // Row-major integers: first row absolute, later rows as deltas
+  clock?: 'unix';    // Set when `t` is Unix ms; otherwise `t` is device millis
+  sentAt?: number;   // Device millis when the batch was sent, required for device millis
+};
+
+export type EnergyDataEntry = Record<string, number | string>;
+
+export function isTelemetryBatch(body: any): body is TelemetryBatch {
+  return !!body && typeof body === 'object' && typeof body.batch === 'number';
+}
+
+const isIntegerArray = (value: unknown): value is number[] =>
+  Array.isArray(value) && value.every(n => Number.isInteger(n));
+
+/**
+ * Expands a batch back into one entry per reading. Device millis are mapped to wall-clock
+ * time relative to `receivedAt`, so readings keep the order and spacing they were taken in;
+ * Unix timestamps are used as sent.
+ */
+export function decodeTelemetryBatch(batch: TelemetryBatch, receivedAt: number): EnergyDataEntry[] {
+  if (batch.batch !== TELEMETRY_BATCH_VERSION) {
+    throw new Error(`Unsupported telemetry batch version ${batch.batch}.`);
+  }
+  const { fields, scale, t, d, clock, sentAt } = batch;
+  if (!Array.isArray(fields) || !fields.every(f => typeof f === 'string') || fields.length === 0) {
+    throw new Error('Telemetry batch has no fields.');
+  }
+  if (!isIntegerArray(scale) || scale.length !== fields.length || scale.some(s => s <= 0)) {
+    throw new Error('Telemetry batch scale does not match its fields.');
+  }
+  if (!isIntegerArray(t) || !isIntegerArray(d) || d.length !== t.length * fields.length) {
+    throw new Error('Telemetry batch rows do not match its fields.');
+  }
+  if (clock !== undefined && clock !== 'unix') {
+    throw new Error(`Unsupported telemetry batch clock ${clock}.`);
+  }
+  if (clock === undefined && !Number.isInteger(sentAt)) {
+    throw new Error('Telemetry batch is missing sentAt.');
+  }
+
+  const entries: EnergyDataEntry[] = [];
+  const row = new Array<number>(fields.length).fill(0);
+  let takenAt = 0;
+
+  for (let r = 0; r < t.length; r++) {
+    takenAt += t[r];
+    const entry: EnergyDataEntry = {};
+    for (let f = 0; f < fields.length; f++) {
+      row[f] += d[r * fields.length + f];
+      entry[fields[f]] = row[f] / scale[f];
+    }
+    const time = clock === 'unix' ? takenAt : receivedAt - (sentAt! - takenAt);
+    entry.timestamp = new Date(time).toISOString();
+    entries.push(entry);
+  }
+  return entries;
+}
+
+/**
+ * Fixed-layout binary record sent with `Content-Type: application/octet-stream`, one reading
+ * per request, by devices still running the former standalone example sketch. Current
+ * firmware, PROFILE_BASIC included, sends batches. All fields are little-endian.
+ *
+ *   0  u8   version (TELEMETRY_RECORD_VERSION)
+ *   1  u8   flags (RECORD_FLAG_*)
+ *   2  u16  reserved
+ *   4  u32  sequence number, increments per reading
+ *   8  u32  Unix seconds when taken, 0 if the device clock was not set
+ *  12  u32  device millis when taken
+ *  16  i32  power, W x10
+ *  20  i32  current, A x1000
+ *  24  u16  voltage, V x10
+ *  26  i16  temperature, C x10
+ *  28  u16  humidity, % x10
+ *  30  u16  ldr
+ *  32  u16  batteryLevel, % x10
+ *  34  u16  reserved
+ */
+export const TELEMETRY_RECORD_VERSION = 1;
+export const TELEMETRY_RECORD_SIZE = 36;
+
+const RECORD_FLAG_LDR = 1 << 0;
+const RECORD_FLAG_BATTERY = 1 << 1;
+
+export function decodeTelemetryRecord(buffer: ArrayBuffer, receivedAt: number): EnergyDataEntry {
+  if (buffer.byteLength !== TELEMETRY_RECORD_SIZE) {
+    throw new Error(`Telemetry record must be ${TELEMETRY_RECORD_SIZE} bytes, got ${buffer.byteLength}.`);
+  }
+  const view = new DataView(buffer);
+  const version = view.getUint8(0);
+  if (version !== TELEMETRY_RECORD_VERSION) {
+    throw new Error(`Unsupported telemetry record version ${version}.`);
+  }
+  const flags = view.getUint8(1);
+  const unixTime = view.getUint32(8, true);
+
+  const entry: EnergyDataEntry = {
+    seq: view.getUint32(4, true),
+    power: view.getInt32(16, true) / 10,
+    current: view.getInt32(20, true) / 1000,
+    voltage: view.getUint16(24, true) / 10,
+    temperature: view.getInt16(26, true) / 10,
+    humidity: view.getUint16(28, true) / 10,
+  };
+  if (flags & RECORD_FLAG_LDR) entry.ldr = view.getUint16(30, true);
+  if (flags & RECORD_FLAG_BATTERY) entry.batteryLevel = view.getUint16(32, true) / 10;
+  entry.timestamp = new Date(unixTime ? unixTime * 1000 : receivedAt).toISOString();
+  return entry;
+}
+
+const PUSH_CHARS = '-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz';
+
+/**
+ * Generates a key in the same format as the Realtime Database's push(), so entries
+ * written in one multi-path update still sort chronologically by key.
+ */
+export function createPushId(timeMs: number): string {
+  let time = timeMs;
+  let id = '';
+  for (let i = 0; i < 8; i++) {
+    id = PUSH_CHARS.charAt(time % 64) + id;
+    time = Math.floor(time / 64);
+  }
+  for (let i = 0; i < 12; i++) {
+    id += PUSH_CHARS.charAt(Math.floor(Math.random() * 64));
+  }
+  return id;
+}
@@ -15,6 +15,21 @@ export type SwitchState = {
   state: boolean;
 };
 
+// Next-hour consumption forecast made on the device, sent with every telemetry reading
+export type DeviceForecast = {
+  nextHourKwh: number;
+  bandKwh: number; // Half-width of the ~95 % band
+};
+
+// The device's acknowledgement of a switch command, written under app/switchAcks/<id>
+export type SwitchAck = {
+  seq: number;
+  state: boolean;           // DB state the relay was driven to
+  appliedAt?: number;       // Unix ms the relay was driven, once the device clock is set
+  ackedAt?: number;         // Server time the acknowledgement was written
+  deviceLatencyUs?: number; // Command receipt to relay write, on the device
+};
+
 export type HistoricalDataPoint = {
   time: string;
   consumption: number;